@@ -0,0 +1,1123 @@
+#define _POSIX_C_SOURCE 200809L    // NOLINT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Starts the server on a generated root directory, loads it from several
+// threads and prints the request rate, throughput and latency percentiles as
+// JSON. Closed loop keeps every connection busy, open loop sends at a
+// constant rate and measures each request from when it was due, so a stalled
+// server shows up in the tail instead of slowing the load down.
+
+#define DEFAULT_MIX "1024:60,16384:30,1048576:10"
+#define LOOPBACK "127.0.0.1"
+#define CONTENT_LENGTH "content-length:"
+#define HEADER_END "\r\n\r\n"
+
+enum
+{
+    DEFAULT_PORT          = 18080,
+    DEFAULT_THREADS       = 2,
+    DEFAULT_CONNECTIONS   = 64,
+    DEFAULT_DURATION      = 10,
+    DEFAULT_WARMUP        = 2,
+    DEFAULT_FILES         = 8,    // per size in the mix
+    DEFAULT_SEED          = 1,
+    MAX_MIX_ENTRIES       = 16,
+    MAX_THREADS           = 256,
+    MAX_CONNECTIONS       = 65536,
+    MAX_FILES             = 1024,
+    MAX_SERVER_ARGUMENTS  = 64,
+    NUMBER_BASE           = 10,
+    NANOSECONDS           = 1000000000,
+    NS_PER_MS             = 1000000,
+    NS_PER_US             = 1000,
+    STARTUP_ATTEMPTS      = 500,
+    STARTUP_RETRY_NS      = 10000000,
+    CLOSED_LOOP_POLL_MS   = 100,
+    REQUEST_CAPACITY      = 256,
+    HEADER_CAPACITY       = 4096,
+    READ_BUFFER_SIZE      = 65536,
+    WRITE_CHUNK_SIZE      = 65536,
+    PENDING_CAPACITY      = 65536,    // open loop arrivals waiting for a connection, per thread
+    INITIAL_SAMPLES       = 65536,
+    HTTP_OK               = 200,
+    STATUS_CODE_OFFSET    = 9,    // "HTTP/1.1 200"
+    PERMILLE              = 1000,
+    P50                   = 500,
+    P99                   = 990,
+    P999                  = 999,
+};
+
+struct mix_entry
+{
+    size_t   size;
+    unsigned weight;
+};
+
+struct bench_config
+{
+    const char      *server;
+    char           **server_arguments;    // after "--" on the command line
+    int              num_server_arguments;
+    in_port_t        port;
+    unsigned         num_threads;
+    unsigned         num_connections;    // across all threads
+    unsigned         duration;
+    unsigned         warmup;
+    uint64_t         rate;    // requests per second, 0 runs a closed loop
+    bool             one_shot;    // a new connection for every request
+    unsigned         files_per_size;
+    uint64_t         seed;
+    const char      *mix_text;
+    struct mix_entry mix[MAX_MIX_ENTRIES];
+    size_t           mix_length;
+    unsigned         total_weight;
+    char             root[sizeof("/tmp/load_bench.XXXXXX")];
+};
+
+enum connection_state
+{
+    CONNECTION_CLOSED,
+    CONNECTION_IDLE,    // keep-alive, between requests
+    CONNECTION_CONNECTING,
+    CONNECTION_SENDING,
+    CONNECTION_READING,
+};
+
+struct connection
+{
+    int                   fd;
+    enum connection_state state;
+    uint64_t              due_ns;    // when the request was meant to go out
+    char                  request[REQUEST_CAPACITY];
+    size_t                request_length;
+    size_t                request_sent;
+    char                  header[HEADER_CAPACITY];
+    size_t                header_length;
+    bool                  header_done;
+    int                   status;
+    uint64_t              body_remaining;
+    uint64_t              bytes;    // of the response, headers included
+};
+
+struct worker
+{
+    const struct bench_config *config;
+    pthread_t                  thread;
+    unsigned                   index;
+    struct connection         *connections;
+    unsigned                   num_connections;
+    struct pollfd             *poll_fds;
+    struct connection        **polled;
+    uint64_t                   random_state;
+
+    uint64_t  record_start_ns;    // requests due before this are warmup
+    uint64_t  end_ns;
+    uint64_t  next_arrival_ns;
+    uint64_t  arrival_interval_ns;
+    uint64_t *pending;    // ring of due times
+    size_t    pending_head;
+    size_t    pending_length;
+
+    uint64_t *samples;    // latency in ns of every recorded request
+    size_t    num_samples;
+    size_t    samples_capacity;
+    uint64_t  bytes;
+    uint64_t  errors;
+    uint64_t  dropped;
+};
+
+static volatile sig_atomic_t running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NANOSECONDS) + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*, seeded per thread so every run makes the same choices
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+__attribute__((noreturn)) static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s -s <server> [-p <port>] [-t <threads>] [-c <connections>] [-d <seconds>] [-w <seconds>] [-r <requests/s>] [-m <size:weight,...>] [-F <files>] [-S <seed>] [-o] [-h] [-- <server options>]\n", program);
+    fputs("\nOptions:\n", stderr);
+    fputs("  -s <path>   Server executable, started on a generated root directory (Required)\n", stderr);
+    fputs("  -p <port>   Port for the server to listen on (Default: 18080)\n", stderr);
+    fputs("  -t <n>      Load generator threads (Default: 2)\n", stderr);
+    fputs("  -c <n>      Connections across all threads (Default: 64)\n", stderr);
+    fputs("  -d <secs>   Measured duration (Default: 10)\n", stderr);
+    fputs("  -w <secs>   Warmup before measuring (Default: 2)\n", stderr);
+    fputs("  -r <n>      Open loop at this many requests per second, 0 keeps every connection busy instead (Default: 0)\n", stderr);
+    fputs("  -m <mix>    File sizes in bytes and how often each is requested (Default: " DEFAULT_MIX ")\n", stderr);
+    fputs("  -F <n>      Files generated per size (Default: 8)\n", stderr);
+    fputs("  -S <n>      Seed for file contents and request order (Default: 1)\n", stderr);
+    fputs("  -o          One request per connection instead of keep-alive\n", stderr);
+    fputs("  -h          Display this help and exit\n", stderr);
+    fputs("\nServer options after -- are passed on, after -p, -f and -L error.\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+static bool parse_number(const char *text, uint64_t min, uint64_t max, uint64_t *number)
+{
+    char              *end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(text, &end, NUMBER_BASE);
+    if(errno != 0 || end == text || *end != '\0' || value < min || value > max)
+    {
+        return false;
+    }
+    *number = value;
+    return true;
+}
+
+// "size:weight,size:weight", sizes in bytes
+static bool parse_mix(struct bench_config *config)
+{
+    const char *position = config->mix_text;
+
+    config->mix_length   = 0;
+    config->total_weight = 0;
+    while(*position != '\0')
+    {
+        char              *end;
+        unsigned long long size;
+        unsigned long      weight;
+
+        if(config->mix_length == MAX_MIX_ENTRIES)
+        {
+            return false;
+        }
+        errno = 0;
+        size  = strtoull(position, &end, NUMBER_BASE);
+        if(errno != 0 || end == position || *end != ':')
+        {
+            return false;
+        }
+        position = end + 1;
+        weight   = strtoul(position, &end, NUMBER_BASE);
+        if(errno != 0 || end == position || weight == 0 || weight > UINT16_MAX || (*end != ',' && *end != '\0'))
+        {
+            return false;
+        }
+        config->mix[config->mix_length].size   = (size_t)size;
+        config->mix[config->mix_length].weight = (unsigned)weight;
+        config->mix_length++;
+        config->total_weight += (unsigned)weight;
+        position = *end == ',' ? end + 1 : end;
+    }
+    return config->mix_length > 0;
+}
+
+static void parse_arguments(int argc, char *argv[], struct bench_config *config)
+{
+    int      opt;
+    uint64_t number;
+
+    memset(config, 0, sizeof(*config));
+    config->port            = DEFAULT_PORT;
+    config->num_threads     = DEFAULT_THREADS;
+    config->num_connections = DEFAULT_CONNECTIONS;
+    config->duration        = DEFAULT_DURATION;
+    config->warmup          = DEFAULT_WARMUP;
+    config->files_per_size  = DEFAULT_FILES;
+    config->seed            = DEFAULT_SEED;
+    config->mix_text        = DEFAULT_MIX;
+
+    while((opt = getopt(argc, argv, ":s:p:t:c:d:w:r:m:F:S:oh")) != -1)
+    {
+        bool valid = true;
+
+        switch(opt)
+        {
+            case 's':
+                config->server = optarg;
+                break;
+            case 'p':
+                valid        = parse_number(optarg, 1, UINT16_MAX, &number);
+                config->port = (in_port_t)number;
+                break;
+            case 't':
+                valid               = parse_number(optarg, 1, MAX_THREADS, &number);
+                config->num_threads = (unsigned)number;
+                break;
+            case 'c':
+                valid                   = parse_number(optarg, 1, MAX_CONNECTIONS, &number);
+                config->num_connections = (unsigned)number;
+                break;
+            case 'd':
+                valid            = parse_number(optarg, 1, UINT16_MAX, &number);
+                config->duration = (unsigned)number;
+                break;
+            case 'w':
+                valid          = parse_number(optarg, 0, UINT16_MAX, &number);
+                config->warmup = (unsigned)number;
+                break;
+            case 'r':
+                valid = parse_number(optarg, 0, NANOSECONDS, &config->rate);
+                break;
+            case 'm':
+                config->mix_text = optarg;
+                break;
+            case 'F':
+                valid                  = parse_number(optarg, 1, MAX_FILES, &number);
+                config->files_per_size = (unsigned)number;
+                break;
+            case 'S':
+                valid = parse_number(optarg, 0, UINT64_MAX, &config->seed);
+                break;
+            case 'o':
+                config->one_shot = true;
+                break;
+            case ':':
+                fprintf(stderr, "Error: Option '-%c' requires an argument.\n", optopt);
+                print_usage(argv[0]);
+            case 'h':
+            default:
+                print_usage(argv[0]);
+        }
+        if(!valid)
+        {
+            fprintf(stderr, "Error: Invalid value '%s' for '-%c'.\n", optarg, opt);
+            print_usage(argv[0]);
+        }
+    }
+
+    if(config->server == NULL)
+    {
+        fputs("Error: The server executable (-s) is required.\n", stderr);
+        print_usage(argv[0]);
+    }
+    if(!parse_mix(config))
+    {
+        fprintf(stderr, "Error: Invalid file mix '%s'.\n", config->mix_text);
+        print_usage(argv[0]);
+    }
+    if(config->num_connections < config->num_threads)
+    {
+        fputs("Error: Every thread needs at least one connection.\n", stderr);
+        print_usage(argv[0]);
+    }
+    if(argc - optind > MAX_SERVER_ARGUMENTS)
+    {
+        fputs("Error: Too many server options.\n", stderr);
+        print_usage(argv[0]);
+    }
+    config->server_arguments     = argv + optind;
+    config->num_server_arguments = argc - optind;
+}
+
+static void file_name(char *name, size_t capacity, const struct bench_config *config, size_t size_index, unsigned file_index)
+{
+    snprintf(name, capacity, "%s/f%zu_%u.bin", config->root, config->mix[size_index].size, file_index);
+}
+
+static void remove_root(const struct bench_config *config)
+{
+    char path[sizeof(config->root) + NAME_MAX];
+
+    for(size_t i = 0; i < config->mix_length; i++)
+    {
+        for(unsigned j = 0; j < config->files_per_size; j++)
+        {
+            file_name(path, sizeof(path), config, i, j);
+            unlink(path);
+        }
+    }
+    rmdir(config->root);
+}
+
+// Fills the root with files_per_size files of every size in the mix, the same bytes for the same seed
+static int generate_root(struct bench_config *config)
+{
+    uint64_t       random_state = config->seed | 1;
+    unsigned char *chunk        = malloc(WRITE_CHUNK_SIZE);
+
+    if(chunk == NULL)
+    {
+        return -1;
+    }
+    strcpy(config->root, "/tmp/load_bench.XXXXXX");
+    if(mkdtemp(config->root) == NULL)
+    {
+        free(chunk);
+        return -1;
+    }
+
+    for(size_t i = 0; i < config->mix_length; i++)
+    {
+        for(unsigned j = 0; j < config->files_per_size; j++)
+        {
+            char   path[sizeof(config->root) + NAME_MAX];
+            size_t remaining = config->mix[i].size;
+            FILE  *file;
+
+            file_name(path, sizeof(path), config, i, j);
+            file = fopen(path, "wb");
+            if(file == NULL)
+            {
+                free(chunk);
+                remove_root(config);
+                return -1;
+            }
+            while(remaining > 0)
+            {
+                const size_t length = remaining < WRITE_CHUNK_SIZE ? remaining : WRITE_CHUNK_SIZE;
+
+                for(size_t k = 0; k < length; k += sizeof(uint64_t))
+                {
+                    const uint64_t word = next_random(&random_state);
+
+                    memcpy(chunk + k, &word, length - k < sizeof(word) ? length - k : sizeof(word));
+                }
+                if(fwrite(chunk, 1, length, file) != length)
+                {
+                    break;
+                }
+                remaining -= length;
+            }
+            if(fclose(file) != 0 || remaining > 0)
+            {
+                free(chunk);
+                remove_root(config);
+                return -1;
+            }
+        }
+    }
+    free(chunk);
+    return 0;
+}
+
+static struct sockaddr_in server_address(const struct bench_config *config)
+{
+    struct sockaddr_in address;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port   = htons(config->port);
+    inet_pton(AF_INET, LOOPBACK, &address.sin_addr);
+    return address;
+}
+
+// Polls the port until the server accepts, the server quitting early is a failure
+static bool wait_for_server(const struct bench_config *config, pid_t server)
+{
+    const struct sockaddr_in address = server_address(config);
+    const struct timespec    retry   = {0, STARTUP_RETRY_NS};
+
+    for(int attempt = 0; attempt < STARTUP_ATTEMPTS; attempt++)
+    {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int       result;
+
+        if(fd == -1)
+        {
+            return false;
+        }
+        result = connect(fd, (const struct sockaddr *)&address, sizeof(address));
+        close(fd);
+        if(result == 0)
+        {
+            return true;
+        }
+        if(waitpid(server, NULL, WNOHANG) == server)
+        {
+            return false;
+        }
+        nanosleep(&retry, NULL);
+    }
+    return false;
+}
+
+// Runs "server -p port -f root -L error [options]" with its output discarded
+static pid_t start_server(const struct bench_config *config)
+{
+    char  port[sizeof("65535")];
+    char *arguments[MAX_SERVER_ARGUMENTS + 8];
+    int   count = 0;
+    pid_t pid;
+
+    snprintf(port, sizeof(port), "%u", (unsigned)config->port);
+    arguments[count++] = (char *)(uintptr_t)config->server;
+    arguments[count++] = (char *)(uintptr_t) "-p";
+    arguments[count++] = port;
+    arguments[count++] = (char *)(uintptr_t) "-f";
+    arguments[count++] = (char *)(uintptr_t)config->root;
+    arguments[count++] = (char *)(uintptr_t) "-L";
+    arguments[count++] = (char *)(uintptr_t) "error";
+    for(int i = 0; i < config->num_server_arguments; i++)
+    {
+        arguments[count++] = config->server_arguments[i];
+    }
+    arguments[count] = NULL;
+
+    pid = fork();
+    if(pid == 0)
+    {
+        const int null_fd = open("/dev/null", O_WRONLY);
+
+        if(null_fd != -1)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        execv(config->server, arguments);
+        perror("execv");
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+static void stop_server(pid_t server)
+{
+    kill(server, SIGINT);
+    waitpid(server, NULL, 0);
+}
+
+static bool record_sample(struct worker *worker, uint64_t latency_ns)
+{
+    if(worker->num_samples == worker->samples_capacity)
+    {
+        const size_t capacity = worker->samples_capacity == 0 ? INITIAL_SAMPLES : worker->samples_capacity * 2;
+        uint64_t    *samples  = realloc(worker->samples, capacity * sizeof(uint64_t));
+
+        if(samples == NULL)
+        {
+            return false;
+        }
+        worker->samples          = samples;
+        worker->samples_capacity = capacity;
+    }
+    worker->samples[worker->num_samples++] = latency_ns;
+    return true;
+}
+
+static void close_connection(struct connection *connection)
+{
+    if(connection->fd != -1)
+    {
+        close(connection->fd);
+    }
+    connection->fd    = -1;
+    connection->state = CONNECTION_CLOSED;
+}
+
+static void fail_request(struct worker *worker, struct connection *connection)
+{
+    if(connection->due_ns >= worker->record_start_ns)
+    {
+        worker->errors++;
+    }
+    close_connection(connection);
+}
+
+// Picks a size by weight, then one of its files
+static void prepare_request(struct worker *worker, struct connection *connection)
+{
+    const struct bench_config *config = worker->config;
+    unsigned                   pick   = (unsigned)(next_random(&worker->random_state) % config->total_weight);
+    const unsigned             file   = (unsigned)(next_random(&worker->random_state) % config->files_per_size);
+    size_t                     size_index = 0;
+    int                        length;
+
+    while(pick >= config->mix[size_index].weight)
+    {
+        pick -= config->mix[size_index].weight;
+        size_index++;
+    }
+    length = snprintf(connection->request,
+                      sizeof(connection->request),
+                      "GET /f%zu_%u.bin HTTP/1.1\r\n"
+                      "Host: " LOOPBACK "\r\n"
+                      "%s"
+                      "\r\n",
+                      config->mix[size_index].size,
+                      file,
+                      config->one_shot ? "Connection: close\r\n" : "");
+    connection->request_length = (size_t)length;
+    connection->request_sent   = 0;
+    connection->header_length  = 0;
+    connection->header_done    = false;
+    connection->status         = 0;
+    connection->body_remaining = 0;
+    connection->bytes          = 0;
+}
+
+// A closed connection connects first, the request goes out once it is writable
+static void start_request(struct worker *worker, struct connection *connection, uint64_t due_ns)
+{
+    connection->due_ns = due_ns;
+    prepare_request(worker, connection);
+
+    if(connection->state == CONNECTION_IDLE)
+    {
+        connection->state = CONNECTION_SENDING;
+        return;
+    }
+
+    {
+        const struct sockaddr_in address = server_address(worker->config);
+        const int                no_delay = 1;
+
+        connection->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(connection->fd == -1 || fcntl(connection->fd, F_SETFL, O_NONBLOCK) == -1)
+        {
+            fail_request(worker, connection);
+            return;
+        }
+        setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        if(connect(connection->fd, (const struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            connection->state = CONNECTION_SENDING;
+        }
+        else if(errno == EINPROGRESS)
+        {
+            connection->state = CONNECTION_CONNECTING;
+        }
+        else
+        {
+            fail_request(worker, connection);
+        }
+    }
+}
+
+static void finish_request(struct worker *worker, struct connection *connection)
+{
+    const uint64_t now = now_ns();
+
+    if(connection->due_ns >= worker->record_start_ns && now < worker->end_ns)
+    {
+        if(connection->status != HTTP_OK || !record_sample(worker, now - connection->due_ns))
+        {
+            worker->errors++;
+        }
+        else
+        {
+            worker->bytes += connection->bytes;
+        }
+    }
+
+    if(worker->config->one_shot)
+    {
+        close_connection(connection);
+    }
+    else
+    {
+        connection->state = CONNECTION_IDLE;
+    }
+}
+
+// Takes the status and Content-Length from the header once it is complete
+static bool parse_response_header(struct connection *connection, size_t *body_start)
+{
+    const char *end;
+    const char *line;
+
+    connection->header[connection->header_length] = '\0';
+    end                                           = strstr(connection->header, HEADER_END);
+    if(end == NULL)
+    {
+        return false;
+    }
+    *body_start             = (size_t)(end - connection->header) + sizeof(HEADER_END) - 1;
+    connection->header_done = true;
+    if(connection->header_length > STATUS_CODE_OFFSET)
+    {
+        connection->status = atoi(connection->header + STATUS_CODE_OFFSET);
+    }
+
+    line = connection->header;
+    while(line < end)
+    {
+        line = strstr(line, "\r\n");
+        if(line == NULL || line >= end)
+        {
+            break;
+        }
+        line += 2;
+        if(strncasecmp(line, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1) == 0)
+        {
+            connection->body_remaining = strtoull(line + sizeof(CONTENT_LENGTH) - 1, NULL, NUMBER_BASE);
+        }
+    }
+    return true;
+}
+
+static void read_response(struct worker *worker, struct connection *connection, char *buffer)
+{
+    while(true)
+    {
+        const ssize_t received = recv(connection->fd, buffer, READ_BUFFER_SIZE, 0);
+        size_t        body_bytes;
+
+        if(received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(received == -1 && errno == EAGAIN)
+        {
+            return;
+        }
+        if(received <= 0)
+        {
+            fail_request(worker, connection);
+            return;
+        }
+        connection->bytes += (uint64_t)received;
+        body_bytes = (size_t)received;
+
+        if(!connection->header_done)
+        {
+            const size_t room  = HEADER_CAPACITY - 1 - connection->header_length;
+            const size_t taken = (size_t)received < room ? (size_t)received : room;
+            size_t       body_start;
+
+            memcpy(connection->header + connection->header_length, buffer, taken);
+            connection->header_length += taken;
+            if(!parse_response_header(connection, &body_start))
+            {
+                if(connection->header_length == HEADER_CAPACITY - 1)
+                {
+                    fail_request(worker, connection);
+                    return;
+                }
+                continue;
+            }
+            // what followed the header in this read is body
+            body_bytes = connection->header_length - body_start + ((size_t)received - taken);
+        }
+
+        if(body_bytes > connection->body_remaining)
+        {
+            fail_request(worker, connection);
+            return;
+        }
+        connection->body_remaining -= body_bytes;
+        if(connection->body_remaining == 0)
+        {
+            finish_request(worker, connection);
+            return;
+        }
+    }
+}
+
+static void send_request(struct worker *worker, struct connection *connection)
+{
+    while(connection->request_sent < connection->request_length)
+    {
+        const ssize_t sent = send(connection->fd, connection->request + connection->request_sent, connection->request_length - connection->request_sent, MSG_NOSIGNAL);
+
+        if(sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent == -1 && errno == EAGAIN)
+        {
+            return;
+        }
+        if(sent == -1)
+        {
+            fail_request(worker, connection);
+            return;
+        }
+        connection->request_sent += (size_t)sent;
+    }
+    connection->state = CONNECTION_READING;
+}
+
+static void handle_connect(struct worker *worker, struct connection *connection)
+{
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+
+    if(getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+    {
+        fail_request(worker, connection);
+        return;
+    }
+    connection->state = CONNECTION_SENDING;
+    send_request(worker, connection);
+}
+
+// Open loop arrivals due by now wait in the ring until a connection is free
+static void schedule_arrivals(struct worker *worker, uint64_t now)
+{
+    while(worker->next_arrival_ns <= now)
+    {
+        if(worker->pending_length == PENDING_CAPACITY)
+        {
+            if(worker->next_arrival_ns >= worker->record_start_ns)
+            {
+                worker->dropped++;
+            }
+        }
+        else
+        {
+            worker->pending[(worker->pending_head + worker->pending_length) % PENDING_CAPACITY] = worker->next_arrival_ns;
+            worker->pending_length++;
+        }
+        worker->next_arrival_ns += worker->arrival_interval_ns;
+    }
+}
+
+// Hands a request to every connection that has none
+static void dispatch(struct worker *worker, uint64_t now)
+{
+    for(unsigned i = 0; i < worker->num_connections; i++)
+    {
+        struct connection *connection = &worker->connections[i];
+        uint64_t           due_ns     = now;
+
+        if(connection->state != CONNECTION_CLOSED && connection->state != CONNECTION_IDLE)
+        {
+            continue;
+        }
+        if(worker->config->rate > 0)
+        {
+            if(worker->pending_length == 0)
+            {
+                return;
+            }
+            due_ns               = worker->pending[worker->pending_head];
+            worker->pending_head = (worker->pending_head + 1) % PENDING_CAPACITY;
+            worker->pending_length--;
+        }
+        start_request(worker, connection, due_ns);
+        if(connection->state == CONNECTION_SENDING)
+        {
+            send_request(worker, connection);
+        }
+    }
+}
+
+static int poll_timeout(const struct worker *worker, uint64_t now)
+{
+    uint64_t wait_ns = (uint64_t)CLOSED_LOOP_POLL_MS * NS_PER_MS;
+
+    if(worker->config->rate > 0 && worker->next_arrival_ns < now + wait_ns)
+    {
+        wait_ns = worker->next_arrival_ns > now ? worker->next_arrival_ns - now : 0;
+    }
+    if(now + wait_ns > worker->end_ns)
+    {
+        wait_ns = worker->end_ns - now;
+    }
+    return (int)((wait_ns + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    char          *buffer = malloc(READ_BUFFER_SIZE);
+
+    if(buffer == NULL)
+    {
+        return NULL;
+    }
+
+    while(running)
+    {
+        uint64_t now = now_ns();
+        nfds_t   num_polled = 0;
+        int      ready;
+
+        if(now >= worker->end_ns)
+        {
+            break;
+        }
+        if(worker->config->rate > 0)
+        {
+            schedule_arrivals(worker, now);
+        }
+        dispatch(worker, now);
+
+        for(unsigned i = 0; i < worker->num_connections; i++)
+        {
+            struct connection *connection = &worker->connections[i];
+
+            if(connection->state == CONNECTION_CLOSED)
+            {
+                continue;
+            }
+            // idle connections are watched for the server closing them
+            worker->poll_fds[num_polled].fd      = connection->fd;
+            worker->poll_fds[num_polled].events  = connection->state == CONNECTION_READING ? POLLIN : connection->state == CONNECTION_IDLE ? 0 : POLLOUT;
+            worker->poll_fds[num_polled].revents = 0;
+            worker->polled[num_polled]           = connection;
+            num_polled++;
+        }
+
+        ready = poll(worker->poll_fds, num_polled, poll_timeout(worker, now_ns()));
+        if(ready == -1 && errno != EINTR)
+        {
+            break;
+        }
+
+        for(nfds_t i = 0; ready > 0 && i < num_polled; i++)
+        {
+            struct connection *connection = worker->polled[i];
+            const short        revents    = worker->poll_fds[i].revents;
+
+            if(revents == 0)
+            {
+                continue;
+            }
+            switch(connection->state)
+            {
+                case CONNECTION_IDLE:
+                    close_connection(connection);
+                    break;
+                case CONNECTION_CONNECTING:
+                    handle_connect(worker, connection);
+                    break;
+                case CONNECTION_SENDING:
+                    send_request(worker, connection);
+                    break;
+                case CONNECTION_READING:
+                    read_response(worker, connection, buffer);
+                    break;
+                case CONNECTION_CLOSED:
+                default:
+                    break;
+            }
+        }
+    }
+
+    for(unsigned i = 0; i < worker->num_connections; i++)
+    {
+        close_connection(&worker->connections[i]);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int init_worker(struct worker *worker, const struct bench_config *config, unsigned index, uint64_t start_ns)
+{
+    memset(worker, 0, sizeof(*worker));
+    worker->config          = config;
+    worker->index           = index;
+    worker->num_connections = config->num_connections / config->num_threads + (index < config->num_connections % config->num_threads ? 1 : 0);
+    worker->random_state    = (config->seed + index + 1) * 0x9E3779B97F4A7C15ULL;
+    worker->record_start_ns = start_ns + ((uint64_t)config->warmup * NANOSECONDS);
+    worker->end_ns          = worker->record_start_ns + ((uint64_t)config->duration * NANOSECONDS);
+
+    // the threads share the rate, their arrivals interleaved rather than in step
+    if(config->rate > 0)
+    {
+        worker->arrival_interval_ns = (uint64_t)NANOSECONDS * config->num_threads / config->rate;
+        worker->next_arrival_ns     = start_ns + (worker->arrival_interval_ns * index / config->num_threads);
+        worker->pending             = malloc(PENDING_CAPACITY * sizeof(uint64_t));
+        if(worker->pending == NULL)
+        {
+            return -1;
+        }
+    }
+
+    worker->connections = calloc(worker->num_connections, sizeof(struct connection));
+    worker->poll_fds    = calloc(worker->num_connections, sizeof(struct pollfd));
+    worker->polled      = calloc(worker->num_connections, sizeof(struct connection *));
+    if(worker->connections == NULL || worker->poll_fds == NULL || worker->polled == NULL)
+    {
+        return -1;
+    }
+    for(unsigned i = 0; i < worker->num_connections; i++)
+    {
+        worker->connections[i].fd = -1;
+    }
+    return 0;
+}
+
+static void destroy_worker(struct worker *worker)
+{
+    free(worker->connections);
+    free(worker->poll_fds);
+    free(worker->polled);
+    free(worker->pending);
+    free(worker->samples);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    const uint64_t left  = *(const uint64_t *)a;
+    const uint64_t right = *(const uint64_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+// Nearest rank, samples sorted
+static double percentile_us(const uint64_t *samples, size_t count, unsigned permille)
+{
+    size_t rank;
+
+    if(count == 0)
+    {
+        return 0;
+    }
+    rank = ((count * permille) + PERMILLE - 1) / PERMILLE;
+    return (double)samples[rank == 0 ? 0 : rank - 1] / NS_PER_US;
+}
+
+static int report(const struct bench_config *config, struct worker *workers)
+{
+    size_t    num_samples = 0;
+    uint64_t  bytes       = 0;
+    uint64_t  errors      = 0;
+    uint64_t  dropped     = 0;
+    double    total_ns    = 0;
+    uint64_t *samples;
+    size_t    filled = 0;
+
+    for(unsigned i = 0; i < config->num_threads; i++)
+    {
+        num_samples += workers[i].num_samples;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        dropped += workers[i].dropped;
+    }
+    samples = malloc((num_samples == 0 ? 1 : num_samples) * sizeof(uint64_t));
+    if(samples == NULL)
+    {
+        return -1;
+    }
+    for(unsigned i = 0; i < config->num_threads; i++)
+    {
+        memcpy(samples + filled, workers[i].samples, workers[i].num_samples * sizeof(uint64_t));
+        filled += workers[i].num_samples;
+    }
+    qsort(samples, num_samples, sizeof(uint64_t), compare_samples);
+    for(size_t i = 0; i < num_samples; i++)
+    {
+        total_ns += (double)samples[i];
+    }
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", config->rate > 0 ? "open" : "closed");
+    printf("  \"connections\": \"%s\",\n", config->one_shot ? "one-shot" : "keep-alive");
+    printf("  \"threads\": %u,\n", config->num_threads);
+    printf("  \"concurrency\": %u,\n", config->num_connections);
+    printf("  \"rate\": %" PRIu64 ",\n", config->rate);
+    printf("  \"duration_s\": %u,\n", config->duration);
+    printf("  \"warmup_s\": %u,\n", config->warmup);
+    printf("  \"mix\": \"%s\",\n", config->mix_text);
+    printf("  \"files_per_size\": %u,\n", config->files_per_size);
+    printf("  \"seed\": %" PRIu64 ",\n", config->seed);
+    printf("  \"requests\": %zu,\n", num_samples);
+    printf("  \"errors\": %" PRIu64 ",\n", errors);
+    printf("  \"dropped\": %" PRIu64 ",\n", dropped);
+    printf("  \"requests_per_second\": %.1f,\n", (double)num_samples / config->duration);
+    printf("  \"throughput_bytes_per_second\": %.1f,\n", (double)bytes / config->duration);
+    printf("  \"latency_us\": {\n");
+    printf("    \"mean\": %.1f,\n", num_samples == 0 ? 0 : total_ns / (double)num_samples / NS_PER_US);
+    printf("    \"p50\": %.1f,\n", percentile_us(samples, num_samples, P50));
+    printf("    \"p99\": %.1f,\n", percentile_us(samples, num_samples, P99));
+    printf("    \"p99.9\": %.1f,\n", percentile_us(samples, num_samples, P999));
+    printf("    \"max\": %.1f\n", percentile_us(samples, num_samples, PERMILLE));
+    printf("  }\n");
+    printf("}\n");
+    free(samples);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config;
+    struct sigaction    sa     = {0};
+    struct worker      *workers;
+    unsigned            started = 0;
+    int                 status  = EXIT_SUCCESS;
+    pid_t               server;
+    uint64_t            start_ns;
+
+    parse_arguments(argc, argv, &config);
+
+    sa.sa_handler = on_interrupt;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    if(generate_root(&config) == -1)
+    {
+        perror("Error: generating the root directory failed");
+        return EXIT_FAILURE;
+    }
+    server = start_server(&config);
+    if(server == -1 || !wait_for_server(&config, server))
+    {
+        fprintf(stderr, "Error: %s did not start listening on port %u.\n", config.server, (unsigned)config.port);
+        if(server > 0)
+        {
+            stop_server(server);
+        }
+        remove_root(&config);
+        return EXIT_FAILURE;
+    }
+
+    workers  = calloc(config.num_threads, sizeof(struct worker));
+    start_ns = now_ns();
+    for(; workers != NULL && started < config.num_threads; started++)
+    {
+        if(init_worker(&workers[started], &config, started, start_ns) == -1 || pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0)
+        {
+            fputs("Error: starting the load generator threads failed.\n", stderr);
+            destroy_worker(&workers[started]);
+            running = 0;
+            status  = EXIT_FAILURE;
+            break;
+        }
+    }
+    for(unsigned i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    stop_server(server);
+    remove_root(&config);
+
+    if(workers == NULL || (status == EXIT_SUCCESS && report(&config, workers) == -1))
+    {
+        status = EXIT_FAILURE;
+    }
+    for(unsigned i = 0; workers != NULL && i < started; i++)
+    {
+        destroy_worker(&workers[i]);
+    }
+    free(workers);
+    return status;
+}
@@ -0,0 +1,640 @@
+#define _POSIX_C_SOURCE 200809L    // NOLINT
+#ifdef __linux__
+    #define _GNU_SOURCE    // NOLINT syscall
+#endif
+
+#include "../include/arena.h"
+#include "../include/buffer_pool.h"
+#include "../include/client_table.h"
+#include "../include/http_parser.h"
+#include "../include/http_scan.h"
+#include "../include/path_map.h"
+#include "../include/server.h"
+#include "request_corpus.h"
+#include "serve_loop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+#endif
+
+// Times the functions on the request path one at a time: parsing the request
+// corpus, mapping shallow and deep URL paths to files, and taking and giving
+// back connection slots with 10k and 100k connections open. Then whole
+// keep-alive requests through the server's read, handle and flush path, which
+// must not touch the heap once warm: any allocation there fails the run.
+// Reports ns, heap allocations, user-space cycles and instructions per
+// operation, the latter two only where perf_event_open is allowed.
+// Usage: micro_bench [iterations]
+
+#define TEMPLATE_ROOT "/tmp/micro_bench.XXXXXX"
+#define DEEP_DIRECTORY "/a/b/c/d/e/f/g/h"
+
+enum
+{
+    DEFAULT_ITERATIONS = 200000,
+    ITERATIONS_BASE    = 10,
+    WARMUP_DIVISOR     = 10,
+    NANOSECONDS        = 1000000000,
+    DIRECTORY_MODE     = 0755,
+    NUM_COUNTERS       = 2,    // cycles, then instructions
+    GROW_CONNECTIONS   = 100000,
+    FILE_MODE          = 0644,
+    INDEX_SIZE         = 1024,
+    PAGE_SIZE          = 32768,    // sent with sendfile rather than from memory
+    RESPONSE_BUDGET    = 1048576,
+    SERVE_DIVISOR      = 10,    // a request is several syscalls, far slower than the rest
+    REQUEST_CAPACITY   = 512,
+};
+
+static const size_t CHURN_CONNECTIONS[] = {10000, 100000};
+
+struct map_case
+{
+    const char *name;
+    const char *url_path;
+};
+
+static const struct map_case MAP_CASES[] = {
+    {"map/root-index", "/"                                           },
+    {"map/shallow",    "/index.html"                                 },
+    {"map/deep",       DEEP_DIRECTORY "/page.html"                   },
+    {"map/deep-query", DEEP_DIRECTORY "/page.html?v=3f9c2b1e"        },
+    {"map/missing",    DEEP_DIRECTORY "/missing.html"                },
+    {"map/escape",     DEEP_DIRECTORY "/../../../../../../../../../x"},
+};
+
+struct serve_case
+{
+    const char *name;
+    const char *url_path;
+    const char *extra_headers;
+    int         status;
+    size_t      response_budget;
+    bool        log_requests;
+};
+
+static const struct serve_case SERVE_CASES[] = {
+    {"serve/cached",       "/index.html",                  "",                                                     200, RESPONSE_BUDGET, false},
+    {"serve/file",         "/index.html",                  "",                                                     200, 0,               false},
+    {"serve/sendfile",     DEEP_DIRECTORY "/page.html",    "",                                                     200, 0,               false},
+    {"serve/logged",       "/index.html",                  "Referer: http://bench/\r\n",                           200, 0,               true },
+    {"serve/not-modified", "/index.html",                  "If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n", 304, 0,               false},
+    {"serve/not-found",    DEEP_DIRECTORY "/missing.html", "",                                                     404, 0,               false},
+};
+
+static unsigned long long allocations;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+#ifdef __GLIBC__
+// glibc's own entry points, so the allocator can be counted without dlsym
+extern void *__libc_malloc(size_t size);                    // NOLINT(bugprone-reserved-identifier)
+extern void *__libc_calloc(size_t count, size_t size);      // NOLINT(bugprone-reserved-identifier)
+extern void *__libc_realloc(void *pointer, size_t size);    // NOLINT(bugprone-reserved-identifier)
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+struct perf_counters
+{
+    int leader;    // cycles, -1 when the kernel does not let us count
+    int instructions;
+};
+
+struct bench_result
+{
+    double   ns;
+    double   allocations;
+    uint64_t counts[NUM_COUNTERS];
+    bool     counted;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NANOSECONDS) + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef __linux__
+static int open_counter(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = config;
+    attr.disabled       = group == -1;
+    attr.exclude_kernel = 1;    // allowed at the default perf_event_paranoid
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void open_counters(struct perf_counters *counters)
+{
+    counters->leader       = -1;
+    counters->instructions = -1;
+#ifdef __linux__
+    counters->leader = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if(counters->leader == -1)
+    {
+        return;
+    }
+    counters->instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS, counters->leader);
+    if(counters->instructions == -1)
+    {
+        close(counters->leader);
+        counters->leader = -1;
+    }
+#endif
+}
+
+static void close_counters(struct perf_counters *counters)
+{
+    if(counters->leader != -1)
+    {
+        close(counters->instructions);
+        close(counters->leader);
+    }
+}
+
+static void start_counters(const struct perf_counters *counters)
+{
+#ifdef __linux__
+    if(counters->leader != -1)
+    {
+        ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    (void)counters;
+#endif
+}
+
+static bool stop_counters(const struct perf_counters *counters, uint64_t counts[NUM_COUNTERS])
+{
+#ifdef __linux__
+    uint64_t group[1 + NUM_COUNTERS];    // the number of counters, then their values
+
+    if(counters->leader == -1)
+    {
+        return false;
+    }
+    ioctl(counters->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if(read(counters->leader, group, sizeof(group)) != (ssize_t)sizeof(group) || group[0] != NUM_COUNTERS)
+    {
+        return false;
+    }
+    memcpy(counts, group + 1, sizeof(uint64_t) * NUM_COUNTERS);
+    return true;
+#else
+    (void)counters;
+    (void)counts;
+    return false;
+#endif
+}
+
+typedef void (*bench_op)(void *arg, unsigned long iterations);
+
+static struct bench_result measure(const struct perf_counters *counters, bench_op op, void *arg, unsigned long iterations)
+{
+    struct bench_result result;
+    unsigned long long  allocations_before;
+    uint64_t            start;
+
+    memset(&result, 0, sizeof(result));
+    allocations_before = allocations;
+    start_counters(counters);
+    start = now_ns();
+    op(arg, iterations);
+    result.ns          = (double)(now_ns() - start) / (double)iterations;
+    result.counted     = stop_counters(counters, result.counts);
+    result.allocations = (double)(allocations - allocations_before) / (double)iterations;
+    return result;
+}
+
+static void print_result(const char *name, const struct bench_result *result, unsigned long iterations)
+{
+    if(result->counted)
+    {
+        printf("%-24s %10.1f %10.3f %10.1f %10.1f\n", name, result->ns, result->allocations, (double)result->counts[0] / (double)iterations, (double)result->counts[1] / (double)iterations);
+    }
+    else
+    {
+        printf("%-24s %10.1f %10.3f %10s %10s\n", name, result->ns, result->allocations, "-", "-");
+    }
+}
+
+// A short untimed run first, so caches, the buffer pool and slabs are warm
+static struct bench_result run_bench(const struct perf_counters *counters, const char *name, bench_op op, void *arg, unsigned long iterations)
+{
+    struct bench_result result;
+
+    op(arg, iterations / WARMUP_DIVISOR + 1);
+    result = measure(counters, op, arg, iterations);
+    print_result(name, &result, iterations);
+    return result;
+}
+
+struct parse_arg
+{
+    const char *text;
+    size_t      length;
+    size_t      headers;    // keeps the loop from being optimized away
+};
+
+static void parse_op(void *arg, unsigned long iterations)
+{
+    struct parse_arg *self = arg;
+    http_parser       parser;
+    http_request      request;
+
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        http_parser_init(&parser, &request, 0);
+        if(http_parser_execute(&parser, &request, self->text, self->length) == HTTP_PARSE_COMPLETE)
+        {
+            self->headers += request.num_headers;
+        }
+    }
+}
+
+struct map_arg
+{
+    arena       arena;
+    const char *root;
+    size_t      root_length;
+    const char *url_path;
+    size_t      url_path_length;
+    size_t      resolved;
+};
+
+// As the server calls it, with the arena reset between requests
+static void map_op(void *arg, unsigned long iterations)
+{
+    struct map_arg *self = arg;
+
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        arena_reset(&self->arena);
+        if(path_map_resolve(&self->arena, self->root, self->root_length, self->url_path, self->url_path_length, NULL) != NULL)
+        {
+            self->resolved++;
+        }
+    }
+}
+
+struct table_arg
+{
+    client_table   table;
+    client_state **live;
+    size_t         num_live;
+    uint64_t       random_state;
+};
+
+// xorshift64, so every run closes the same slots
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// One connection closing somewhere in the table and another taking its slot
+static void churn_op(void *arg, unsigned long iterations)
+{
+    struct table_arg *self = arg;
+
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        const size_t index = (size_t)(next_random(&self->random_state) % self->num_live);
+
+        client_table_release(&self->table, self->live[index]);
+        self->live[index]         = client_table_acquire(&self->table);
+        self->live[index]->socket = (int)index;
+    }
+}
+
+// Connections arriving at an empty table, a slab allocated for every CLIENT_SLAB_SIZE of them
+static void grow_op(void *arg, unsigned long iterations)
+{
+    struct table_arg *self = arg;
+
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        self->live[i]         = client_table_acquire(&self->table);
+        self->live[i]->socket = (int)i;
+    }
+    self->num_live = iterations;
+}
+
+struct serve_arg
+{
+    serve_loop *loop;
+    char        request[REQUEST_CAPACITY];
+    size_t      length;
+    int         status;
+    bool        failed;
+};
+
+// One request on the same keep-alive connection and its whole response read back
+static void serve_op(void *arg, unsigned long iterations)
+{
+    struct serve_arg *self = arg;
+
+    for(unsigned long i = 0; i < iterations && !self->failed; i++)
+    {
+        self->failed = serve_loop_exchange(self->loop, self->request, self->length) != self->status;
+    }
+}
+
+static void free_table(client_table *table)
+{
+    struct client_slab *slab = table->slabs;
+
+    while(slab != NULL)
+    {
+        struct client_slab *next = slab->next;
+
+        free(slab);
+        slab = next;
+    }
+    client_table_init(table);
+}
+
+static int bench_parser(const struct perf_counters *counters, unsigned long iterations)
+{
+    for(size_t r = 0; r < sizeof(REQUESTS) / sizeof(REQUESTS[0]); r++)
+    {
+        struct parse_arg arg = {REQUESTS[r].text, strlen(REQUESTS[r].text), 0};
+        char             name[NAME_MAX];
+
+        snprintf(name, sizeof(name), "parse/%s", REQUESTS[r].name);
+        run_bench(counters, name, parse_op, &arg, iterations);
+        if(arg.headers == 0)
+        {
+            fprintf(stderr, "%s: request did not parse\n", REQUESTS[r].name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int create_file(const char *path, off_t size)
+{
+    const int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, FILE_MODE);
+
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// real_root/index.html and real_root/a/b/.../h/page.html, for paths one and nine levels deep
+static int populate_root(const char *real_root)
+{
+    const size_t root_length = strlen(real_root);
+    char         path[PATH_MAX + sizeof(DEEP_DIRECTORY "/index.html")];
+
+    memcpy(path, real_root, root_length);
+    for(size_t end = 2; end <= sizeof(DEEP_DIRECTORY) - 1; end += 2)
+    {
+        memcpy(path + root_length, DEEP_DIRECTORY, end);
+        path[root_length + end] = '\0';
+        if(mkdir(path, DIRECTORY_MODE) == -1)
+        {
+            return -1;
+        }
+    }
+
+    strcpy(path + root_length, "/index.html");
+    if(create_file(path, INDEX_SIZE) == -1)
+    {
+        return -1;
+    }
+    strcpy(path + root_length, DEEP_DIRECTORY "/page.html");
+    return create_file(path, PAGE_SIZE);
+}
+
+static void remove_root(const char *real_root)
+{
+    const size_t root_length = strlen(real_root);
+    char         path[PATH_MAX + sizeof(DEEP_DIRECTORY "/index.html")];
+
+    memcpy(path, real_root, root_length);
+    strcpy(path + root_length, "/index.html");
+    unlink(path);
+    strcpy(path + root_length, DEEP_DIRECTORY "/page.html");
+    unlink(path);
+
+    // the deepest directory first, up to the root itself
+    for(size_t end = sizeof(DEEP_DIRECTORY) - 1;; end -= 2)
+    {
+        path[root_length + end] = '\0';
+        rmdir(path);
+        if(end == 0)
+        {
+            break;
+        }
+    }
+}
+
+static int bench_path_map(const struct perf_counters *counters, const char *real_root, unsigned long iterations)
+{
+    for(size_t m = 0; m < sizeof(MAP_CASES) / sizeof(MAP_CASES[0]); m++)
+    {
+        struct map_arg arg;
+        const char    *query = strchr(MAP_CASES[m].url_path, '?');
+
+        memset(&arg, 0, sizeof(arg));
+        arg.root            = real_root;
+        arg.root_length     = strlen(real_root);
+        arg.url_path        = MAP_CASES[m].url_path;
+        arg.url_path_length = query == NULL ? strlen(arg.url_path) : (size_t)(query - arg.url_path);
+        run_bench(counters, MAP_CASES[m].name, map_op, &arg, iterations);
+        arena_destroy(&arg.arena);
+    }
+    return 0;
+}
+
+// Fails when a warm keep-alive request allocates at all, the arena, buffer
+// pool and caches are meant to leave the system allocator out of steady state
+static int bench_serve(const struct perf_counters *counters, const char *real_root, unsigned long iterations)
+{
+    const unsigned long serve_iterations = iterations / SERVE_DIVISOR + 1;
+    int                 result           = 0;
+
+    for(size_t c = 0; c < sizeof(SERVE_CASES) / sizeof(SERVE_CASES[0]); c++)
+    {
+        struct serve_arg    arg;
+        struct bench_result measured;
+        int                 length;
+
+        memset(&arg, 0, sizeof(arg));
+        length = snprintf(arg.request, sizeof(arg.request), "GET %s HTTP/1.1\r\nHost: bench\r\nUser-Agent: micro_bench\r\n%s\r\n", SERVE_CASES[c].url_path, SERVE_CASES[c].extra_headers);
+        arg.loop = serve_loop_create(real_root, SERVE_CASES[c].response_budget, SERVE_CASES[c].log_requests);
+        if(arg.loop == NULL || length < 0 || (size_t)length >= sizeof(arg.request))
+        {
+            fprintf(stderr, "%s: setting up the connection failed\n", SERVE_CASES[c].name);
+            return -1;
+        }
+        arg.length = (size_t)length;
+        arg.status = SERVE_CASES[c].status;
+
+        measured = run_bench(counters, SERVE_CASES[c].name, serve_op, &arg, serve_iterations);
+        serve_loop_destroy(arg.loop);
+        if(arg.failed)
+        {
+            fprintf(stderr, "%s: the response was not the expected %d\n", SERVE_CASES[c].name, SERVE_CASES[c].status);
+            result = -1;
+        }
+        else if(measured.allocations > 0)
+        {
+            fprintf(stderr, "%s: %.3f heap allocations per request, steady state must make none\n", SERVE_CASES[c].name, measured.allocations);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int bench_client_table(const struct perf_counters *counters, unsigned long iterations)
+{
+    struct table_arg arg;
+    char             name[NAME_MAX];
+
+    for(size_t c = 0; c < sizeof(CHURN_CONNECTIONS) / sizeof(CHURN_CONNECTIONS[0]); c++)
+    {
+        memset(&arg, 0, sizeof(arg));
+        client_table_init(&arg.table);
+        arg.random_state = CHURN_CONNECTIONS[c];
+        arg.live         = malloc(CHURN_CONNECTIONS[c] * sizeof(client_state *));
+        if(arg.live == NULL)
+        {
+            return -1;
+        }
+        grow_op(&arg, CHURN_CONNECTIONS[c]);
+
+        snprintf(name, sizeof(name), "table/churn-%zuk", CHURN_CONNECTIONS[c] / 1000);
+        run_bench(counters, name, churn_op, &arg, iterations);
+        free_table(&arg.table);
+        free(arg.live);
+    }
+
+    // every run starts from an empty table, so it is measured once
+    memset(&arg, 0, sizeof(arg));
+    client_table_init(&arg.table);
+    arg.live = malloc(GROW_CONNECTIONS * sizeof(client_state *));
+    if(arg.live == NULL)
+    {
+        return -1;
+    }
+    {
+        const struct bench_result result = measure(counters, grow_op, &arg, GROW_CONNECTIONS);
+
+        print_result("table/grow-100k", &result, GROW_CONNECTIONS);
+    }
+    free_table(&arg.table);
+    free(arg.live);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long        iterations                = DEFAULT_ITERATIONS;
+    char                 root[sizeof(TEMPLATE_ROOT)] = TEMPLATE_ROOT;
+    char                 real_root[PATH_MAX]         = "";
+    struct perf_counters counters;
+    int                  result;
+
+    if(argc > 1)
+    {
+        char *end;
+
+        errno      = 0;
+        iterations = strtoul(argv[1], &end, ITERATIONS_BASE);
+        if(errno != 0 || *end != '\0' || iterations == 0)
+        {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    http_scan_init();
+    open_counters(&counters);
+    if(counters.leader == -1)
+    {
+        fputs("perf_event_open is not available, cycles and instructions are not counted\n", stderr);
+    }
+
+    // resolved like the server resolves its root, so mapped paths compare equal
+    if(mkdtemp(root) == NULL)
+    {
+        perror("Error: creating the root directory failed");
+        close_counters(&counters);
+        return EXIT_FAILURE;
+    }
+    if(realpath(root, real_root) == NULL || populate_root(real_root) == -1)
+    {
+        perror("Error: creating the root directory failed");
+        remove_root(real_root[0] == '/' ? real_root : root);
+        close_counters(&counters);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %10s %10s %10s %10s\n", "benchmark", "ns/op", "allocs/op", "cycles/op", "instr/op");
+    result = bench_parser(&counters, iterations);
+    if(result == 0)
+    {
+        result = bench_path_map(&counters, real_root, iterations);
+    }
+    if(result == 0)
+    {
+        result = bench_client_table(&counters, iterations);
+    }
+    if(result == 0)
+    {
+        result = bench_serve(&counters, real_root, iterations);
+    }
+
+    remove_root(real_root);
+    close_counters(&counters);
+    buffer_pool_destroy();
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L    // NOLINT
+
+#include "../include/http_parser.h"
+#include "../include/http_scan.h"
+#include "request_corpus.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Compares the header scanning kernels by parsing captured browser requests
+// with each of them. Usage: scan_bench [iterations]
+
+enum
+{
+    DEFAULT_ITERATIONS = 200000,
+    ITERATIONS_BASE    = 10,
+    NANOSECONDS        = 1000000000,
+};
+
+static const enum http_scan_type SCAN_TYPES[] = {
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NANOSECONDS) + (uint64_t)ts.tv_nsec;
+}
+
+// Returns the nanoseconds per parse, or a negative value if the request does not parse
+static double bench_parse(const char *text, size_t length, unsigned long iterations)
+{
+    http_parser  parser;
+    http_request request;
+    size_t       headers = 0;
+    uint64_t     start;
+
+    start = now_ns();
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        http_parser_init(&parser, &request, 0);
+        if(http_parser_execute(&parser, &request, text, length) != HTTP_PARSE_COMPLETE)
+        {
+            return -1;
+        }
+        headers += request.num_headers;
+    }
+
+    // keeps the loop from being optimized away
+    if(headers == 0)
+    {
+        fputs("no headers parsed\n", stderr);
+    }
+    return (double)(now_ns() - start) / (double)iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+
+    if(argc > 1)
+    {
+        char *end;
+
+        errno      = 0;
+        iterations = strtoul(argv[1], &end, ITERATIONS_BASE);
+        if(errno != 0 || *end != '\0' || iterations == 0)
+        {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-8s %-8s %8s %12s %10s\n", "request", "kernels", "bytes", "ns/request", "MB/s");
+    for(size_t r = 0; r < sizeof(REQUESTS) / sizeof(REQUESTS[0]); r++)
+    {
+        const size_t length = strlen(REQUESTS[r].text);
+
+        for(size_t k = 0; k < sizeof(SCAN_TYPES) / sizeof(SCAN_TYPES[0]); k++)
+        {
+            double ns_per_parse;
+
+            if(http_scan_select(SCAN_TYPES[k]) == -1)
+            {
+                continue;
+            }
+
+            ns_per_parse = bench_parse(REQUESTS[r].text, length, iterations);
+            if(ns_per_parse < 0)
+            {
+                fprintf(stderr, "%s: request did not parse with the %s kernels\n", REQUESTS[r].name, http_scan->name);
+                return EXIT_FAILURE;
+            }
+            printf("%-8s %-8s %8zu %12.1f %10.1f\n", REQUESTS[r].name, http_scan->name, length, ns_per_parse, (double)length * 1000.0 / ns_per_parse);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+// server.c is compiled in with its main renamed, so the benchmark reaches the
+// server's static functions without splitting the server into a library
+#define main server_main      // NOLINT
+#include "../src/server.c"    // NOLINT(bugprone-suspicious-include)
+#undef main
+
+#include "serve_loop.h"
+
+#define CONTENT_LENGTH_HEADER "\r\nContent-Length: "
+#define HEADERS_END "\r\n\r\n"
+
+enum
+{
+    SERVE_LOOP_RESPONSE_CAPACITY = 131072,
+    SERVE_LOOP_MAX_ROUNDS        = 1000,    // serve_client calls per response before giving up
+    STATUS_CODE_OFFSET           = 9,       // past "HTTP/1.1 "
+    STATUS_CODE_DIGITS           = 3,
+    DECIMAL_BASE                 = 10,
+};
+
+struct serve_loop
+{
+    server_context ctx;
+    access_log     log;
+    bool           logging;
+    client_state  *state;
+    int            peer;    // the client's end
+    char           response[SERVE_LOOP_RESPONSE_CAPACITY];
+};
+
+// The slot register_client took, the only one in use
+static client_state *find_client(const server_context *ctx, int socket)
+{
+    for(struct client_slab *slab = ctx->clients.slabs; slab != NULL; slab = slab->next)
+    {
+        for(size_t i = 0; i < CLIENT_SLAB_SIZE; i++)
+        {
+            if(slab->slots[i].socket == socket)
+            {
+                return &slab->slots[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+serve_loop *serve_loop_create(const char *root, size_t response_budget, bool log_requests)
+{
+    serve_loop             *loop = calloc(1, sizeof(serve_loop));
+    int                     fds[2];
+    struct sockaddr_storage peer_addr;
+
+    if(loop == NULL)
+    {
+        return NULL;
+    }
+    loop->ctx                       = init_context();
+    loop->ctx.root_directory        = root;
+    loop->ctx.response_cache_budget = response_budget;
+    loop->ctx.compression_threads   = 0;
+    loop->ctx.log_level             = LOG_LEVEL_ERROR;
+    loop->peer                      = -1;
+    if(log_requests)
+    {
+        if(access_log_init(&loop->log, 1, "/dev/null") == -1)
+        {
+            free(loop);
+            return NULL;
+        }
+        loop->logging        = true;
+        loop->ctx.log_level  = LOG_LEVEL_ACCESS;
+        loop->ctx.access_log = &loop->log;
+        loop->ctx.log_ring   = &loop->log.rings[0];
+    }
+
+    // as a worker sets itself up, minus the listeners and the wakeup pipe
+    if(event_backend_init(&loop->ctx.backend, loop->ctx.backend_type) == -1)
+    {
+        if(loop->logging)
+        {
+            access_log_destroy(&loop->log);
+        }
+        free(loop);
+        return NULL;
+    }
+    client_table_init(&loop->ctx.clients);
+    init_file_cache(&loop->ctx);
+    init_compressor(&loop->ctx);
+    loop->ctx.now_ms = timer_wheel_now_ms();
+    timer_wheel_init(&loop->ctx.timers, loop->ctx.now_ms);
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        serve_loop_destroy(loop);
+        return NULL;
+    }
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.ss_family = AF_UNIX;
+    loop->peer          = fds[1];
+    register_client(&loop->ctx, fds[0], &peer_addr, sizeof(sa_family_t), false);
+    loop->state = find_client(&loop->ctx, fds[0]);
+    if(loop->state == NULL)
+    {
+        serve_loop_destroy(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+// The length of the whole response once its headers are in, 0 until then
+static size_t response_length(const char *response, size_t received)
+{
+    const char *headers_end;
+    const char *content_length;
+
+    headers_end = memmem(response, received, HEADERS_END, sizeof(HEADERS_END) - 1);
+    if(headers_end == NULL)
+    {
+        return 0;
+    }
+
+    // a 304 has no body and no Content-Length
+    content_length = memmem(response, (size_t)(headers_end - response), CONTENT_LENGTH_HEADER, sizeof(CONTENT_LENGTH_HEADER) - 1);
+    if(content_length == NULL)
+    {
+        return (size_t)(headers_end - response) + sizeof(HEADERS_END) - 1;
+    }
+    return (size_t)(headers_end - response) + sizeof(HEADERS_END) - 1 + strtoul(content_length + sizeof(CONTENT_LENGTH_HEADER) - 1, NULL, DECIMAL_BASE);
+}
+
+int serve_loop_exchange(serve_loop *loop, const char *request, size_t length)
+{
+    size_t received = 0;
+    size_t expected = 0;
+    int    status   = 0;
+
+    if(write(loop->peer, request, length) != (ssize_t)length)
+    {
+        return -1;
+    }
+
+    // what the event loop does on every wakeup, with the client reading in between
+    for(size_t round = 0; round < SERVE_LOOP_MAX_ROUNDS; round++)
+    {
+        ssize_t result;
+
+        if(loop->state->socket == -1)
+        {
+            return -1;
+        }
+        serve_client(&loop->ctx, loop->state);
+
+        while((result = read(loop->peer, loop->response + received, sizeof(loop->response) - received)) > 0)
+        {
+            received += (size_t)result;
+        }
+        if(expected == 0)
+        {
+            expected = response_length(loop->response, received);
+        }
+        if(expected != 0 && received >= expected)
+        {
+            if(received != expected || received < STATUS_CODE_OFFSET + STATUS_CODE_DIGITS)
+            {
+                return -1;
+            }
+            for(size_t i = STATUS_CODE_OFFSET; i < STATUS_CODE_OFFSET + STATUS_CODE_DIGITS; i++)
+            {
+                status = (status * DECIMAL_BASE) + (loop->response[i] - '0');
+            }
+            return status;
+        }
+    }
+    return -1;
+}
+
+void serve_loop_destroy(serve_loop *loop)
+{
+    struct client_slab *slab = loop->ctx.clients.slabs;
+
+    if(loop->state != NULL)
+    {
+        close_client(&loop->ctx, loop->state);
+    }
+    if(loop->peer != -1)
+    {
+        close(loop->peer);
+    }
+
+    // cleanup_server without its summary lines
+    while(slab != NULL)
+    {
+        struct client_slab *next = slab->next;
+
+        free(slab);
+        slab = next;
+    }
+    file_cache_destroy(&loop->ctx.file_cache);
+    compressor_destroy(&loop->ctx.compressor);
+    event_backend_destroy(&loop->ctx.backend);
+    if(loop->logging)
+    {
+        access_log_destroy(&loop->log);
+    }
+    free(loop);
+}
@@ -0,0 +1,23 @@
+#ifndef SERVE_LOOP_H
+#define SERVE_LOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// One worker without listeners and one keep-alive client on the other end of a
+// socketpair, driven through the server's own read, handle and flush path
+struct serve_loop;
+
+typedef struct serve_loop serve_loop;
+
+// Serves root with response_budget bytes of in-memory responses, logging every
+// request to /dev/null when log_requests is set. Returns NULL on failure.
+serve_loop *serve_loop_create(const char *root, size_t response_budget, bool log_requests);
+
+// Sends the request, runs the connection until its whole response is back and
+// returns the status code, or -1 when the connection failed or was closed
+int serve_loop_exchange(serve_loop *loop, const char *request, size_t length);
+
+void serve_loop_destroy(serve_loop *loop);
+
+#endif /*SERVE_LOOP_H*/
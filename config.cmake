@@ -18,16 +18,109 @@ set(STANDARD_FLAGS
 )
 
 # Define targets
-set(EXECUTABLE_TARGETS main)
+set(EXECUTABLE_TARGETS main scan_bench micro_bench bench)
 set(LIBRARY_TARGETS "")
 
 set(main_SOURCES
         src/server.c
+        src/access_log.c
+        src/arena.c
+        src/buffer_pool.c
+        src/client_table.c
+        src/compression.c
+        src/event_backend.c
+        src/file_cache.c
+        src/http_parser.c
+        src/http_scan.c
+        src/metrics.c
+        src/path_map.c
+        src/resolver.c
+        src/timer_wheel.c
+        src/util.c
 )
 
 set(main_HEADERS
         include/server.h
+        include/access_log.h
+        include/arena.h
+        include/buffer_pool.h
+        include/client_table.h
+        include/compression.h
+        include/event_backend.h
+        include/file_cache.h
+        include/http_parser.h
+        include/http_scan.h
+        include/metrics.h
+        include/path_map.h
+        include/resolver.h
+        include/timer_wheel.h
+        include/util.h
 )
 
-set(main_LINK_LIBRARIES "")
+set(main_LINK_LIBRARIES
+        pthread
+        z
+)
+
+set(scan_bench_SOURCES
+        bench/scan_bench.c
+        src/http_parser.c
+        src/http_scan.c
+)
+
+set(scan_bench_HEADERS
+        include/http_parser.h
+        include/http_scan.h
+)
+
+# serve_loop.c compiles src/server.c in, so every other server source is linked
+set(micro_bench_SOURCES
+        bench/micro_bench.c
+        bench/serve_loop.c
+        src/access_log.c
+        src/arena.c
+        src/buffer_pool.c
+        src/client_table.c
+        src/compression.c
+        src/event_backend.c
+        src/file_cache.c
+        src/http_parser.c
+        src/http_scan.c
+        src/metrics.c
+        src/path_map.c
+        src/resolver.c
+        src/timer_wheel.c
+        src/util.c
+)
 
+set(micro_bench_HEADERS
+        bench/serve_loop.h
+        include/access_log.h
+        include/arena.h
+        include/buffer_pool.h
+        include/client_table.h
+        include/compression.h
+        include/event_backend.h
+        include/file_cache.h
+        include/http_parser.h
+        include/http_scan.h
+        include/metrics.h
+        include/path_map.h
+        include/resolver.h
+        include/server.h
+        include/timer_wheel.h
+        include/util.h
+)
+
+set(micro_bench_LINK_LIBRARIES
+        pthread
+        z
+)
+
+set(bench_SOURCES
+        bench/load_bench.c
+)
+
+set(bench_LINK_LIBRARIES
+        pthread
+)
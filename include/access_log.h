@@ -0,0 +1,86 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum {
+    ACCESS_LOG_RING_CAPACITY = 1048576, // per worker, power of two
+    ACCESS_LOG_LINE_CAPACITY = 2048, // longer lines are cut short
+    ACCESS_LOG_WRITE_BUFFER_SIZE = 262144,
+    ACCESS_LOG_FLUSH_INTERVAL_MS = 50,
+    ACCESS_LOG_DATE_CAPACITY = 32,
+    ACCESS_LOG_FIELD_CAPACITY = 1024, // a request line, Referer or User-Agent once escaped
+    ACCESS_LOG_CACHE_LINE = 64,
+};
+
+enum log_level {
+    LOG_LEVEL_ERROR, // errors only, straight to stderr as before
+    LOG_LEVEL_INFO, // connections opening and closing
+    LOG_LEVEL_ACCESS, // one line per request as well
+};
+
+enum log_format {
+    LOG_FORMAT_COMMON,
+    LOG_FORMAT_COMBINED, // Common plus Referer and User-Agent
+};
+
+// Single producer (one worker), single consumer (the writer thread). Both
+// positions only ever grow, so head - tail is the number of bytes waiting.
+struct log_ring {
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_size_t head; // written by the worker
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_size_t tail; // written by the writer thread
+    _Alignas(ACCESS_LOG_CACHE_LINE) atomic_uint_fast64_t dropped;
+
+    char *buffer;
+    size_t capacity;
+
+    // the worker formats at most one timestamp per second
+    time_t date_second;
+    char date[ACCESS_LOG_DATE_CAPACITY];
+};
+
+typedef struct log_ring log_ring;
+
+struct access_log {
+    log_ring *rings; // one per worker
+    size_t num_rings;
+
+    int fd;
+    bool owns_fd; // false for stdout
+    pthread_t thread;
+    bool started;
+    atomic_bool stopping;
+    char *write_buffer;
+};
+
+typedef struct access_log access_log;
+
+// Opens path for appending, or writes to stdout when path is NULL, and starts the writer thread
+int access_log_init(access_log *log, size_t num_rings, const char *path);
+
+// Stops the writer once everything queued so far is written
+void access_log_destroy(access_log *log);
+
+// Queues a complete line without blocking. A line that does not fit is counted
+// as dropped and false is returned.
+bool log_ring_write(log_ring *ring, const char *line, size_t length);
+
+__attribute__((format(printf, 2, 3))) bool log_ring_printf(log_ring *ring, const char *format, ...);
+
+// The current local time as Common Log Format writes it, e.g. 10/Oct/2000:13:55:36 -0700
+const char *log_ring_date(log_ring *ring);
+
+// Copies a client-supplied value for a quoted log field the way Apache does:
+// '"' and '\' get a backslash, other bytes outside printable ASCII become \xHH.
+// Never splits an escape, the result is cut short and '\0' terminated instead.
+// Returns its length.
+size_t access_log_escape(char *field, size_t capacity, const char *value, size_t length);
+
+uint64_t access_log_dropped(access_log *log);
+
+#endif /*ACCESS_LOG_H*/
@@ -0,0 +1,41 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "buffer_pool.h"
+#include <stddef.h>
+
+enum {
+    ARENA_BLOCK_SIZE = BUFFER_POOL_SMALL, // header included
+};
+
+struct arena_block {
+    struct arena_block *next;
+    size_t capacity;
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+typedef struct arena_block arena_block;
+
+// Bump allocator for memory that lives exactly as long as a request and its
+// response. Nothing is freed on its own, a reset drops everything at once.
+// Blocks come from the buffer pool, stay chained to the arena across resets and
+// only go back to the pool when the arena is destroyed.
+struct arena {
+    arena_block *first; // NULL until the first allocation
+    arena_block *current;
+    size_t used; // bytes taken from current
+    arena_block *large; // bigger than a block, back to the pool on reset
+};
+
+typedef struct arena arena;
+
+// Returns memory aligned for any type, NULL when no block can be had
+void *arena_alloc(arena *a, size_t size);
+
+// O(1) unless something larger than a block was allocated since the last reset
+void arena_reset(arena *a);
+
+// Hands the blocks back to the pool, the arena stays usable
+void arena_destroy(arena *a);
+
+#endif /*ARENA_H*/
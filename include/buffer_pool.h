@@ -0,0 +1,53 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    // size classes, a request is rounded up to the smallest that fits and
+    // anything bigger than the largest goes straight to malloc
+    BUFFER_POOL_SMALL = 4096,
+    BUFFER_POOL_LARGE = 16384,
+    BUFFER_POOL_CLASSES = 2,
+
+    BUFFER_POOL_SLAB_BUFFERS = 32, // carved from malloc at once when the pool runs dry
+    BUFFER_POOL_MAX_SLABS = 16384, // per class
+    BUFFER_POOL_CACHE_CAPACITY = 64, // per thread and class
+    BUFFER_POOL_CACHE_BATCH = 32, // moved between a thread cache and the shared stack at once
+    BUFFER_POOL_CACHE_LINE = 64,
+};
+
+// Sits in front of every buffer handed out
+struct pool_buffer {
+    atomic_uint_least32_t next; // index + 1 of the next free buffer, 0 ends the stack
+    uint32_t index;
+    uint32_t size_class; // BUFFER_POOL_CLASSES for buffers from malloc
+    uint32_t size;
+    _Alignas(BUFFER_POOL_CACHE_LINE) unsigned char data[];
+};
+
+typedef struct pool_buffer pool_buffer;
+
+// Returns a buffer of at least size bytes, aligned to a cache line, NULL when out of memory.
+// Served from the calling thread's cache, which only touches the shared stack every
+// BUFFER_POOL_CACHE_BATCH buffers.
+void *buffer_pool_acquire(size_t size);
+
+// Buffers go back to the cache of whichever thread releases them
+void buffer_pool_release(void *buffer);
+
+// What buffer_pool_acquire would really hand out for size
+size_t buffer_pool_size(size_t size);
+
+// Bytes the calling thread has acquired and not released yet
+size_t buffer_pool_thread_bytes(void);
+
+// Bytes carved from malloc for the pool, in use or not
+size_t buffer_pool_reserved_bytes(void);
+
+// Frees every slab, once no thread uses the pool any more
+void buffer_pool_destroy(void);
+
+#endif /*BUFFER_POOL_H*/
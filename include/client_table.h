@@ -0,0 +1,24 @@
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+struct client_state;
+struct client_slab;
+
+// Every client slot of a worker, free ones threaded onto a list
+struct client_table {
+    struct client_slab *slabs;
+    struct client_state *free_list;
+};
+
+typedef struct client_table client_table;
+
+void client_table_init(client_table *table);
+
+// Pops a free slot, only touching the allocator when every slab is full.
+// Returns a zeroed slot with no socket, or NULL when no slab can be had.
+struct client_state *client_table_acquire(client_table *table);
+
+// The slot's generation moves on, so stale references to it can be told apart
+void client_table_release(client_table *table, struct client_state *state);
+
+#endif /*CLIENT_TABLE_H*/
@@ -0,0 +1,91 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "file_cache.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+enum {
+    DEFAULT_COMPRESSION_THREADS = 1, // per worker
+    MAX_COMPRESSION_THREADS = 64,
+    DEFAULT_COMPRESSION_CACHE_BUDGET = 16777216,
+    MAX_COMPRESSION_CACHE_BUDGET = 1073741824,
+    COMPRESSION_QUEUE_CAPACITY = 64, // files queued, being compressed or waiting to be cached
+    COMPRESSION_MIN_SIZE = 256, // below this the saving hardly covers the Content-Encoding header
+    COMPRESSION_MAX_SIZE = 8388608, // a pool thread holds the whole file and its compressed copy
+    COMPRESSION_LEVEL = 6,
+};
+
+// The gzip body of one file as it was at mtime, keyed by the resolved path
+struct compression_entry {
+    char *path;
+    size_t path_length;
+    uint64_t hash;
+    struct timespec mtime;
+    off_t size;
+
+    // NULL while pending, and for good when gzip did not make the file smaller
+    cached_response *body;
+    bool pending; // a pool thread reads the path, so the entry cannot be evicted
+    size_t cost; // charged against the budget, the body included
+
+    struct compression_entry *hash_next;
+    lru_node lru;
+};
+
+typedef struct compression_entry compression_entry;
+
+struct compression_job {
+    compression_entry *entry;
+    cached_response *body; // the result
+};
+
+typedef struct compression_job compression_job;
+
+// Compresses files on a pool of threads so the event loop never does. The
+// cache belongs to the event loop and needs no locking, only the job queues
+// are shared with the pool. Finished jobs are announced through a pipe.
+struct content_compressor {
+    compression_entry **buckets;
+    size_t num_buckets; // power of two
+    size_t budget;
+    size_t bytes;
+    lru_list lru;
+    uint64_t hits;
+    uint64_t misses;
+
+    pthread_t *threads;
+    size_t num_threads; // 0 when compression is disabled
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    compression_job queue[COMPRESSION_QUEUE_CAPACITY];
+    size_t queue_head;
+    size_t queue_length;
+    compression_job done[COMPRESSION_QUEUE_CAPACITY];
+    size_t done_length;
+    size_t outstanding; // queued, running or done
+    bool stopping;
+
+    int result_fds[2]; // the event loop watches result_fds[0]
+};
+
+typedef struct content_compressor content_compressor;
+
+// num_threads == 0 leaves compression disabled and starts nothing
+int compressor_init(content_compressor *compressor, size_t num_threads, size_t budget);
+void compressor_destroy(content_compressor *compressor);
+
+// Returns the referenced gzip body of the file at path as of mtime and size.
+// Returns NULL while it is being compressed, when it did not shrink, or after
+// queueing it for the pool. Never blocks.
+cached_response *compressor_lookup(content_compressor *compressor, const char *path, const struct timespec *mtime, off_t size);
+
+// Drains result_fds[0] and caches every finished job
+void compressor_process_results(content_compressor *compressor);
+
+#endif /*COMPRESSION_H*/
@@ -0,0 +1,113 @@
+#ifndef EVENT_BACKEND_H
+#define EVENT_BACKEND_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum {
+    EVENT_READ = 1U << 0U,
+    EVENT_WRITE = 1U << 1U,
+    EVENT_ERROR = 1U << 2U,
+
+    // Registration only: the fd is a listener shared between pollers.
+    // It stays level-triggered and, on epoll, only one waiter is woken.
+    EVENT_EXCLUSIVE = 1U << 3U,
+
+    // Registration: the fd is a listener the backend may accept on by itself.
+    // Reported: result holds the accepted, non-blocking socket. Backends that
+    // do not accept report EVENT_READ and leave accept() to the caller.
+    EVENT_ACCEPT = 1U << 4U,
+
+    // Registration: the fd is a stream socket the backend may read by itself,
+    // in which case the caller must not read it. Reported: received holds the
+    // bytes, or is NULL once the peer closed or the connection failed.
+    EVENT_RECEIVE = 1U << 5U,
+};
+
+enum event_backend_type {
+    EVENT_BACKEND_POLL,
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_IO_URING,
+};
+
+// Bytes a backend read on a connection's behalf, into a buffer from the pool.
+// The caller consumes them in order and gives each one back when done.
+struct received_data {
+    struct received_data *next; // free for the caller to queue them
+    size_t length;
+    size_t offset; // consumed so far
+    uint16_t buffer_id;
+    char data[];
+};
+
+typedef struct received_data received_data;
+
+struct backend_event {
+    uint32_t events;
+    int result; // EVENT_ACCEPT only
+    received_data *received; // EVENT_RECEIVE only
+    void *data;
+};
+
+typedef struct backend_event backend_event;
+
+struct event_backend;
+struct uring_ring;
+
+struct event_backend_ops {
+    const char *name;
+    int (*init)(struct event_backend *backend);
+    int (*add)(struct event_backend *backend, int fd, uint32_t interest, void *data);
+    int (*modify)(struct event_backend *backend, int fd, uint32_t interest, void *data);
+    int (*remove)(struct event_backend *backend, int fd);
+    int (*wait)(struct event_backend *backend, backend_event *events, int max_events, int timeout_ms);
+    void (*destroy)(struct event_backend *backend);
+    void (*release)(struct event_backend *backend, received_data *received); // backends that receive only
+};
+
+struct event_backend {
+    const struct event_backend_ops *ops;
+
+    // epoll
+    int epoll_fd;
+
+    // poll, fds are swap-removed so poll_index maps an fd to its pollfds slot
+    struct pollfd *pollfds;
+    void **poll_data;
+    nfds_t num_pollfds;
+    nfds_t pollfds_capacity;
+    ssize_t *poll_index;
+    size_t poll_index_capacity;
+
+    // io_uring, laid out in event_backend.c
+    struct uring_ring *uring;
+
+    // EVENT_RECEIVE sockets are read by the backend, never by the caller
+    bool receives;
+    size_t idle_buffer_bytes; // pooled buffers the backend holds that no connection has
+
+    // connections an EVENT_ACCEPT listener reports per wait, 0 for no limit
+    size_t accept_batch;
+};
+
+typedef struct event_backend event_backend;
+
+// Returns -1 if the backend is not available on this platform or, for io_uring,
+// on the running kernel
+int event_backend_init(event_backend *backend, enum event_backend_type type);
+int event_backend_add(event_backend *backend, int fd, uint32_t interest, void *data);
+int event_backend_modify(event_backend *backend, int fd, uint32_t interest, void *data);
+int event_backend_remove(event_backend *backend, int fd);
+
+// Same contract as poll(): number of events, 0 on timeout, -1 with errno set
+int event_backend_wait(event_backend *backend, backend_event *events, int max_events, int timeout_ms);
+
+// Hands a consumed buffer back to the backend, which reads into it again
+void event_backend_release(event_backend *backend, received_data *received);
+void event_backend_destroy(event_backend *backend);
+const char *event_backend_name(const event_backend *backend);
+
+#endif /*EVENT_BACKEND_H*/
@@ -0,0 +1,162 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include "http_parser.h"
+#include "util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+enum {
+    DEFAULT_FILE_CACHE_ENTRIES = 1024,
+    MAX_FILE_CACHE_ENTRIES = 1048576,
+    FILE_CACHE_ETAG_CAPACITY = 64,
+
+    SMALL_FILE_RESPONSE_LIMIT = 16384, // bodies up to this size may be kept fully serialized
+};
+
+// A complete serialized response (status line, headers and body) for a small
+// file, sent with a single send(). Immutable once built and shared by every
+// connection serving it, each of which holds a reference.
+struct cached_response {
+    size_t references;
+    size_t header_length; // HEAD sends only this prefix
+    size_t length;
+    time_t date_second; // the second its Date header names
+    size_t date_offset; // of the Date value in data, 0 if the headers have none
+    char data[];
+};
+
+typedef struct cached_response cached_response;
+
+struct file_cache_link;
+
+// One open file, shared by every response that serves it. The cache holds
+// one reference and each response in flight holds another, so an entry that
+// is evicted or invalidated mid-send stays open until the last send is done.
+struct file_cache_entry {
+    char *url_path; // key, the request path without its query string
+    size_t url_path_length;
+    uint64_t hash;
+
+    char *requested_path; // the root joined with the request path, before links are followed
+    char *resolved_path;
+    const char *content_type;
+    int fd;
+    off_t size;
+    ino_t inode;
+    struct timespec mtime;
+    char etag[FILE_CACHE_ETAG_CAPACITY];
+    char last_modified[HTTP_DATE_CAPACITY]; // empty if mtime cannot be formatted
+
+    // bit per precompressed sibling (name.br, name.gz) known not to exist, the
+    // entry is dropped when a file named like one appears next to it
+    unsigned missing_siblings;
+
+    // one per directory from the root down to the file, along the requested
+    // and, where links make it differ, the resolved path. Only while cached.
+    struct file_cache_link *links;
+    size_t num_links;
+
+    size_t references;
+    int cached; // still reachable through the hash table and LRU list
+
+    struct file_cache_entry *hash_next;
+    lru_node lru;
+
+    // small files only, dropped together with the entry or to stay under the byte budget
+    cached_response *response;
+    lru_node response_lru;
+};
+
+typedef struct file_cache_entry file_cache_entry;
+
+// A directory between the root and cached files. inotify is not recursive, so
+// every one of them is watched, and the watch goes with its last entry.
+struct file_cache_watch {
+    int watch_descriptor;
+    struct file_cache_link *links; // every entry whose path runs through the directory
+    struct file_cache_watch *hash_next;
+};
+
+typedef struct file_cache_watch file_cache_watch;
+
+// One step of an entry's path: the name it looks up in a watched directory.
+// Also hashed by watch descriptor and name, so an event finds its entries directly.
+struct file_cache_link {
+    file_cache_entry *entry;
+    file_cache_watch *watch;
+    const char *name; // in the entry's own path, not '\0' terminated
+    size_t name_length;
+    uint64_t hash;
+    int names_file; // the last step, a precompressed sibling appearing next to it counts as well
+
+    struct file_cache_link *watch_prev;
+    struct file_cache_link *watch_next;
+    struct file_cache_link *hash_prev;
+    struct file_cache_link *hash_next;
+};
+
+typedef struct file_cache_link file_cache_link;
+
+// Per worker, so it needs no locking
+struct file_cache {
+    file_cache_entry **buckets;
+    size_t num_buckets; // power of two
+    size_t num_entries;
+    size_t max_entries; // 0 disables the cache
+
+    lru_list lru;
+
+    int inotify_fd;
+    const char *root; // resolved, every cached path starts with it
+    size_t root_length;
+    file_cache_watch **watch_buckets; // num_buckets of them, by watch descriptor
+    file_cache_link **link_buckets; // num_buckets of them, by watch descriptor and name
+
+    // In-memory responses, bounded by bytes rather than entries (0 disables them)
+    size_t response_budget;
+    size_t response_bytes;
+    lru_list response_lru;
+    uint64_t response_hits;
+    uint64_t response_misses;
+};
+
+typedef struct file_cache file_cache;
+
+// max_entries == 0 leaves the cache disabled. Without inotify (non-Linux) the cache
+// cannot notice changes, so it stays disabled there too. root must outlive the cache.
+int file_cache_init(file_cache *cache, const char *root, size_t max_entries, size_t response_budget);
+void file_cache_destroy(file_cache *cache);
+
+// Returns a referenced entry or NULL, a hit makes no syscalls
+file_cache_entry *file_cache_lookup(file_cache *cache, const char *url_path, size_t url_path_length);
+
+// Takes ownership of fd whether or not it succeeds and keeps copies of both
+// paths, which start with the root. Returns a referenced entry, or NULL after
+// closing fd. When the cache is disabled or a directory on either path cannot
+// be watched the entry is not kept.
+file_cache_entry *file_cache_insert(file_cache *cache, const char *url_path, size_t url_path_length, const char *requested_path, const char *resolved_path, int fd, const struct stat *st, const char *content_type);
+
+void file_cache_release(file_cache_entry *entry);
+
+// Returns a referenced in-memory response for the entry or NULL. Hits and misses
+// are counted for files small enough to be kept. A response whose Date header
+// is older than now gets date, formatted for now, written over it when no
+// connection is sending it. Otherwise it is dropped and counts as a miss.
+cached_response *file_cache_lookup_response(file_cache *cache, file_cache_entry *entry, time_t now, const char date[HTTP_DATE_CAPACITY]);
+
+// Builds the in-memory response from the serialized headers, dated date_second,
+// and the file itself. Returns a referenced response, or NULL if the file is
+// not eligible or does not fit.
+cached_response *file_cache_store_response(file_cache *cache, file_cache_entry *entry, const char *headers, size_t header_length, time_t date_second);
+
+void cached_response_release(cached_response *response);
+
+// Drains the inotify fd and drops every entry whose file, or a directory on
+// the way to it, changed
+void file_cache_process_events(file_cache *cache);
+
+#endif /*FILE_CACHE_H*/
@@ -0,0 +1,158 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum {
+    MAX_HTTP_HEADERS = 32,
+    MAX_BYTE_RANGES = 16, // more is treated as no Range at all
+    HTTP_DATE_CAPACITY = 30, // "Sun, 06 Nov 1994 08:49:37 GMT" and its '\0'
+};
+
+// Results of http_parser_execute
+enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_COMPLETE = 1,
+    HTTP_PARSE_TOO_MANY_HEADERS = 2,
+};
+
+// A piece of the connection's request buffer. Offsets rather than pointers,
+// so they survive the buffer being reallocated between reads.
+struct http_slice {
+    size_t offset;
+    size_t length;
+};
+
+typedef struct http_slice http_slice;
+
+enum http_method {
+    HTTP_METHOD_UNKNOWN,
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_CONNECT,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_TRACE,
+    HTTP_METHOD_PATCH,
+    HTTP_METHOD_COUNT,
+};
+
+// Headers the server acts on, everything else is HTTP_HEADER_OTHER
+enum http_header_id {
+    HTTP_HEADER_OTHER,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_REFERER, // only logged
+    HTTP_HEADER_USER_AGENT, // only logged
+    HTTP_HEADER_COUNT,
+};
+
+struct http_header {
+    enum http_header_id id;
+    http_slice name;
+    http_slice value; // without surrounding whitespace
+};
+
+typedef struct http_header http_header;
+
+struct http_request {
+    enum http_method method_id;
+    http_slice method;
+    http_slice path;
+    http_slice protocolVersion;
+    http_header headers[MAX_HTTP_HEADERS];
+    size_t num_headers;
+    uint8_t known_headers[HTTP_HEADER_COUNT]; // index + 1 of the first header with each id, 0 if absent
+    uint16_t repeated_headers; // bit per id that appeared more than once
+};
+
+typedef struct http_request http_request;
+
+// One satisfiable range of a Range header, clamped to the representation
+struct http_byte_range {
+    uint64_t first;
+    uint64_t length;
+};
+
+typedef struct http_byte_range http_byte_range;
+
+enum http_parse_state {
+    PARSE_METHOD,
+    PARSE_SPACES_BEFORE_PATH,
+    PARSE_PATH,
+    PARSE_SPACES_BEFORE_VERSION,
+    PARSE_VERSION,
+    PARSE_REQUEST_LINE_LF,
+    PARSE_HEADER_START,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE_START,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADER_LF,
+    PARSE_END_LF,
+    PARSE_DONE,
+};
+
+// Where parsing stopped, so the next call only looks at bytes that arrived since
+struct http_parser {
+    enum http_parse_state state;
+    size_t position;
+    size_t token_start;
+    size_t token_end; // end of a header value before any trailing whitespace
+};
+
+typedef struct http_parser http_parser;
+
+// Starts parsing a new request at offset start, where the previous one in the buffer ended
+void http_parser_init(http_parser *parser, http_request *request, size_t start);
+
+// Parses buffer[parser->position, length) without allocating. Once it returns
+// HTTP_PARSE_COMPLETE, parser->position is the first byte after the blank line.
+int http_parser_execute(http_parser *parser, http_request *request, const char *buffer, size_t length);
+
+// The first header with the given id, NULL if the request has none
+const http_header *http_request_header(const http_request *request, enum http_header_id id);
+
+// Whether the request has more than one header with the given id
+bool http_request_header_repeated(const http_request *request, enum http_header_id id);
+
+// Whether a comma-separated header value such as Connection lists token (case-insensitive)
+bool http_header_has_token(const char *buffer, const http_header *header, const char *token);
+
+// Whether an Accept-Encoding style header accepts token, listed by name or
+// through "*", with a q-value other than 0
+bool http_header_accepts(const char *buffer, const http_header *header, const char *token);
+
+// Parses a Range header value against a representation of size bytes. Returns
+// the number of satisfiable ranges, in the order given, 0 if none is
+// satisfiable, and -1 if the header is malformed, not in bytes, or has more
+// than max_ranges ranges, in which case it is ignored.
+int http_parse_range(const char *value, size_t length, uint64_t size, http_byte_range *ranges, size_t max_ranges);
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only form HTTP/1.1
+// senders generate. Returns -1 for anything else.
+int http_parse_date(const char *value, size_t length, time_t *seconds);
+
+// Formats seconds as an IMF-fixdate, -1 if the time cannot be represented
+int http_format_date(time_t seconds, char date[HTTP_DATE_CAPACITY]);
+
+// Whether an If-None-Match header lists etag or is "*". Weak comparison, so
+// W/"x" and "x" match each other.
+bool http_header_matches_etag(const char *buffer, const http_header *header, const char *etag);
+
+bool http_slice_equals(const char *buffer, http_slice slice, const char *literal);
+bool http_slice_equals_ignore_case(const char *buffer, http_slice slice, const char *literal);
+
+#endif /*HTTP_PARSER_H*/
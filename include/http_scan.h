@@ -0,0 +1,32 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum http_scan_type {
+    HTTP_SCAN_SCALAR,
+    HTTP_SCAN_SSE42,
+    HTTP_SCAN_AVX2,
+};
+
+// Kernels that skip runs of ordinary bytes. Each returns the index of the first
+// byte in buffer[start, end) the parser has to look at, or end if there is none.
+struct http_scan_ops {
+    const char *name;
+    size_t (*path)(const char *buffer, size_t start, size_t end);  // stops at SP, HT, other CTLs and DEL
+    size_t (*value)(const char *buffer, size_t start, size_t end); // stops at CTLs other than HT (so CR) and DEL
+    size_t (*token)(const char *buffer, size_t start, size_t end); // stops at non-token bytes like ':', may stop early on '|' and '~'
+};
+
+// Scalar until http_scan_init picks the best kernels the CPU supports
+extern const struct http_scan_ops *http_scan;
+
+void http_scan_init(void);
+
+// Forces one implementation, -1 if this CPU or build does not have it
+int http_scan_select(enum http_scan_type type);
+
+bool http_is_token_char(unsigned char c);
+
+#endif /*HTTP_SCAN_H*/
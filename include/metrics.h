@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    // HDR-style buckets: exact below METRICS_HISTOGRAM_EXACT, then every power of two
+    // split into METRICS_HISTOGRAM_SUB_BUCKETS, so a bucket is at most 12.5% wide
+    METRICS_HISTOGRAM_EXACT = 16,
+    METRICS_HISTOGRAM_SUB_BUCKET_BITS = 3,
+    METRICS_HISTOGRAM_SUB_BUCKETS = 1 << METRICS_HISTOGRAM_SUB_BUCKET_BITS,
+    METRICS_HISTOGRAM_MIN_EXPONENT = 4, // log2 of METRICS_HISTOGRAM_EXACT
+    METRICS_HISTOGRAM_MAX_EXPONENT = 40, // about 12 days in microseconds, longer is clamped
+    METRICS_HISTOGRAM_BUCKETS = METRICS_HISTOGRAM_EXACT + ((METRICS_HISTOGRAM_MAX_EXPONENT - METRICS_HISTOGRAM_MIN_EXPONENT + 1) * METRICS_HISTOGRAM_SUB_BUCKETS),
+
+    METRICS_STATUS_CLASSES = 5, // 1xx to 5xx
+    METRICS_TEXT_CAPACITY = 8192,
+    METRICS_CACHE_LINE = 64,
+};
+
+// Only the owning worker writes a counter, so an update is a plain load and
+// store. The atomics are there for whoever reads the shard from another thread.
+typedef atomic_uint_fast64_t metrics_counter;
+
+struct metrics_histogram {
+    metrics_counter buckets[METRICS_HISTOGRAM_BUCKETS];
+    metrics_counter count;
+    metrics_counter sum;
+};
+
+typedef struct metrics_histogram metrics_histogram;
+
+// One per worker, on cache lines of its own
+struct metrics_shard {
+    _Alignas(METRICS_CACHE_LINE) metrics_counter connections_accepted;
+    metrics_counter connections_active; // gauge, the worker's num_clients
+    metrics_counter responses[METRICS_STATUS_CLASSES];
+    metrics_counter bytes_sent;
+    metrics_counter parse_errors;
+    metrics_counter file_cache_hits;
+    metrics_counter file_cache_misses;
+    metrics_counter response_cache_hits;
+    metrics_counter response_cache_misses;
+    metrics_counter compression_cache_hits;
+    metrics_counter compression_cache_misses;
+    metrics_counter connection_buffer_bytes; // gauge, pooled buffers the worker's connections hold
+
+    // first request byte read to last response byte written, in microseconds
+    metrics_histogram latency;
+};
+
+typedef struct metrics_shard metrics_shard;
+
+struct metrics_registry {
+    metrics_shard *shards;
+    size_t num_shards;
+};
+
+typedef struct metrics_registry metrics_registry;
+
+int metrics_init(metrics_registry *registry, size_t num_shards);
+void metrics_destroy(metrics_registry *registry);
+
+static inline void metrics_add(metrics_counter *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static inline void metrics_set(metrics_counter *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+void metrics_record_response(metrics_shard *shard, int status_code, uint64_t bytes_sent, uint64_t microseconds);
+
+// Sums the shards into the Prometheus text format. Returns a malloc'd buffer, NULL on failure.
+char *metrics_render(const metrics_registry *registry, size_t *length);
+
+#endif /*METRICS_H*/
@@ -0,0 +1,14 @@
+#ifndef PATH_MAP_H
+#define PATH_MAP_H
+
+#include "arena.h"
+#include <stddef.h>
+
+// Resolves the path of a request URL, without its query string, to the real
+// path of a file under root. A path ending in '/' maps to the directory's
+// index file. Returns a path in the arena, or NULL when nothing exists there
+// or the resolved path leaves the root. Unless requested_path is NULL it is
+// set to the path as joined, before links were followed, also in the arena.
+char *path_map_resolve(arena *a, const char *root, size_t root_length, const char *url_path, size_t url_path_length, char **requested_path);
+
+#endif /*PATH_MAP_H*/
@@ -0,0 +1,80 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "util.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+enum {
+    DEFAULT_RESOLVER_CACHE_ENTRIES = 1024,
+    RESOLVER_QUEUE_CAPACITY = 64,
+    RESOLVER_HOST_CAPACITY = 256, // a DNS name is at most 253 characters
+    RESOLVER_KEY_CAPACITY = 20, // address family and an IPv6 address
+};
+
+// An address waiting for the resolver thread, and what comes back for it.
+// Results travel through a pipe, so one must stay under PIPE_BUF to be written atomically.
+struct resolver_result {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    void *data; // whoever asked, only to be trusted while generation still matches
+    uint32_t generation;
+    char host[RESOLVER_HOST_CAPACITY]; // the numeric address when there is no name
+};
+
+typedef struct resolver_result resolver_result;
+
+// Remembers both names and failed lookups so an address is resolved once
+struct resolver_entry {
+    unsigned char key[RESOLVER_KEY_CAPACITY]; // the host part of the address, the port is left out
+    size_t key_length;
+    uint64_t hash;
+    bool resolved; // false while the lookup is still on the resolver thread
+    char host[RESOLVER_HOST_CAPACITY];
+
+    struct resolver_entry *hash_next;
+    lru_node lru;
+};
+
+typedef struct resolver_entry resolver_entry;
+
+// Reverse DNS lookups block for as long as the DNS server takes, so they run
+// on a thread of their own. The cache belongs to the event loop and needs no
+// locking, only the queue of pending lookups is shared with the thread.
+struct host_resolver {
+    resolver_entry **buckets;
+    size_t num_buckets; // power of two
+    size_t num_entries;
+    size_t max_entries;
+    lru_list lru;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    resolver_result queue[RESOLVER_QUEUE_CAPACITY]; // only addr, data and generation are set
+    size_t queue_head;
+    size_t queue_length;
+    bool stopping;
+
+    int result_fds[2]; // the event loop watches result_fds[0]
+};
+
+typedef struct host_resolver host_resolver;
+
+// max_entries must be at least 1
+int resolver_init(host_resolver *resolver, size_t max_entries);
+void resolver_destroy(host_resolver *resolver);
+
+// Returns the cached name of the address, or NULL after handing it to the
+// resolver thread (unless a lookup is already pending or the queue is full).
+// Never blocks.
+const char *resolver_lookup(host_resolver *resolver, const struct sockaddr *addr, socklen_t addr_len, void *data, uint32_t generation);
+
+// Takes the next finished lookup off result_fds[0] and caches it.
+// Returns 1 with *result filled in, 0 once none are left.
+int resolver_next_result(host_resolver *resolver, resolver_result *result);
+
+#endif /*RESOLVER_H*/
@@ -2,52 +2,213 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "access_log.h"
+#include "arena.h"
+#include "buffer_pool.h"
+#include "client_table.h"
+#include "compression.h"
+#include "event_backend.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "timer_wheel.h"
 #include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 
 enum {
-    VALID_HTTP_METHODS_LENGTH = 3,
+    ERROR_BUFFER_SIZE = 256,
+    PORT_INPUT_BASE = 10,
+
+    BASE_REQUEST_BUFFER_CAPACITY = BUFFER_POOL_SMALL - 1, // the '\0' takes the last byte
+    REQUEST_BUFFER_INCREASE_THRESHOLD = 256,
+
+    DEFAULT_MAX_HEADER_SIZE = 8192,
+    MAX_HEADER_SIZE_LIMIT = 1048576,
+
+    DEFAULT_IDLE_TIMEOUT_SECONDS = 5,
+    DEFAULT_HEADER_TIMEOUT_SECONDS = 10,
+    MAX_TIMEOUT_SECONDS = 3600,
+    MS_PER_SECOND = 1000,
+
+    CLIENT_SLAB_SIZE = 64,
+
+    DEFAULT_ACCEPT_BATCH = 64,
+    MAX_ACCEPT_BATCH = 65536,
+
+    MAX_WORKER_THREADS = 1024,
+    MAX_RESPONSE_CACHE_BUDGET = 1073741824,
+
+    RESPONSE_HEADERS_CAPACITY = 640,
+    RANGE_HEADERS_CAPACITY = 128, // Accept-Ranges and Content-Range
+    PART_HEADER_CAPACITY = 256, // boundary, Content-Type and Content-Range of one multipart/byteranges part
+    ERROR_BODY_CAPACITY = 64,
+    SENDFILE_CHUNK_SIZE = 1048576, // per connection per wakeup
+    SENDFILE_FALLBACK_BUFFER_SIZE = 65536,
+    MAX_QUEUED_RESPONSES = 16, // pipelined requests answered ahead of sending
+
+    DEFAULT_CONNECTION_QUEUE_LIMIT = 1048576,
+    DEFAULT_QUEUE_LIMIT = 67108864,
+    MAX_QUEUE_LIMIT = 1073741824,
 };
 
-const char * const VALID_HTTP_METHODS[VALID_HTTP_METHODS_LENGTH] = {
-    "GET",
-    "HEAD",
-    "POST",
+enum {
+    HTTP_OK = 200,
+    HTTP_PARTIAL_CONTENT = 206,
+    HTTP_NOT_MODIFIED = 304,
+    HTTP_BAD_REQUEST = 400,
+    HTTP_FORBIDDEN = 403,
+    HTTP_NOT_FOUND = 404,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
+    HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+    HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_NOT_IMPLEMENTED = 501,
+    HTTP_VERSION_NOT_SUPPORTED = 505,
 };
 
+// Results of pushing part of a response to a non-blocking socket
 enum {
-    ERROR_BUFFER_SIZE = 256,
-    PORT_INPUT_BASE = 10,
+    SEND_FAILED = -1,
+    SEND_COMPLETE = 0,
+    SEND_BLOCKED = 1,
+};
 
-    BASE_REQUEST_BUFFER_CAPACITY = 30,
-    REQUEST_BUFFER_INCREASE_THRESHOLD = 20,
+// Results of reading the next request from a non-blocking socket
+enum {
+    READ_FAILED = -1,
+    READ_WAITING = 0,
+    READ_COMPLETE = 1, // state->request holds a whole request
+    READ_REJECTED = 2, // the error response for a malformed request is ready to send
+    READ_QUEUE_FULL = 3, // requests may be left in the buffer until some responses go out
 };
 
-struct http_request {
-    char *method;
-    char *path;
-    char *protocolVersion;
-    char **headers;
+// A part of a multipart/byteranges body after the first: the delimiter and part
+// headers, then a range of the file. The closing delimiter has no range. A gzip
+// body compressed on the fly is sent the same way, as one part without a range.
+struct response_part {
+    const char *header;
+    size_t header_length;
+    off_t file_offset;
+    off_t file_length;
 };
 
-typedef struct http_request http_request;
+typedef struct response_part response_part;
+
+// One response, built while its request is handled and then sent across as
+// many write wakeups as it takes. Seventeen of these live in every client_exchange,
+// so fields are ordered and narrowed to keep that within one small pool buffer.
+struct client_response {
+    bool ready; // fully put together
+    bool keep_alive; // read the next request once this response is sent
+    bool gzip_etag; // the body is gzipped on the fly, tagged as its own variant of the file
+    int status_code;
+    int file_fd; // -1 when the body is not a file
+    uint32_t log_prefix_length;
+    char *headers; // in the connection's arena, NULL when sending a cached response
+    cached_response *cached; // shared, referenced while it is being sent
+    const char *data; // whichever of the two is being sent
+    size_t length;
+    size_t sent;
+
+    const char *encoding_headers; // Vary and Content-Encoding, NULL unless the body is negotiated
+
+    file_cache_entry *file_entry; // reference held while the file is being served
+    off_t file_size;
+    off_t file_offset;
+    off_t file_remaining;
+
+    // multipart/byteranges and compressed bodies only, in the arena. Each part
+    // replaces data and the file range once the previous one is sent.
+    response_part *parts;
+    uint32_t num_parts; // at most MAX_BYTE_RANGES and the closing delimiter
+    uint32_t next_part;
+
+    // access log line up to the status code (log_prefix_length bytes), a '\0',
+    // then the Combined Log Format fields that follow the byte count. In the
+    // arena, NULL unless requests are logged.
+    char *log_line;
+    uint64_t started_us;
+    uint64_t bytes_sent; // headers included
+
+    size_t queued_bytes; // in memory and charged against the queue limits while queued
+};
+
+typedef struct client_response client_response;
+
+// Everything a connection needs only while a request is in flight. Borrowed
+// from the buffer pool when bytes arrive and handed back once the connection is
+// idle again, so thousands of idle keep-alive connections cost next to nothing.
+struct client_exchange {
+    // the request is parsed in place, as slices of request_buffer
+    http_parser parser;
+    http_request request;
+
+    // the response to the request just parsed, while it is being put together
+    client_response response;
+
+    // Responses waiting to be sent, oldest first. Pipelined requests are all
+    // answered up front and their responses go out in order.
+    client_response queued_responses[MAX_QUEUED_RESPONSES];
+    size_t queue_head;
+    size_t queue_length;
+    size_t queued_bytes; // what the queued responses hold in memory, file bodies aside
+};
+
+typedef struct client_exchange client_exchange;
+
+// borrow_exchange takes one small buffer per connection with a request in flight
+_Static_assert(sizeof(client_exchange) <= BUFFER_POOL_SMALL, "client_exchange must fit a small pool buffer");
 
 struct client_state {
-    int socket;
+    int socket; // -1 while the slot is free
+    struct sockaddr_storage peer_addr; // formatted only when something is logged
+    socklen_t peer_addr_len;
 
+    // Slots are reused, the generation tells a stale reference from the current owner
+    uint32_t generation;
+    struct client_state *next_free;
+
+    // from the buffer pool, NULL while the connection is idle
     size_t request_buffer_capacity;
     size_t request_buffer_filled;
+    size_t request_start; // where the request being parsed begins, earlier bytes are answered
     char *request_buffer;
+    client_exchange *exchange;
 
-    char *file_path;
+    // what the event backend read on the connection's behalf, oldest first
+    received_data *received;
+    bool received_end; // the backend saw the peer close or the connection fail
 
-    http_request request;
+    char *file_path; // in the arena
+
+    // Request-scoped memory, reset in one go once every queued response is sent
+    arena arena;
+
+    int http_minor_version;
+    bool header_timer_started; // set once the first byte of a request arrives
+    bool waiting_for_write; // registered for EVENT_WRITE rather than EVENT_READ
+    bool admin; // accepted on the admin port, answered with metrics only
+    bool closing; // the last queued response ends the connection
+    uint64_t request_started_us; // first byte of the request being read, 0 when nothing is timed
+
+    // idle timeout between requests and while sending, header timeout while a request arrives
+    timer_entry timer;
 };
 
 typedef struct client_state client_state;
 
+// Clients live in fixed-size slabs that are never moved or shrunk, so a
+// client_state pointer stays valid for the whole connection
+struct client_slab {
+    struct client_slab *next;
+    client_state slots[CLIENT_SLAB_SIZE];
+};
+
 struct server_context {
     int argc;
     char **argv;
@@ -63,13 +224,88 @@ struct server_context {
     uint16_t port_number;
     const char *root_directory;
 
-    struct pollfd *pollfds;
-    nfds_t pollfds_capacity;
+    const char *user_entered_accept_batch;
+    size_t accept_batch; // connections accepted per listener wakeup
+    const char *user_entered_defer_accept;
+    int defer_accept_seconds; // TCP_DEFER_ACCEPT, 0 wakes on the handshake as usual
+
+    const char *user_entered_max_header_size;
+    size_t max_header_size;
+
+    const char *user_entered_idle_timeout;
+    uint64_t idle_timeout_ms;
+    const char *user_entered_header_timeout;
+    uint64_t header_timeout_ms;
+
+    const char *user_entered_backend;
+    enum event_backend_type backend_type;
+    event_backend backend;
+    timer_wheel timers;
+    uint64_t now_ms; // sampled once per event loop iteration
 
     nfds_t num_clients;
-    struct client_state* clients;
+    client_table clients;
+
+    const char *user_entered_cache_entries;
+    size_t file_cache_entries;
+    const char *user_entered_response_budget;
+    size_t response_cache_budget;
+    file_cache file_cache;
+
+    // gzip on the fly runs on a pool of threads per worker, never in the event loop
+    const char *user_entered_compression_threads;
+    size_t compression_threads; // 0 only serves precompressed .br and .gz siblings
+    const char *user_entered_compression_budget;
+    size_t compression_budget;
+    content_compressor compressor;
+
+    // A slow reader stops having further pipelined requests answered once its
+    // queued responses hold this much memory, and so does every connection with
+    // something queued once all of them together hold queue_limit
+    const char *user_entered_connection_queue_limit;
+    size_t connection_queue_limit;
+    const char *user_entered_queue_limit;
+    size_t queue_limit; // across every worker
+
+    const char *user_entered_threads;
+    size_t num_threads;
+    bool pin_threads;
+
+    // reverse DNS for the log runs on a thread of its own per worker, never in the event loop
+    bool resolve_hostnames;
+    host_resolver resolver;
+
+    const char *user_entered_log_level;
+    enum log_level log_level;
+    const char *user_entered_log_format;
+    enum log_format log_format;
+    const char *log_path; // NULL logs to stdout
+    access_log *access_log; // shared by the workers, NULL at LOG_LEVEL_ERROR
+    log_ring *log_ring; // this worker's
+
+    // scraped on metrics_path or from a listener of its own on the admin port
+    const char *metrics_path;
+    const char *user_entered_admin_port;
+    uint16_t admin_port;
+    int admin_fd; // only the first worker listens on it, -1 everywhere else
+    metrics_registry *metrics; // shared by the workers, NULL without -M or -P
+    metrics_shard *metrics_shard; // this worker's
+
+    // Workers sleep in the backend, the main thread writes here to wake them for shutdown
+    int wakeup_fds[2];
 };
 
 typedef struct server_context server_context;
 
+// Every worker owns a full copy of the context: its own SO_REUSEPORT
+// listener, poller and client table, so workers share nothing on the hot path
+struct worker {
+    pthread_t thread;
+    size_t index;
+    bool started;
+    server_context ctx;
+};
+
+typedef struct worker worker;
+
 #endif /*SERVER_H*/
\ No newline at end of file
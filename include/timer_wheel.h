@@ -0,0 +1,51 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    TIMER_WHEEL_SLOTS = 512, // power of two
+    TIMER_WHEEL_TICK_MS = 100,
+};
+
+// Embedded in whatever can time out, so arming a timer never allocates
+struct timer_entry {
+    struct timer_entry *prev;
+    struct timer_entry *next;
+    uint64_t expires_tick;
+    bool armed;
+    void *data;
+};
+
+typedef struct timer_entry timer_entry;
+
+// Hashed timing wheel: a timer lives in the slot for its expiry tick, so arming,
+// re-arming and cancelling are O(1). Timers further out than one turn share
+// slots with nearer ones and are skipped until their tick comes round.
+struct timer_wheel {
+    timer_entry *slots[TIMER_WHEEL_SLOTS];
+    uint64_t current_tick; // the next tick to expire
+    size_t num_timers;
+};
+
+typedef struct timer_wheel timer_wheel;
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now_ms);
+
+// (Re-)arms the entry to expire at expires_ms, rounded up to the next tick
+void timer_wheel_schedule(timer_wheel *wheel, timer_entry *entry, uint64_t expires_ms);
+
+void timer_wheel_cancel(timer_wheel *wheel, timer_entry *entry);
+
+// How long the event loop may sleep before the next tick is due, -1 with no timers armed
+int timer_wheel_timeout(const timer_wheel *wheel, uint64_t now_ms);
+
+// Unlinks and returns one timer that is due by now_ms, NULL once there are none
+// left. Called before anything is scheduled in a loop iteration.
+timer_entry *timer_wheel_expire(timer_wheel *wheel, uint64_t now_ms);
+
+uint64_t timer_wheel_now_ms(void);
+
+#endif /*TIMER_WHEEL_H*/
@@ -0,0 +1,86 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// The struct of the given type that embeds node as member, NULL for a NULL node
+#define LRU_ENTRY(node, type, member) ((node) == NULL ? NULL : (type *)(void *)((char *)(node) - offsetof(type, member)))
+
+// Embedded in whatever is cached, so moving an entry around never allocates
+struct lru_node {
+    struct lru_node *prev;
+    struct lru_node *next;
+};
+
+typedef struct lru_node lru_node;
+
+// Most recently used at the head, evicted from the tail
+struct lru_list {
+    lru_node *head;
+    lru_node *tail;
+};
+
+typedef struct lru_list lru_list;
+
+// FNV-1a, the hash of every cache's table
+static inline uint64_t hash_bytes(const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    uint64_t             hash  = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static inline void lru_unlink(lru_list *list, lru_node *node)
+{
+    if(node->prev != NULL)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        list->head = node->next;
+    }
+
+    if(node->next != NULL)
+    {
+        node->next->prev = node->prev;
+    }
+    else
+    {
+        list->tail = node->prev;
+    }
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static inline void lru_push_front(lru_list *list, lru_node *node)
+{
+    node->prev = NULL;
+    node->next = list->head;
+    if(list->head != NULL)
+    {
+        list->head->prev = node;
+    }
+    list->head = node;
+    if(list->tail == NULL)
+    {
+        list->tail = node;
+    }
+}
+
+// Signals are for the main thread, so the new thread starts with all of them
+// blocked. Returns 0 or the error number, like pthread_create.
+int start_background_thread(pthread_t *thread, void *(*start)(void *), void *arg);
+
+#endif /*UTIL_H*/
@@ -0,0 +1,299 @@
+#include "../include/access_log.h"
+#include "../include/util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum
+{
+    NS_PER_MS = 1000000,
+};
+
+static void *access_log_main(void *arg);
+
+int access_log_init(access_log *log, size_t num_rings, const char *path)
+{
+    int result;
+
+    memset(log, 0, sizeof(*log));
+    log->fd = STDOUT_FILENO;
+    if(path != NULL)
+    {
+        log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if(log->fd == -1)
+        {
+            return -1;
+        }
+        log->owns_fd = true;
+    }
+
+    log->rings        = calloc(num_rings, sizeof(log_ring));
+    log->write_buffer = malloc(ACCESS_LOG_WRITE_BUFFER_SIZE);
+    if(log->rings == NULL || log->write_buffer == NULL)
+    {
+        access_log_destroy(log);
+        return -1;
+    }
+    for(size_t i = 0; i < num_rings; i++)
+    {
+        log->rings[i].buffer = malloc(ACCESS_LOG_RING_CAPACITY);
+        if(log->rings[i].buffer == NULL)
+        {
+            access_log_destroy(log);
+            return -1;
+        }
+        log->rings[i].capacity = ACCESS_LOG_RING_CAPACITY;
+        log->num_rings++;
+    }
+
+    result = start_background_thread(&log->thread, access_log_main, log);
+    if(result != 0)
+    {
+        access_log_destroy(log);
+        errno = result;
+        return -1;
+    }
+    log->started = true;
+    return 0;
+}
+
+void access_log_destroy(access_log *log)
+{
+    if(log->started)
+    {
+        atomic_store(&log->stopping, true);
+        pthread_join(log->thread, NULL);
+    }
+
+    for(size_t i = 0; i < log->num_rings; i++)
+    {
+        free(log->rings[i].buffer);
+    }
+    free(log->rings);
+    free(log->write_buffer);
+    if(log->owns_fd)
+    {
+        close(log->fd);
+    }
+    memset(log, 0, sizeof(*log));
+    log->fd = -1;
+}
+
+bool log_ring_write(log_ring *ring, const char *line, size_t length)
+{
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    const size_t mask = ring->capacity - 1;
+    size_t       first;
+
+    // the event loop never waits for the writer, it counts what it had to leave out
+    if(ring->capacity - (head - tail) < length)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    first = ring->capacity - (head & mask);
+    if(first > length)
+    {
+        first = length;
+    }
+    memcpy(ring->buffer + (head & mask), line, first);
+    memcpy(ring->buffer, line + first, length - first);
+
+    atomic_store_explicit(&ring->head, head + length, memory_order_release);
+    return true;
+}
+
+bool log_ring_printf(log_ring *ring, const char *format, ...)
+{
+    char    line[ACCESS_LOG_LINE_CAPACITY];
+    va_list args;
+    int     length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if(length < 0)
+    {
+        return false;
+    }
+    if((size_t)length >= sizeof(line))
+    {
+        // cut short, but still a whole line
+        length                 = (int)sizeof(line) - 1;
+        line[sizeof(line) - 2] = '\n';
+    }
+    return log_ring_write(ring, line, (size_t)length);
+}
+
+const char *log_ring_date(log_ring *ring)
+{
+    const time_t now = time(NULL);
+    struct tm    local;
+
+    if(now != ring->date_second || ring->date[0] == '\0')
+    {
+        if(localtime_r(&now, &local) == NULL || strftime(ring->date, sizeof(ring->date), "%d/%b/%Y:%H:%M:%S %z", &local) == 0)
+        {
+            snprintf(ring->date, sizeof(ring->date), "-");
+        }
+        ring->date_second = now;
+    }
+    return ring->date;
+}
+
+size_t access_log_escape(char *field, size_t capacity, const char *value, size_t length)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t            written      = 0;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        const unsigned char c = (unsigned char)value[i];
+        char                escaped[sizeof("\\xff")];
+        size_t              escaped_length;
+
+        if(c == '"' || c == '\\')
+        {
+            escaped[0]     = '\\';
+            escaped[1]     = (char)c;
+            escaped_length = 2;
+        }
+        else if(c < ' ' || c > '~')
+        {
+            escaped[0]     = '\\';
+            escaped[1]     = 'x';
+            escaped[2]     = hex_digits[c >> 4];
+            escaped[3]     = hex_digits[c & 0xf];
+            escaped_length = 4;
+        }
+        else
+        {
+            escaped[0]     = (char)c;
+            escaped_length = 1;
+        }
+
+        // the '\0' takes the last byte
+        if(written + escaped_length >= capacity)
+        {
+            break;
+        }
+        memcpy(field + written, escaped, escaped_length);
+        written += escaped_length;
+    }
+    if(capacity > 0)
+    {
+        field[written] = '\0';
+    }
+    return written;
+}
+
+uint64_t access_log_dropped(access_log *log)
+{
+    uint64_t dropped = 0;
+
+    for(size_t i = 0; i < log->num_rings; i++)
+    {
+        dropped += atomic_load_explicit(&log->rings[i].dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+static void write_all(int fd, const char *data, size_t length)
+{
+    while(length > 0)
+    {
+        const ssize_t written = write(fd, data, length);
+
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            // nowhere left to report it, the lines are lost
+            return;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+// Moves what every ring holds into the write buffer, writing whenever it fills.
+// Returns the number of bytes written.
+static size_t drain_rings(access_log *log)
+{
+    size_t buffered = 0;
+    size_t total    = 0;
+
+    for(size_t i = 0; i < log->num_rings; i++)
+    {
+        log_ring    *ring = &log->rings[i];
+        const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t       tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        const size_t mask = ring->capacity - 1;
+
+        while(tail != head)
+        {
+            size_t chunk = head - tail;
+
+            // contiguous in the ring and in the write buffer
+            if(chunk > ring->capacity - (tail & mask))
+            {
+                chunk = ring->capacity - (tail & mask);
+            }
+            if(chunk > ACCESS_LOG_WRITE_BUFFER_SIZE - buffered)
+            {
+                chunk = ACCESS_LOG_WRITE_BUFFER_SIZE - buffered;
+            }
+            memcpy(log->write_buffer + buffered, ring->buffer + (tail & mask), chunk);
+            buffered += chunk;
+            tail += chunk;
+
+            // the worker may reuse the space as soon as it is copied out
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+            if(buffered == ACCESS_LOG_WRITE_BUFFER_SIZE)
+            {
+                write_all(log->fd, log->write_buffer, buffered);
+                total += buffered;
+                buffered = 0;
+            }
+        }
+    }
+
+    if(buffered > 0)
+    {
+        write_all(log->fd, log->write_buffer, buffered);
+        total += buffered;
+    }
+    return total;
+}
+
+static void *access_log_main(void *arg)
+{
+    access_log           *log   = arg;
+    const struct timespec pause = {0, (long)ACCESS_LOG_FLUSH_INTERVAL_MS * NS_PER_MS};
+
+    while(true)
+    {
+        const bool stopping = atomic_load(&log->stopping);
+
+        // the workers are done by the time stopping is set, one more pass catches their last lines
+        if(drain_rings(log) == 0)
+        {
+            if(stopping)
+            {
+                return NULL;
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+}
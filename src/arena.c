@@ -0,0 +1,98 @@
+#include "../include/arena.h"
+#include <stdalign.h>
+#include <stdint.h>
+
+#define ARENA_BLOCK_CAPACITY (ARENA_BLOCK_SIZE - offsetof(arena_block, data))
+
+static arena_block *take_block(size_t capacity)
+{
+    arena_block *block = buffer_pool_acquire(offsetof(arena_block, data) + capacity);
+
+    if(block == NULL)
+    {
+        return NULL;
+    }
+    block->next     = NULL;
+    block->capacity = capacity;
+    return block;
+}
+
+static void release_blocks(arena_block *block)
+{
+    while(block != NULL)
+    {
+        arena_block *next = block->next;
+
+        buffer_pool_release(block);
+        block = next;
+    }
+}
+
+static void *alloc_large(arena *a, size_t size)
+{
+    arena_block *block = take_block(size);
+
+    if(block == NULL)
+    {
+        return NULL;
+    }
+    block->next = a->large;
+    a->large    = block;
+    return block->data;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    void *memory;
+
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if(size > ARENA_BLOCK_CAPACITY)
+    {
+        return alloc_large(a, size);
+    }
+
+    if(a->current == NULL)
+    {
+        a->first = take_block(ARENA_BLOCK_CAPACITY);
+        if(a->first == NULL)
+        {
+            return NULL;
+        }
+        a->current = a->first;
+        a->used    = 0;
+    }
+    else if(a->used + size > a->current->capacity)
+    {
+        // blocks kept from an earlier, bigger request are used again before taking new ones
+        if(a->current->next == NULL)
+        {
+            a->current->next = take_block(ARENA_BLOCK_CAPACITY);
+            if(a->current->next == NULL)
+            {
+                return NULL;
+            }
+        }
+        a->current = a->current->next;
+        a->used    = 0;
+    }
+
+    memory = a->current->data + a->used;
+    a->used += size;
+    return memory;
+}
+
+void arena_reset(arena *a)
+{
+    release_blocks(a->large);
+    a->large   = NULL;
+    a->current = a->first;
+    a->used    = 0;
+}
+
+void arena_destroy(arena *a)
+{
+    arena_reset(a);
+    release_blocks(a->first);
+    a->first   = NULL;
+    a->current = NULL;
+}
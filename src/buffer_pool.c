@@ -0,0 +1,228 @@
+#include "../include/buffer_pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG_SHIFT 32
+#define INDEX_MASK 0xffffffffU
+
+// Free buffers are linked by index rather than by pointer, so the stack head fits
+// a tag next to the index and a pop cannot be fooled by a buffer that was popped
+// and pushed again in between (ABA). Slabs are never freed while the pool is in
+// use, so reading the next index of a buffer someone else just took is harmless.
+struct buffer_class {
+    _Alignas(BUFFER_POOL_CACHE_LINE) atomic_uint_fast64_t head; // tag << 32 | (index + 1)
+    _Alignas(BUFFER_POOL_CACHE_LINE) pthread_mutex_t grow_lock;
+    size_t size;
+    size_t num_slabs;
+    _Atomic(unsigned char *) slabs[BUFFER_POOL_MAX_SLABS];
+};
+
+struct buffer_cache {
+    pool_buffer *buffers[BUFFER_POOL_CACHE_CAPACITY];
+    size_t count;
+};
+
+// NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables)
+static struct buffer_class classes[BUFFER_POOL_CLASSES] = {
+    {.grow_lock = PTHREAD_MUTEX_INITIALIZER, .size = BUFFER_POOL_SMALL},
+    {.grow_lock = PTHREAD_MUTEX_INITIALIZER, .size = BUFFER_POOL_LARGE},
+};
+static atomic_size_t reserved_bytes;
+
+static _Thread_local struct buffer_cache thread_caches[BUFFER_POOL_CLASSES];
+static _Thread_local size_t              thread_bytes;
+// NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables)
+
+static size_t unit_size(const struct buffer_class *pool)
+{
+    return sizeof(pool_buffer) + pool->size;
+}
+
+static pool_buffer *buffer_at(struct buffer_class *pool, uint32_t index)
+{
+    unsigned char *slab = atomic_load_explicit(&pool->slabs[index / BUFFER_POOL_SLAB_BUFFERS], memory_order_acquire);
+
+    return (pool_buffer *)(slab + ((index % BUFFER_POOL_SLAB_BUFFERS) * unit_size(pool)));
+}
+
+static void push_shared(struct buffer_class *pool, pool_buffer *buffer)
+{
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    uint64_t next;
+
+    do
+    {
+        atomic_store_explicit(&buffer->next, (uint32_t)(head & INDEX_MASK), memory_order_relaxed);
+        next = ((((head >> TAG_SHIFT) + 1) & INDEX_MASK) << TAG_SHIFT) | (buffer->index + 1);
+    } while(!atomic_compare_exchange_weak_explicit(&pool->head, &head, next, memory_order_release, memory_order_relaxed));
+}
+
+static pool_buffer *pop_shared(struct buffer_class *pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+
+    while((head & INDEX_MASK) != 0)
+    {
+        pool_buffer   *buffer = buffer_at(pool, (uint32_t)(head & INDEX_MASK) - 1);
+        const uint64_t next   = ((((head >> TAG_SHIFT) + 1) & INDEX_MASK) << TAG_SHIFT) | atomic_load_explicit(&buffer->next, memory_order_relaxed);
+
+        if(atomic_compare_exchange_weak_explicit(&pool->head, &head, next, memory_order_acquire, memory_order_acquire))
+        {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+// Carves a new slab straight into the (empty) thread cache
+static bool grow_class(struct buffer_class *pool, struct buffer_cache *cache)
+{
+    unsigned char *slab;
+    size_t         slab_index;
+
+    pthread_mutex_lock(&pool->grow_lock);
+    slab_index = pool->num_slabs;
+    slab       = slab_index < BUFFER_POOL_MAX_SLABS ? aligned_alloc(BUFFER_POOL_CACHE_LINE, BUFFER_POOL_SLAB_BUFFERS * unit_size(pool)) : NULL;
+    if(slab == NULL)
+    {
+        pthread_mutex_unlock(&pool->grow_lock);
+        return false;
+    }
+    atomic_store_explicit(&pool->slabs[slab_index], slab, memory_order_release);
+    pool->num_slabs++;
+    pthread_mutex_unlock(&pool->grow_lock);
+
+    for(size_t i = 0; i < BUFFER_POOL_SLAB_BUFFERS; i++)
+    {
+        pool_buffer *buffer = (pool_buffer *)(slab + (i * unit_size(pool)));
+
+        atomic_init(&buffer->next, 0);
+        buffer->index                 = (uint32_t)((slab_index * BUFFER_POOL_SLAB_BUFFERS) + i);
+        buffer->size_class            = (uint32_t)(pool - classes);
+        buffer->size                  = (uint32_t)pool->size;
+        cache->buffers[cache->count++] = buffer;
+    }
+    atomic_fetch_add_explicit(&reserved_bytes, BUFFER_POOL_SLAB_BUFFERS * unit_size(pool), memory_order_relaxed);
+    return true;
+}
+
+static size_t class_for(size_t size)
+{
+    for(size_t i = 0; i < BUFFER_POOL_CLASSES; i++)
+    {
+        if(size <= classes[i].size)
+        {
+            return i;
+        }
+    }
+    return BUFFER_POOL_CLASSES;
+}
+
+size_t buffer_pool_size(size_t size)
+{
+    const size_t size_class = class_for(size);
+
+    return size_class == BUFFER_POOL_CLASSES ? size : classes[size_class].size;
+}
+
+void *buffer_pool_acquire(size_t size)
+{
+    const size_t         size_class = class_for(size);
+    struct buffer_class *pool;
+    struct buffer_cache *cache;
+    pool_buffer         *buffer;
+
+    if(size_class == BUFFER_POOL_CLASSES)
+    {
+        buffer = aligned_alloc(BUFFER_POOL_CACHE_LINE, (sizeof(pool_buffer) + size + BUFFER_POOL_CACHE_LINE - 1) & ~(size_t)(BUFFER_POOL_CACHE_LINE - 1));
+        if(buffer == NULL)
+        {
+            return NULL;
+        }
+        buffer->size_class = BUFFER_POOL_CLASSES;
+        buffer->size       = (uint32_t)size;
+        thread_bytes += size;
+        return buffer->data;
+    }
+
+    pool  = &classes[size_class];
+    cache = &thread_caches[size_class];
+    if(cache->count == 0)
+    {
+        // refill half the cache, so the next few releases do not have to give any back
+        while(cache->count < BUFFER_POOL_CACHE_BATCH && (buffer = pop_shared(pool)) != NULL)
+        {
+            cache->buffers[cache->count++] = buffer;
+        }
+        if(cache->count == 0 && !grow_class(pool, cache))
+        {
+            return NULL;
+        }
+    }
+
+    buffer = cache->buffers[--cache->count];
+    thread_bytes += buffer->size;
+    return buffer->data;
+}
+
+void buffer_pool_release(void *buffer)
+{
+    pool_buffer         *header;
+    struct buffer_cache *cache;
+
+    if(buffer == NULL)
+    {
+        return;
+    }
+
+    header = (pool_buffer *)((unsigned char *)buffer - offsetof(pool_buffer, data));
+
+    // at shutdown one thread releases what the stopped workers held
+    thread_bytes -= header->size < thread_bytes ? header->size : thread_bytes;
+    if(header->size_class == BUFFER_POOL_CLASSES)
+    {
+        free(header);
+        return;
+    }
+
+    cache = &thread_caches[header->size_class];
+    if(cache->count == BUFFER_POOL_CACHE_CAPACITY)
+    {
+        // the older half goes to the other threads
+        for(size_t i = 0; i < BUFFER_POOL_CACHE_BATCH; i++)
+        {
+            push_shared(&classes[header->size_class], cache->buffers[i]);
+        }
+        memmove(cache->buffers, cache->buffers + BUFFER_POOL_CACHE_BATCH, (BUFFER_POOL_CACHE_CAPACITY - BUFFER_POOL_CACHE_BATCH) * sizeof(pool_buffer *));
+        cache->count -= BUFFER_POOL_CACHE_BATCH;
+    }
+    cache->buffers[cache->count++] = header;
+}
+
+size_t buffer_pool_thread_bytes(void)
+{
+    return thread_bytes;
+}
+
+size_t buffer_pool_reserved_bytes(void)
+{
+    return atomic_load_explicit(&reserved_bytes, memory_order_relaxed);
+}
+
+void buffer_pool_destroy(void)
+{
+    for(size_t i = 0; i < BUFFER_POOL_CLASSES; i++)
+    {
+        for(size_t slab = 0; slab < classes[i].num_slabs; slab++)
+        {
+            free(atomic_load_explicit(&classes[i].slabs[slab], memory_order_relaxed));
+            atomic_store_explicit(&classes[i].slabs[slab], NULL, memory_order_relaxed);
+        }
+        classes[i].num_slabs = 0;
+        atomic_store_explicit(&classes[i].head, 0, memory_order_relaxed);
+        thread_caches[i].count = 0;
+    }
+    atomic_store_explicit(&reserved_bytes, 0, memory_order_relaxed);
+}
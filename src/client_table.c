@@ -0,0 +1,52 @@
+#include "../include/client_table.h"
+#include "../include/server.h"
+#include <stdlib.h>
+#include <string.h>
+
+void client_table_init(client_table *table)
+{
+    table->slabs     = NULL;
+    table->free_list = NULL;
+}
+
+client_state *client_table_acquire(client_table *table)
+{
+    client_state *state;
+    uint32_t      generation;
+
+    if(table->free_list == NULL)
+    {
+        struct client_slab *slab = calloc(1, sizeof(struct client_slab));
+        if(slab == NULL)
+        {
+            return NULL;
+        }
+
+        // thread every slot of the new slab onto the free list
+        for(size_t i = 0; i < CLIENT_SLAB_SIZE; i++)
+        {
+            slab->slots[i].socket    = -1;
+            slab->slots[i].next_free = i + 1 < CLIENT_SLAB_SIZE ? &slab->slots[i + 1] : NULL;
+        }
+        slab->next       = table->slabs;
+        table->slabs     = slab;
+        table->free_list = &slab->slots[0];
+    }
+
+    state            = table->free_list;
+    table->free_list = state->next_free;
+
+    generation = state->generation;
+    memset(state, 0, sizeof(*state));
+    state->generation = generation;
+    state->socket     = -1;
+    return state;
+}
+
+void client_table_release(client_table *table, client_state *state)
+{
+    state->socket = -1;
+    state->generation++;
+    state->next_free = table->free_list;
+    table->free_list = state;
+}
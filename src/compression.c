@@ -0,0 +1,461 @@
+#include "../include/compression.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+enum
+{
+    GZIP_WINDOW_BITS     = 15 + 16,    // the largest window, with a gzip header and trailer
+    DEFLATE_MEMORY_LEVEL = 8,
+    AVERAGE_ENTRY_BYTES  = 4096,    // sizes the hash table from the budget
+    MIN_BUCKETS          = 64,
+    MIN_SAVING_DIVISOR   = 8,    // a body must lose at least an eighth to be worth sending
+    PIPE_DRAIN_BUFFER    = 64,
+};
+
+static void remove_entry(content_compressor *compressor, compression_entry *entry)
+{
+    compression_entry **link = &compressor->buckets[entry->hash & (compressor->num_buckets - 1)];
+
+    while(*link != entry)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    lru_unlink(&compressor->lru, &entry->lru);
+    compressor->bytes -= entry->cost;
+    if(entry->body != NULL)
+    {
+        // a response still sending it keeps its own reference
+        cached_response_release(entry->body);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+// Drops the least recently used finished entries until the cache is back under budget
+static void enforce_budget(content_compressor *compressor)
+{
+    compression_entry *entry = LRU_ENTRY(compressor->lru.tail, compression_entry, lru);
+
+    while(compressor->bytes > compressor->budget && entry != NULL)
+    {
+        compression_entry *previous = LRU_ENTRY(entry->lru.prev, compression_entry, lru);
+
+        if(!entry->pending)
+        {
+            remove_entry(compressor, entry);
+        }
+        entry = previous;
+    }
+}
+
+static compression_entry *find_entry(content_compressor *compressor, const char *path, size_t path_length, uint64_t hash)
+{
+    compression_entry *entry = compressor->buckets[hash & (compressor->num_buckets - 1)];
+
+    while(entry != NULL)
+    {
+        if(entry->hash == hash && entry->path_length == path_length && memcmp(entry->path, path, path_length) == 0)
+        {
+            if(compressor->lru.head != &entry->lru)
+            {
+                lru_unlink(&compressor->lru, &entry->lru);
+                lru_push_front(&compressor->lru, &entry->lru);
+            }
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+static compression_entry *insert_entry(content_compressor *compressor, const char *path, size_t path_length, uint64_t hash)
+{
+    compression_entry *entry = calloc(1, sizeof(compression_entry));
+    size_t             bucket;
+
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    entry->path = malloc(path_length + 1);
+    if(entry->path == NULL)
+    {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->path, path, path_length + 1);
+    entry->path_length = path_length;
+    entry->hash        = hash;
+    entry->cost        = sizeof(compression_entry) + path_length + 1;
+
+    bucket                      = hash & (compressor->num_buckets - 1);
+    entry->hash_next            = compressor->buckets[bucket];
+    compressor->buckets[bucket] = entry;
+    lru_push_front(&compressor->lru, &entry->lru);
+    compressor->bytes += entry->cost;
+    return entry;
+}
+
+static bool read_whole_file(int fd, unsigned char *buffer, size_t size)
+{
+    size_t filled = 0;
+
+    while(filled < size)
+    {
+        const ssize_t result = pread(fd, buffer + filled, size - filled, (off_t)filled);
+
+        if(result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(result <= 0)
+        {
+            return false;
+        }
+        filled += (size_t)result;
+    }
+    return true;
+}
+
+static cached_response *deflate_buffer(const unsigned char *input, size_t size)
+{
+    z_stream         stream = {0};
+    cached_response *body;
+    size_t           bound;
+    size_t           length;
+
+    if(deflateInit2(&stream, COMPRESSION_LEVEL, Z_DEFLATED, GZIP_WINDOW_BITS, DEFLATE_MEMORY_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return NULL;
+    }
+
+    // room for the worst case, so one deflate call finishes the stream
+    bound = deflateBound(&stream, (uLong)size);
+    body  = malloc(sizeof(cached_response) + bound);
+    if(body == NULL)
+    {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in   = (Bytef *)(uintptr_t)input;
+    stream.avail_in  = (uInt)size;
+    stream.next_out  = (Bytef *)body->data;
+    stream.avail_out = (uInt)bound;
+    if(deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&stream);
+        free(body);
+        return NULL;
+    }
+    length = stream.total_out;
+    deflateEnd(&stream);
+
+    if(length > size - (size / MIN_SAVING_DIVISOR))
+    {
+        free(body);
+        return NULL;
+    }
+    body->references    = 1;
+    body->header_length = 0;
+    body->length        = length;
+    return body;
+}
+
+// Runs on a pool thread. Only the path, mtime and size of the entry are read,
+// and they do not change while it is pending.
+static cached_response *compress_file(const compression_entry *entry)
+{
+    cached_response *body = NULL;
+    unsigned char   *input;
+    struct stat      st;
+    int              fd;
+
+    fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        return NULL;
+    }
+
+    // a file that changed since the request saw it gets a new entry once the file cache notices
+    if(fstat(fd, &st) == -1 || st.st_size != entry->size || st.st_mtime != entry->mtime.tv_sec)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    input = malloc((size_t)entry->size);
+    if(input != NULL && read_whole_file(fd, input, (size_t)entry->size))
+    {
+        body = deflate_buffer(input, (size_t)entry->size);
+    }
+    free(input);
+    close(fd);
+    return body;
+}
+
+static void *compressor_main(void *arg)
+{
+    content_compressor *self = arg;
+
+    while(true)
+    {
+        compression_job job;
+
+        pthread_mutex_lock(&self->lock);
+        while(!self->stopping && self->queue_length == 0)
+        {
+            pthread_cond_wait(&self->wakeup, &self->lock);
+        }
+        if(self->stopping)
+        {
+            pthread_mutex_unlock(&self->lock);
+            return NULL;
+        }
+        job              = self->queue[self->queue_head];
+        self->queue_head = (self->queue_head + 1) % COMPRESSION_QUEUE_CAPACITY;
+        self->queue_length--;
+        pthread_mutex_unlock(&self->lock);
+
+        job.body = compress_file(job.entry);
+
+        // outstanding jobs never exceed the capacity, so there is always room
+        pthread_mutex_lock(&self->lock);
+        self->done[self->done_length++] = job;
+        pthread_mutex_unlock(&self->lock);
+
+        // a full pipe already holds a wakeup the event loop has not read yet
+        while(write(self->result_fds[1], "", 1) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+static void close_result_pipe(content_compressor *compressor)
+{
+    close(compressor->result_fds[0]);
+    close(compressor->result_fds[1]);
+    compressor->result_fds[0] = -1;
+    compressor->result_fds[1] = -1;
+}
+
+static void stop_threads(content_compressor *compressor, size_t num_started)
+{
+    pthread_mutex_lock(&compressor->lock);
+    compressor->stopping = true;
+    pthread_cond_broadcast(&compressor->wakeup);
+    pthread_mutex_unlock(&compressor->lock);
+    for(size_t i = 0; i < num_started; i++)
+    {
+        pthread_join(compressor->threads[i], NULL);
+    }
+}
+
+int compressor_init(content_compressor *compressor, size_t num_threads, size_t budget)
+{
+    int    result = 0;
+    size_t started;
+
+    memset(compressor, 0, sizeof(*compressor));
+    compressor->result_fds[0] = -1;
+    compressor->result_fds[1] = -1;
+    if(num_threads == 0)
+    {
+        return 0;
+    }
+
+    compressor->num_buckets = MIN_BUCKETS;
+    while(compressor->num_buckets < budget / AVERAGE_ENTRY_BYTES)
+    {
+        compressor->num_buckets *= 2;
+    }
+    compressor->budget  = budget;
+    compressor->buckets = calloc(compressor->num_buckets, sizeof(compression_entry *));
+    compressor->threads = calloc(num_threads, sizeof(pthread_t));
+    if(compressor->buckets == NULL || compressor->threads == NULL)
+    {
+        free(compressor->buckets);
+        free(compressor->threads);
+        compressor->buckets = NULL;
+        compressor->threads = NULL;
+        return -1;
+    }
+
+    if(pipe(compressor->result_fds) == -1)
+    {
+        free(compressor->buckets);
+        free(compressor->threads);
+        compressor->buckets = NULL;
+        compressor->threads = NULL;
+        return -1;
+    }
+    for(size_t i = 0; i < 2; i++)
+    {
+        if(fcntl(compressor->result_fds[i], F_SETFD, FD_CLOEXEC) == -1 || fcntl(compressor->result_fds[i], F_SETFL, O_NONBLOCK) == -1)
+        {
+            close_result_pipe(compressor);
+            free(compressor->buckets);
+            free(compressor->threads);
+            compressor->buckets = NULL;
+            compressor->threads = NULL;
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&compressor->lock, NULL);
+    pthread_cond_init(&compressor->wakeup, NULL);
+
+    for(started = 0; started < num_threads && result == 0; started++)
+    {
+        result = start_background_thread(&compressor->threads[started], compressor_main, compressor);
+    }
+    if(result != 0)
+    {
+        stop_threads(compressor, started - 1);
+        pthread_cond_destroy(&compressor->wakeup);
+        pthread_mutex_destroy(&compressor->lock);
+        close_result_pipe(compressor);
+        free(compressor->buckets);
+        free(compressor->threads);
+        compressor->buckets = NULL;
+        compressor->threads = NULL;
+        errno               = result;
+        return -1;
+    }
+    compressor->num_threads = num_threads;
+    return 0;
+}
+
+void compressor_destroy(content_compressor *compressor)
+{
+    if(compressor->num_threads == 0)
+    {
+        return;
+    }
+
+    // files being compressed are waited for, the rest of the queue is dropped
+    stop_threads(compressor, compressor->num_threads);
+    for(size_t i = 0; i < compressor->done_length; i++)
+    {
+        if(compressor->done[i].body != NULL)
+        {
+            cached_response_release(compressor->done[i].body);
+        }
+    }
+    pthread_cond_destroy(&compressor->wakeup);
+    pthread_mutex_destroy(&compressor->lock);
+    close_result_pipe(compressor);
+
+    while(compressor->lru.head != NULL)
+    {
+        remove_entry(compressor, LRU_ENTRY(compressor->lru.head, compression_entry, lru));
+    }
+    free(compressor->buckets);
+    free(compressor->threads);
+    compressor->buckets     = NULL;
+    compressor->threads     = NULL;
+    compressor->num_threads = 0;
+}
+
+cached_response *compressor_lookup(content_compressor *compressor, const char *path, const struct timespec *mtime, off_t size)
+{
+    const size_t       path_length = strlen(path);
+    const uint64_t     hash        = hash_bytes(path, path_length);
+    compression_entry *entry;
+    bool               queued = false;
+
+    if(compressor->num_threads == 0 || size < COMPRESSION_MIN_SIZE || size > COMPRESSION_MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    entry = find_entry(compressor, path, path_length, hash);
+    if(entry != NULL && !entry->pending && (entry->size != size || entry->mtime.tv_sec != mtime->tv_sec || entry->mtime.tv_nsec != mtime->tv_nsec))
+    {
+        // compressed from an older version of the file
+        remove_entry(compressor, entry);
+        entry = NULL;
+    }
+    if(entry != NULL)
+    {
+        if(entry->body == NULL)
+        {
+            return NULL;
+        }
+        compressor->hits++;
+        entry->body->references++;
+        return entry->body;
+    }
+
+    compressor->misses++;
+    entry = insert_entry(compressor, path, path_length, hash);
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    entry->mtime   = *mtime;
+    entry->size    = size;
+    entry->pending = true;
+
+    pthread_mutex_lock(&compressor->lock);
+    if(compressor->outstanding < COMPRESSION_QUEUE_CAPACITY)
+    {
+        compression_job *job = &compressor->queue[(compressor->queue_head + compressor->queue_length) % COMPRESSION_QUEUE_CAPACITY];
+
+        job->entry = entry;
+        job->body  = NULL;
+        compressor->queue_length++;
+        compressor->outstanding++;
+        pthread_cond_signal(&compressor->wakeup);
+        queued = true;
+    }
+    pthread_mutex_unlock(&compressor->lock);
+
+    // with the pool busy the file is tried again by a later request
+    if(!queued)
+    {
+        remove_entry(compressor, entry);
+    }
+    return NULL;
+}
+
+void compressor_process_results(content_compressor *compressor)
+{
+    compression_job jobs[COMPRESSION_QUEUE_CAPACITY];
+    size_t          num_jobs;
+    char            drain[PIPE_DRAIN_BUFFER];
+    ssize_t         drained;
+
+    // the bytes are only wakeups, the jobs themselves are in done
+    do
+    {
+        drained = read(compressor->result_fds[0], drain, sizeof(drain));
+    } while(drained > 0 || (drained == -1 && errno == EINTR));
+
+    pthread_mutex_lock(&compressor->lock);
+    num_jobs = compressor->done_length;
+    memcpy(jobs, compressor->done, num_jobs * sizeof(compression_job));
+    compressor->done_length = 0;
+    compressor->outstanding -= num_jobs;
+    pthread_mutex_unlock(&compressor->lock);
+
+    for(size_t i = 0; i < num_jobs; i++)
+    {
+        compression_entry *entry = jobs[i].entry;
+
+        entry->pending = false;
+        entry->body    = jobs[i].body;
+        if(entry->body != NULL)
+        {
+            entry->cost += sizeof(cached_response) + entry->body->length;
+            compressor->bytes += sizeof(cached_response) + entry->body->length;
+        }
+    }
+    enforce_budget(compressor);
+}
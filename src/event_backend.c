@@ -0,0 +1,1276 @@
+#ifdef __linux__
+    #define _GNU_SOURCE    // NOLINT syscall
+#endif
+
+#include "../include/event_backend.h"
+#include "../include/buffer_pool.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #if defined(__has_include)
+        #if __has_include(<linux/io_uring.h>)
+            #include <linux/io_uring.h>
+            #include <sys/mman.h>
+            #include <sys/socket.h>
+            #include <sys/syscall.h>
+            // multishot polls came with 5.13, buffer rings and multishot accept with 5.19
+            #if defined(IORING_FEAT_RSRC_TAGS) && defined(IORING_ACCEPT_MULTISHOT)
+                #define HAVE_IO_URING
+            #endif
+            #ifndef IORING_SETUP_SUBMIT_ALL
+                #define IORING_SETUP_SUBMIT_ALL 0
+            #endif
+            #ifndef IORING_SETUP_COOP_TASKRUN
+                #define IORING_SETUP_COOP_TASKRUN 0
+            #endif
+        #endif
+    #endif
+#endif
+
+enum
+{
+    INITIAL_BACKEND_CAPACITY = 16,
+    EPOLL_WAIT_BATCH         = 256,
+    URING_SQ_ENTRIES         = 256,
+    URING_CQ_ENTRIES         = 4096,    // one poll per fd can complete at once
+    URING_KIND_SHIFT         = 32,
+    URING_KIND_MASK          = 3,
+    URING_SEQUENCE_SHIFT     = 34,
+    URING_SEQUENCE_MASK      = 0x3FFFFFFF,
+    URING_RECEIVE_BUFFERS    = 256,    // per worker, a power of two
+    URING_BUFFER_GROUP       = 0,
+    MS_PER_SECOND            = 1000,
+    NS_PER_MS                = 1000000,
+};
+
+static int poll_backend_init(event_backend *backend)
+{
+    backend->pollfds_capacity = INITIAL_BACKEND_CAPACITY;
+    backend->num_pollfds      = 0;
+
+    backend->pollfds   = malloc(sizeof(struct pollfd) * backend->pollfds_capacity);
+    backend->poll_data = malloc(sizeof(void *) * backend->pollfds_capacity);
+    if(backend->pollfds == NULL || backend->poll_data == NULL)
+    {
+        free(backend->pollfds);
+        free((void *)backend->poll_data);
+        backend->pollfds   = NULL;
+        backend->poll_data = NULL;
+        return -1;
+    }
+
+    backend->poll_index          = NULL;
+    backend->poll_index_capacity = 0;
+    return 0;
+}
+
+static short to_poll_events(uint32_t interest)
+{
+    short events = 0;
+
+    if(interest & EVENT_READ)
+    {
+        events |= POLLIN;
+    }
+    if(interest & EVENT_WRITE)
+    {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
+static int poll_backend_add(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    // make sure the fd -> slot map covers this fd
+    if((size_t)fd >= backend->poll_index_capacity)
+    {
+        size_t   new_capacity = backend->poll_index_capacity == 0 ? INITIAL_BACKEND_CAPACITY : backend->poll_index_capacity;
+        ssize_t *new_index;
+
+        while(new_capacity <= (size_t)fd)
+        {
+            new_capacity *= 2;
+        }
+
+        new_index = realloc(backend->poll_index, sizeof(ssize_t) * new_capacity);
+        if(new_index == NULL)
+        {
+            return -1;
+        }
+        for(size_t i = backend->poll_index_capacity; i < new_capacity; i++)
+        {
+            new_index[i] = -1;
+        }
+        backend->poll_index          = new_index;
+        backend->poll_index_capacity = new_capacity;
+    }
+
+    if(backend->num_pollfds >= backend->pollfds_capacity)
+    {
+        nfds_t         new_capacity = backend->pollfds_capacity * 2;
+        struct pollfd *new_pollfds;
+        void         **new_data;
+
+        new_pollfds = realloc(backend->pollfds, sizeof(struct pollfd) * new_capacity);
+        if(new_pollfds == NULL)
+        {
+            return -1;
+        }
+        backend->pollfds = new_pollfds;
+
+        new_data = realloc((void *)backend->poll_data, sizeof(void *) * new_capacity);
+        if(new_data == NULL)
+        {
+            return -1;
+        }
+        backend->poll_data        = new_data;
+        backend->pollfds_capacity = new_capacity;
+    }
+
+    backend->pollfds[backend->num_pollfds].fd      = fd;
+    backend->pollfds[backend->num_pollfds].events  = to_poll_events(interest);
+    backend->pollfds[backend->num_pollfds].revents = 0;
+    backend->poll_data[backend->num_pollfds]       = data;
+    backend->poll_index[fd]                        = (ssize_t)backend->num_pollfds;
+    backend->num_pollfds++;
+    return 0;
+}
+
+static int poll_backend_modify(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    ssize_t slot;
+
+    if(fd < 0 || (size_t)fd >= backend->poll_index_capacity || backend->poll_index[fd] == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    slot                          = backend->poll_index[fd];
+    backend->pollfds[slot].events = to_poll_events(interest);
+    backend->poll_data[slot]      = data;
+    return 0;
+}
+
+static int poll_backend_remove(event_backend *backend, int fd)
+{
+    ssize_t slot;
+    nfds_t  last;
+
+    if(fd < 0 || (size_t)fd >= backend->poll_index_capacity || backend->poll_index[fd] == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // swap the last pollfd into the hole instead of shifting everything down
+    slot = backend->poll_index[fd];
+    last = backend->num_pollfds - 1;
+    if((nfds_t)slot != last)
+    {
+        backend->pollfds[slot]                         = backend->pollfds[last];
+        backend->poll_data[slot]                       = backend->poll_data[last];
+        backend->poll_index[backend->pollfds[slot].fd] = slot;
+    }
+    backend->poll_index[fd] = -1;
+    backend->num_pollfds--;
+    return 0;
+}
+
+static int poll_backend_wait(event_backend *backend, backend_event *events, int max_events, int timeout_ms)
+{
+    int ready;
+    int count = 0;
+
+    ready = poll(backend->pollfds, backend->num_pollfds, timeout_ms);
+    if(ready <= 0)
+    {
+        return ready;
+    }
+
+    for(nfds_t i = 0; i < backend->num_pollfds && count < ready && count < max_events; i++)
+    {
+        const short revents = backend->pollfds[i].revents;
+
+        if(revents == 0)
+        {
+            continue;
+        }
+
+        events[count].events = 0;
+        if(revents & POLLIN)
+        {
+            events[count].events |= EVENT_READ;
+        }
+        if(revents & POLLOUT)
+        {
+            events[count].events |= EVENT_WRITE;
+        }
+        if(revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            events[count].events |= EVENT_ERROR;
+        }
+        events[count].data = backend->poll_data[i];
+        count++;
+    }
+    return count;
+}
+
+static void poll_backend_destroy(event_backend *backend)
+{
+    free(backend->pollfds);
+    free((void *)backend->poll_data);
+    free(backend->poll_index);
+    backend->pollfds    = NULL;
+    backend->poll_data  = NULL;
+    backend->poll_index = NULL;
+}
+
+static const struct event_backend_ops poll_backend_ops = {
+    .name    = "poll",
+    .init    = poll_backend_init,
+    .add     = poll_backend_add,
+    .modify  = poll_backend_modify,
+    .remove  = poll_backend_remove,
+    .wait    = poll_backend_wait,
+    .destroy = poll_backend_destroy,
+};
+
+#ifdef __linux__
+static int epoll_backend_init(event_backend *backend)
+{
+    backend->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return backend->epoll_fd == -1 ? -1 : 0;
+}
+
+static uint32_t to_epoll_events(uint32_t interest)
+{
+    uint32_t events = 0;
+
+    if(interest & EVENT_READ)
+    {
+        events |= EPOLLIN;
+    }
+    if(interest & EVENT_WRITE)
+    {
+        events |= EPOLLOUT;
+    }
+
+    // Clients are edge-triggered, the server always drains them until EAGAIN.
+    // A listener shared with other pollers wakes only one of them
+    // (EPOLLEXCLUSIVE does not accept EPOLLRDHUP).
+    if(interest & EVENT_EXCLUSIVE)
+    {
+        events |= EPOLLEXCLUSIVE;
+    }
+    else
+    {
+        events |= EPOLLET | EPOLLRDHUP;
+    }
+    return events;
+}
+
+static int epoll_backend_add(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    struct epoll_event event = {0};
+
+    event.events   = to_epoll_events(interest);
+    event.data.ptr = data;
+    return epoll_ctl(backend->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static int epoll_backend_modify(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    struct epoll_event event = {0};
+
+    event.events   = to_epoll_events(interest);
+    event.data.ptr = data;
+    return epoll_ctl(backend->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static int epoll_backend_remove(event_backend *backend, int fd)
+{
+    return epoll_ctl(backend->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_backend_wait(event_backend *backend, backend_event *events, int max_events, int timeout_ms)
+{
+    struct epoll_event epoll_events[EPOLL_WAIT_BATCH];
+    int                ready;
+
+    if(max_events > EPOLL_WAIT_BATCH)
+    {
+        max_events = EPOLL_WAIT_BATCH;
+    }
+
+    ready = epoll_wait(backend->epoll_fd, epoll_events, max_events, timeout_ms);
+    for(int i = 0; i < ready; i++)
+    {
+        events[i].events = 0;
+        if(epoll_events[i].events & EPOLLIN)
+        {
+            events[i].events |= EVENT_READ;
+        }
+        if(epoll_events[i].events & EPOLLOUT)
+        {
+            events[i].events |= EVENT_WRITE;
+        }
+        if(epoll_events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        {
+            events[i].events |= EVENT_ERROR;
+        }
+        events[i].data = epoll_events[i].data.ptr;
+    }
+    return ready;
+}
+
+static void epoll_backend_destroy(event_backend *backend)
+{
+    if(backend->epoll_fd != -1)
+    {
+        close(backend->epoll_fd);
+        backend->epoll_fd = -1;
+    }
+}
+
+static const struct event_backend_ops epoll_backend_ops = {
+    .name    = "epoll",
+    .init    = epoll_backend_init,
+    .add     = epoll_backend_add,
+    .modify  = epoll_backend_modify,
+    .remove  = epoll_backend_remove,
+    .wait    = epoll_backend_wait,
+    .destroy = epoll_backend_destroy,
+};
+#endif
+
+#ifdef HAVE_IO_URING
+    // completions of POLL_REMOVE and ASYNC_CANCEL requests carry this and are dropped
+    #define URING_IGNORED UINT64_MAX
+
+// What a request in flight for an fd is, kept in its user_data
+enum uring_kind
+{
+    URING_POLL,
+    URING_RECEIVE,
+    URING_ACCEPT,
+};
+
+// Every fd has at most one poll or accept and one receive in flight. Their
+// user_data holds the fd, the kind and the arm sequence at the time they were
+// queued, so the completion of one that was since removed or replaced is
+// recognised as stale and dropped.
+struct uring_watch
+{
+    void    *data;
+    uint32_t interest;
+    uint32_t sequence;            // polls and accepts
+    uint32_t receive_sequence;    // only moves on removal, a receive outlives interest changes
+    uint32_t reported_wait;       // wait in which the fd last produced an event
+    int      reported_slot;       // that event's index
+    uint32_t accepted_wait;       // wait in which the listener last reported a connection
+    size_t   accepted;            // connections reported in that wait
+    bool     registered;
+    bool     polling;
+    bool     accepting;
+    bool     receiving;
+    bool     rearm_queued;
+};
+
+struct uring_ring
+{
+    int ring_fd;
+
+    // submission queue, entries are queued locally and published in one go
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_array;
+    unsigned             sq_mask;
+    unsigned             sq_entries;
+    unsigned             sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    // completion queue
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void  *sq_memory;
+    size_t sq_memory_size;
+    void  *cq_memory;    // same as sq_memory when the kernel maps both rings at once
+    size_t cq_memory_size;
+    size_t sqes_size;
+
+    // Pool buffers the kernel receives into, picked as data arrives rather
+    // than tied to a connection up front. NULL on kernels before 5.19, which
+    // also lack multishot accept, so clients are polled and read by the caller.
+    struct io_uring_buf_ring *buffer_ring;
+    uint16_t                  buffer_tail;
+    size_t                    buffer_capacity;    // data bytes in each
+    size_t                    buffers_out;        // handed to the caller and not released yet
+    received_data            *buffers[URING_RECEIVE_BUFFERS];
+
+    // indexed by fd
+    struct uring_watch *watches;
+    size_t              watches_capacity;
+
+    // fds whose poll, accept or receive ended in the last wait, armed again at the next one
+    int   *rearm;
+    size_t num_rearm;
+
+    uint32_t wait_count;
+};
+
+static int uring_enter(const struct uring_ring *ring, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static unsigned uring_unsubmitted(struct uring_ring *ring)
+{
+    // the kernel moves the head as it consumes entries, even when an enter fails halfway
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void uring_free_buffers(struct uring_ring *ring)
+{
+    for(size_t i = 0; i < URING_RECEIVE_BUFFERS; i++)
+    {
+        buffer_pool_release(ring->buffers[i]);
+        ring->buffers[i] = NULL;
+    }
+    if(ring->buffer_ring != NULL)
+    {
+        munmap(ring->buffer_ring, URING_RECEIVE_BUFFERS * sizeof(struct io_uring_buf));
+        ring->buffer_ring = NULL;
+    }
+}
+
+static void uring_unmap(struct uring_ring *ring)
+{
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_memory != NULL && ring->cq_memory != MAP_FAILED && ring->cq_memory != ring->sq_memory)
+    {
+        munmap(ring->cq_memory, ring->cq_memory_size);
+    }
+    if(ring->sq_memory != NULL && ring->sq_memory != MAP_FAILED)
+    {
+        munmap(ring->sq_memory, ring->sq_memory_size);
+    }
+    if(ring->ring_fd != -1)
+    {
+        close(ring->ring_fd);
+    }
+
+    // after the ring, nothing is received into them any more
+    uring_free_buffers(ring);
+    free(ring->watches);
+    free(ring->rearm);
+    free(ring);
+}
+
+static int uring_setup(struct io_uring_params *params, unsigned flags)
+{
+    memset(params, 0, sizeof(*params));
+    params->flags      = IORING_SETUP_CQSIZE | flags;
+    params->cq_entries = URING_CQ_ENTRIES;
+    return (int)syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, params);
+}
+
+// Puts a buffer at the tail of the buffer ring, where the kernel takes it for a later receive
+static void uring_provide_buffer(struct uring_ring *ring, uint16_t buffer_id)
+{
+    // bufs[0] shares its last field with the tail, so only the others are written
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_RECEIVE_BUFFERS - 1)];
+
+    buffer->addr = (uint64_t)(uintptr_t)ring->buffers[buffer_id]->data;
+    buffer->len  = (uint32_t)ring->buffer_capacity;
+    buffer->bid  = buffer_id;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+// Registers the buffer ring, still empty
+static int uring_init_buffers(struct uring_ring *ring)
+{
+    struct io_uring_buf_reg reg = {0};
+    void                   *memory;
+
+    // the ring itself has to be page aligned
+    memory = mmap(NULL, URING_RECEIVE_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(memory == MAP_FAILED)
+    {
+        return -1;
+    }
+    ring->buffer_ring = memory;
+
+    reg.ring_addr    = (uint64_t)(uintptr_t)memory;
+    reg.ring_entries = URING_RECEIVE_BUFFERS;
+    reg.bgid         = URING_BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        uring_free_buffers(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Fills the buffer ring from the pool. Left to the first wait, so the buffers
+// count towards the thread that runs the backend rather than the one that set it up.
+static int uring_fill_buffers(struct uring_ring *ring)
+{
+    ring->buffer_capacity = buffer_pool_size(BUFFER_POOL_SMALL) - offsetof(received_data, data);
+    for(size_t i = 0; i < URING_RECEIVE_BUFFERS; i++)
+    {
+        // after a failed attempt the ones already in are kept
+        if(ring->buffers[i] != NULL)
+        {
+            continue;
+        }
+        ring->buffers[i] = buffer_pool_acquire(BUFFER_POOL_SMALL);
+        if(ring->buffers[i] == NULL)
+        {
+            return -1;
+        }
+        ring->buffers[i]->buffer_id = (uint16_t)i;
+        uring_provide_buffer(ring, (uint16_t)i);
+    }
+    return 0;
+}
+
+static int uring_backend_init(event_backend *backend)
+{
+    struct io_uring_params params;
+    struct uring_ring     *ring = calloc(1, sizeof(struct uring_ring));
+    unsigned char         *sq;
+    unsigned char         *cq;
+
+    if(ring == NULL)
+    {
+        return -1;
+    }
+
+    // task work only runs when the worker enters anyway, which saves interrupting it;
+    // kernels before 6.0 do not know these flags
+    ring->ring_fd = uring_setup(&params, IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL);
+    if(ring->ring_fd == -1 && errno == EINVAL)
+    {
+        ring->ring_fd = uring_setup(&params, 0);
+    }
+    if(ring->ring_fd == -1)
+    {
+        uring_unmap(ring);
+        return -1;
+    }
+
+    // the headers may be newer than the running kernel
+    if(!(params.features & IORING_FEAT_RSRC_TAGS) || !(params.features & IORING_FEAT_NODROP))
+    {
+        uring_unmap(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_memory_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+    ring->cq_memory_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_memory_size = ring->sq_memory_size > ring->cq_memory_size ? ring->sq_memory_size : ring->cq_memory_size;
+        ring->cq_memory_size = ring->sq_memory_size;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_memory = mmap(NULL, ring->sq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(ring->sq_memory == MAP_FAILED)
+    {
+        uring_unmap(ring);
+        return -1;
+    }
+    ring->cq_memory = ring->sq_memory;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_memory = mmap(NULL, ring->cq_memory_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if(ring->cq_memory == MAP_FAILED)
+        {
+            uring_unmap(ring);
+            return -1;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        uring_unmap(ring);
+        return -1;
+    }
+
+    sq                  = ring->sq_memory;
+    cq                  = ring->cq_memory;
+    ring->sq_head       = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail       = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array      = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask       = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries    = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head       = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail       = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask       = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes          = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // without buffer rings the backend still works, as a poller only
+    backend->receives = uring_init_buffers(ring) == 0;
+    backend->uring    = ring;
+    return 0;
+}
+
+// Submits what is queued without waiting, used when the submission queue fills up
+static int uring_submit(struct uring_ring *ring)
+{
+    unsigned to_submit;
+
+    while((to_submit = uring_unsubmitted(ring)) > 0)
+    {
+        if(uring_enter(ring, to_submit, 0, 0, NULL, 0) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_next_sqe(struct uring_ring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned             index;
+
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries && uring_submit(ring) == -1)
+    {
+        return NULL;
+    }
+
+    index = ring->sq_local_tail & ring->sq_mask;
+    sqe   = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static uint64_t uring_user_data(int fd, enum uring_kind kind, uint32_t sequence)
+{
+    return ((uint64_t)(sequence & URING_SEQUENCE_MASK) << URING_SEQUENCE_SHIFT) | ((uint64_t)kind << URING_KIND_SHIFT) | (uint32_t)fd;
+}
+
+static bool uring_accepts(const struct uring_ring *ring, uint32_t interest)
+{
+    return ring->buffer_ring != NULL && (interest & EVENT_ACCEPT);
+}
+
+static bool uring_receives(const struct uring_ring *ring, uint32_t interest)
+{
+    return ring->buffer_ring != NULL && (interest & EVENT_RECEIVE) && (interest & EVENT_READ);
+}
+
+// What is left for a poll to report once accepts and receives are taken care of
+static uint32_t to_uring_poll_events(const struct uring_ring *ring, uint32_t interest)
+{
+    // poll masks share the epoll bit values
+    uint32_t events = 0;
+
+    if((interest & EVENT_READ) && !uring_receives(ring, interest) && !uring_accepts(ring, interest))
+    {
+        events |= EPOLLIN;
+    }
+    if(interest & EVENT_WRITE)
+    {
+        events |= EPOLLOUT;
+    }
+    if(events != 0 && !(interest & EVENT_EXCLUSIVE))
+    {
+        events |= EPOLLRDHUP;
+    }
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // the kernel reads poll32_events as two swapped halves on big-endian machines
+    events = (events << 16) | (events >> 16);
+    #endif
+    return events;
+}
+
+static int uring_queue_poll(struct uring_ring *ring, int fd)
+{
+    struct uring_watch  *watch = &ring->watches[fd];
+    struct io_uring_sqe *sqe   = uring_next_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    // Clients stay armed and are reported on every wakeup, like edge-triggered
+    // epoll, the server drains them until EAGAIN. A listener may be left with
+    // connections pending, so its poll is one-shot and level-triggered.
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->len           = (watch->interest & EVENT_EXCLUSIVE) ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->fd            = fd;
+    sqe->poll32_events = to_uring_poll_events(ring, watch->interest);
+    sqe->user_data     = uring_user_data(fd, URING_POLL, watch->sequence);
+    watch->polling     = true;
+    return 0;
+}
+
+// Stays armed and posts every connection as it is accepted, the listener itself never wakes anyone
+static int uring_queue_accept(struct uring_ring *ring, int fd)
+{
+    struct uring_watch  *watch = &ring->watches[fd];
+    struct io_uring_sqe *sqe   = uring_next_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->fd           = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = uring_user_data(fd, URING_ACCEPT, watch->sequence);
+    watch->accepting  = true;
+    return 0;
+}
+
+// One receive in flight per fd and the next only after the wait that reaped
+// it, so a connection takes at most one buffer per wakeup
+static int uring_queue_receive(struct uring_ring *ring, int fd)
+{
+    struct uring_watch  *watch = &ring->watches[fd];
+    struct io_uring_sqe *sqe   = uring_next_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode     = IORING_OP_RECV;
+    sqe->flags      = IOSQE_BUFFER_SELECT;
+    sqe->buf_group  = URING_BUFFER_GROUP;
+    sqe->fd         = fd;
+    sqe->user_data  = uring_user_data(fd, URING_RECEIVE, watch->receive_sequence);
+    watch->receiving = true;
+    return 0;
+}
+
+// Cancels a request in flight for fd, its late completion is made stale by the caller
+static int uring_queue_cancel(struct uring_ring *ring, int fd, enum uring_kind kind, uint32_t sequence)
+{
+    struct io_uring_sqe *sqe = uring_next_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode    = kind == URING_POLL ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = uring_user_data(fd, kind, sequence);
+    sqe->user_data = URING_IGNORED;
+    return 0;
+}
+
+// Queues what the fd's interest calls for and is not in flight already
+static int uring_arm(struct uring_ring *ring, int fd)
+{
+    struct uring_watch *watch = &ring->watches[fd];
+
+    if(uring_accepts(ring, watch->interest))
+    {
+        return watch->accepting ? 0 : uring_queue_accept(ring, fd);
+    }
+    if(uring_receives(ring, watch->interest) && !watch->receiving && uring_queue_receive(ring, fd) == -1)
+    {
+        return -1;
+    }
+    if(to_uring_poll_events(ring, watch->interest) != 0 && !watch->polling)
+    {
+        return uring_queue_poll(ring, fd);
+    }
+    return 0;
+}
+
+static void uring_queue_rearm(struct uring_ring *ring, int fd)
+{
+    // every fd is in the list at most once, so it never outgrows the watches
+    if(!ring->watches[fd].rearm_queued)
+    {
+        ring->watches[fd].rearm_queued = true;
+        ring->rearm[ring->num_rearm++] = fd;
+    }
+}
+
+static struct uring_watch *uring_registered_watch(const struct uring_ring *ring, int fd)
+{
+    if(fd < 0 || (size_t)fd >= ring->watches_capacity || !ring->watches[fd].registered)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+    return &ring->watches[fd];
+}
+
+static int uring_backend_add(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    struct uring_ring *ring = backend->uring;
+
+    if(fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if((size_t)fd >= ring->watches_capacity)
+    {
+        size_t              new_capacity = ring->watches_capacity == 0 ? INITIAL_BACKEND_CAPACITY : ring->watches_capacity;
+        struct uring_watch *new_watches;
+        int                *new_rearm;
+
+        while(new_capacity <= (size_t)fd)
+        {
+            new_capacity *= 2;
+        }
+
+        new_watches = realloc(ring->watches, sizeof(struct uring_watch) * new_capacity);
+        if(new_watches == NULL)
+        {
+            return -1;
+        }
+        memset(new_watches + ring->watches_capacity, 0, sizeof(struct uring_watch) * (new_capacity - ring->watches_capacity));
+        ring->watches = new_watches;
+
+        new_rearm = realloc(ring->rearm, sizeof(int) * new_capacity);
+        if(new_rearm == NULL)
+        {
+            return -1;
+        }
+        ring->rearm            = new_rearm;
+        ring->watches_capacity = new_capacity;
+    }
+
+    if(ring->watches[fd].registered)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    ring->watches[fd].data       = data;
+    ring->watches[fd].interest   = interest;
+    ring->watches[fd].registered = true;
+    if(uring_arm(ring, fd) == -1)
+    {
+        ring->watches[fd].registered = false;
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_backend_modify(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    struct uring_ring  *ring  = backend->uring;
+    struct uring_watch *watch = uring_registered_watch(ring, fd);
+
+    if(watch == NULL)
+    {
+        return -1;
+    }
+
+    watch->data     = data;
+    watch->interest = interest;
+
+    // Polling anew also reports an fd that yielded while still ready, as
+    // EPOLL_CTL_MOD does. A receive in flight is left to complete, the bytes
+    // it takes off the socket are reported whatever the interest is by then.
+    if(watch->polling)
+    {
+        if(uring_queue_cancel(ring, fd, URING_POLL, watch->sequence) == -1)
+        {
+            return -1;
+        }
+        watch->polling = false;
+        watch->sequence++;
+    }
+    return uring_arm(ring, fd);
+}
+
+static int uring_backend_remove(event_backend *backend, int fd)
+{
+    struct uring_ring  *ring  = backend->uring;
+    struct uring_watch *watch = uring_registered_watch(ring, fd);
+
+    if(watch == NULL)
+    {
+        return -1;
+    }
+
+    // requests hold on to the file until the cancels are submitted with the next wait
+    watch->registered = false;
+    if((watch->polling && uring_queue_cancel(ring, fd, URING_POLL, watch->sequence) == -1) ||
+       (watch->accepting && uring_queue_cancel(ring, fd, URING_ACCEPT, watch->sequence) == -1) ||
+       (watch->receiving && uring_queue_cancel(ring, fd, URING_RECEIVE, watch->receive_sequence) == -1))
+    {
+        return -1;
+    }
+    watch->polling   = false;
+    watch->accepting = false;
+    watch->receiving = false;
+    watch->sequence++;
+    watch->receive_sequence++;
+    return 0;
+}
+
+static void uring_count_idle_buffers(event_backend *backend)
+{
+    backend->idle_buffer_bytes = (URING_RECEIVE_BUFFERS - backend->uring->buffers_out) * buffer_pool_size(BUFFER_POOL_SMALL);
+}
+
+static void uring_backend_release(event_backend *backend, received_data *received)
+{
+    backend->uring->buffers_out--;
+    uring_provide_buffer(backend->uring, received->buffer_id);
+    uring_count_idle_buffers(backend);
+}
+
+static uint32_t from_uring_poll_result(int result)
+{
+    uint32_t events = 0;
+
+    if(result < 0)
+    {
+        return EVENT_ERROR;
+    }
+    if(result & EPOLLIN)
+    {
+        events |= EVENT_READ;
+    }
+    if(result & EPOLLOUT)
+    {
+        events |= EVENT_WRITE;
+    }
+    if(result & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+        events |= EVENT_ERROR;
+    }
+    return events;
+}
+
+// Whether a completion belongs to the request in flight for its fd right now
+static bool uring_is_current(const struct uring_watch *watch, enum uring_kind kind, uint32_t sequence)
+{
+    if(!watch->registered)
+    {
+        return false;
+    }
+    switch(kind)
+    {
+        case URING_POLL:
+            return watch->polling && (watch->sequence & URING_SEQUENCE_MASK) == sequence;
+        case URING_ACCEPT:
+            return watch->accepting && (watch->sequence & URING_SEQUENCE_MASK) == sequence;
+        case URING_RECEIVE:
+            return watch->receiving && (watch->receive_sequence & URING_SEQUENCE_MASK) == sequence;
+        default:
+            return false;
+    }
+}
+
+// Arms again what ended in the last wait. A receive waits on while the caller
+// holds every buffer, it would only fail with ENOBUFS.
+static int uring_rearm(struct uring_ring *ring)
+{
+    size_t kept = 0;
+
+    for(size_t i = 0; i < ring->num_rearm; i++)
+    {
+        const int           fd    = ring->rearm[i];
+        struct uring_watch *watch = &ring->watches[fd];
+
+        if(watch->registered && ring->buffers_out == URING_RECEIVE_BUFFERS && uring_receives(ring, watch->interest) && !watch->receiving)
+        {
+            ring->rearm[kept++] = fd;
+            continue;
+        }
+        watch->rearm_queued = false;
+        if(watch->registered && uring_arm(ring, fd) == -1)
+        {
+            return -1;
+        }
+    }
+    ring->num_rearm = kept;
+    return 0;
+}
+
+static int uring_backend_wait(event_backend *backend, backend_event *events, int max_events, int timeout_ms)
+{
+    struct uring_ring            *ring    = backend->uring;
+    struct io_uring_getevents_arg arg     = {0};
+    struct __kernel_timespec      timeout = {0};
+    unsigned                      to_submit;
+    unsigned                      head;
+    unsigned                      tail;
+    int                           count = 0;
+
+    // before anything is submitted that receives into them
+    if(backend->receives && ring->buffers[URING_RECEIVE_BUFFERS - 1] == NULL && uring_fill_buffers(ring) == -1)
+    {
+        return -1;
+    }
+    if(uring_rearm(ring) == -1)
+    {
+        return -1;
+    }
+    ring->wait_count++;
+
+    // everything queued since the last wait goes in with the same enter that waits
+    to_submit = uring_unsubmitted(ring);
+    head      = *ring->cq_head;
+    if(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) || timeout_ms == 0)
+    {
+        if(to_submit > 0 && uring_enter(ring, to_submit, 0, 0, NULL, 0) == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if(timeout_ms > 0)
+        {
+            timeout.tv_sec  = timeout_ms / MS_PER_SECOND;
+            timeout.tv_nsec = (long long)(timeout_ms % MS_PER_SECOND) * NS_PER_MS;
+            arg.ts          = (uint64_t)(uintptr_t)&timeout;
+        }
+        if(uring_enter(ring, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 && errno != ETIME && errno != EBUSY)
+        {
+            return -1;
+        }
+    }
+
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail && count < max_events)
+    {
+        const struct io_uring_cqe *cqe      = &ring->cqes[head & ring->cq_mask];
+        const int                  fd       = (int)(cqe->user_data & UINT32_MAX);
+        const enum uring_kind      kind     = (enum uring_kind)((cqe->user_data >> URING_KIND_SHIFT) & URING_KIND_MASK);
+        const uint32_t             sequence = (uint32_t)(cqe->user_data >> URING_SEQUENCE_SHIFT);
+        received_data             *received = NULL;
+        struct uring_watch        *watch    = (size_t)fd < ring->watches_capacity ? &ring->watches[fd] : NULL;
+
+        // a listener past its batch stops reaping here, the rest is left for the next wait
+        if(kind == URING_ACCEPT && cqe->res >= 0 && watch != NULL && watch->accepted_wait == ring->wait_count && backend->accept_batch > 0 && watch->accepted >= backend->accept_batch)
+        {
+            break;
+        }
+
+        head++;
+        if(cqe->user_data == URING_IGNORED)
+        {
+            continue;
+        }
+
+        // the kernel took a buffer, it goes back to the ring unless the caller gets bytes in it
+        if(cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            received = ring->buffers[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+            if(cqe->res > 0)
+            {
+                received->next   = NULL;
+                received->length = (size_t)cqe->res;
+                received->offset = 0;
+                ring->buffers_out++;
+            }
+            else
+            {
+                uring_provide_buffer(ring, received->buffer_id);
+                received = NULL;
+            }
+        }
+
+        if(watch == NULL || !uring_is_current(watch, kind, sequence))
+        {
+            // the connection went away meanwhile, nobody takes what was accepted or received for it
+            if(kind == URING_ACCEPT && cqe->res >= 0)
+            {
+                close(cqe->res);
+            }
+            if(received != NULL)
+            {
+                uring_backend_release(backend, received);
+            }
+            continue;
+        }
+
+        // one-shot requests end with their completion, multishot ones when the kernel gives up on them
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            watch->polling   = kind == URING_POLL ? false : watch->polling;
+            watch->accepting = kind == URING_ACCEPT ? false : watch->accepting;
+            watch->receiving = kind == URING_RECEIVE ? false : watch->receiving;
+            uring_queue_rearm(ring, fd);
+        }
+
+        // every accepted connection is an event of its own
+        if(kind == URING_ACCEPT)
+        {
+            if(cqe->res >= 0)
+            {
+                if(watch->accepted_wait != ring->wait_count)
+                {
+                    watch->accepted_wait = ring->wait_count;
+                    watch->accepted      = 0;
+                }
+                watch->accepted++;
+                events[count].events = EVENT_ACCEPT;
+                events[count].result = cqe->res;
+                events[count].data   = watch->data;
+                count++;
+            }
+            continue;
+        }
+
+        // out of buffers, the receive is armed again once one comes back
+        if(kind == URING_RECEIVE && cqe->res == -ENOBUFS)
+        {
+            continue;
+        }
+
+        // several completions for an fd can be reaped in one go, the server sees one event
+        if(watch->reported_wait != ring->wait_count)
+        {
+            watch->reported_wait = ring->wait_count;
+            watch->reported_slot = count;
+            events[count].events = 0;
+            events[count].data   = watch->data;
+            count++;
+        }
+        if(kind == URING_RECEIVE)
+        {
+            // nothing received means the peer closed or the connection failed
+            events[watch->reported_slot].events |= received != NULL ? EVENT_READ | EVENT_RECEIVE : EVENT_READ | EVENT_RECEIVE | EVENT_ERROR;
+            events[watch->reported_slot].received = received;
+        }
+        else
+        {
+            events[watch->reported_slot].events |= from_uring_poll_result(cqe->res);
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if(backend->receives)
+    {
+        uring_count_idle_buffers(backend);
+    }
+    return count;
+}
+
+static void uring_backend_destroy(event_backend *backend)
+{
+    if(backend->uring != NULL)
+    {
+        uring_unmap(backend->uring);
+        backend->uring             = NULL;
+        backend->receives          = false;
+        backend->idle_buffer_bytes = 0;
+    }
+}
+
+static const struct event_backend_ops uring_backend_ops = {
+    .name    = "io_uring",
+    .init    = uring_backend_init,
+    .add     = uring_backend_add,
+    .modify  = uring_backend_modify,
+    .remove  = uring_backend_remove,
+    .wait    = uring_backend_wait,
+    .destroy = uring_backend_destroy,
+    .release = uring_backend_release,
+};
+#endif
+
+int event_backend_init(event_backend *backend, enum event_backend_type type)
+{
+    memset(backend, 0, sizeof(*backend));
+    backend->epoll_fd = -1;
+
+    switch(type)
+    {
+        case EVENT_BACKEND_POLL:
+            backend->ops = &poll_backend_ops;
+            break;
+        case EVENT_BACKEND_EPOLL:
+#ifdef __linux__
+            backend->ops = &epoll_backend_ops;
+            break;
+#else
+            errno = ENOSYS;
+            return -1;
+#endif
+        case EVENT_BACKEND_IO_URING:
+#ifdef HAVE_IO_URING
+            backend->ops = &uring_backend_ops;
+            break;
+#else
+            errno = ENOSYS;
+            return -1;
+#endif
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if(backend->ops->init(backend) == -1)
+    {
+        backend->ops = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int event_backend_add(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    return backend->ops->add(backend, fd, interest, data);
+}
+
+int event_backend_modify(event_backend *backend, int fd, uint32_t interest, void *data)
+{
+    return backend->ops->modify(backend, fd, interest, data);
+}
+
+int event_backend_remove(event_backend *backend, int fd)
+{
+    return backend->ops->remove(backend, fd);
+}
+
+int event_backend_wait(event_backend *backend, backend_event *events, int max_events, int timeout_ms)
+{
+    return backend->ops->wait(backend, events, max_events, timeout_ms);
+}
+
+void event_backend_release(event_backend *backend, received_data *received)
+{
+    backend->ops->release(backend, received);
+}
+
+void event_backend_destroy(event_backend *backend)
+{
+    if(backend->ops != NULL)
+    {
+        backend->ops->destroy(backend);
+        backend->ops = NULL;
+    }
+}
+
+const char *event_backend_name(const event_backend *backend)
+{
+    return backend->ops == NULL ? "none" : backend->ops->name;
+}
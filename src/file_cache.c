@@ -0,0 +1,682 @@
+#include "../include/file_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
+
+enum
+{
+    INOTIFY_READ_BUFFER_SIZE = 4096,
+};
+
+#define DATE_HEADER "\r\nDate: "
+
+#ifdef __linux__
+    // anything that can change what a cached path resolves to or what the file holds
+    #define FILE_CACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// fs.inotify.max_user_watches is shared by every worker, running out is reported once
+static atomic_flag watch_limit_reported = ATOMIC_FLAG_INIT;
+#endif
+
+int file_cache_init(file_cache *cache, const char *root, size_t max_entries, size_t response_budget)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->inotify_fd  = -1;
+    cache->root        = root;
+    cache->root_length = strlen(root);
+
+    // a root of "/" is an empty prefix, cached paths start with the separator that follows it
+    if(cache->root_length == 1)
+    {
+        cache->root_length = 0;
+    }
+
+#ifdef __linux__
+    if(max_entries == 0)
+    {
+        return 0;
+    }
+
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(cache->inotify_fd == -1)
+    {
+        return -1;
+    }
+
+    // about one entry per bucket when full
+    cache->num_buckets = 1;
+    while(cache->num_buckets < max_entries)
+    {
+        cache->num_buckets *= 2;
+    }
+
+    cache->buckets       = calloc(cache->num_buckets, sizeof(file_cache_entry *));
+    cache->watch_buckets = calloc(cache->num_buckets, sizeof(file_cache_watch *));
+    cache->link_buckets  = calloc(cache->num_buckets, sizeof(file_cache_link *));
+    if(cache->buckets == NULL || cache->watch_buckets == NULL || cache->link_buckets == NULL)
+    {
+        free((void *)cache->buckets);
+        free((void *)cache->watch_buckets);
+        free((void *)cache->link_buckets);
+        cache->buckets       = NULL;
+        cache->watch_buckets = NULL;
+        cache->link_buckets  = NULL;
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+        return -1;
+    }
+    cache->max_entries     = max_entries;
+    cache->response_budget = response_budget;
+#endif
+    return 0;
+}
+
+void cached_response_release(cached_response *response)
+{
+    response->references--;
+    if(response->references == 0)
+    {
+        free(response);
+    }
+}
+
+static void free_entry(file_cache_entry *entry)
+{
+    close(entry->fd);
+    free(entry->url_path);
+    free(entry->requested_path);
+    free(entry->resolved_path);
+    free(entry);
+}
+
+void file_cache_release(file_cache_entry *entry)
+{
+    entry->references--;
+    if(entry->references == 0)
+    {
+        free_entry(entry);
+    }
+}
+
+static void drop_response(file_cache *cache, file_cache_entry *entry)
+{
+    lru_unlink(&cache->response_lru, &entry->response_lru);
+    cache->response_bytes -= entry->response->length;
+    cached_response_release(entry->response);
+    entry->response = NULL;
+}
+
+#ifdef __linux__
+static uint64_t hash_link(int watch_descriptor, const char *name, size_t name_length)
+{
+    return hash_bytes(name, name_length) ^ ((uint64_t)(unsigned)watch_descriptor * FNV_PRIME);
+}
+
+static file_cache_watch **find_watch(file_cache *cache, int watch_descriptor)
+{
+    file_cache_watch **link = &cache->watch_buckets[(size_t)(unsigned)watch_descriptor & (cache->num_buckets - 1)];
+
+    while(*link != NULL && (*link)->watch_descriptor != watch_descriptor)
+    {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+// The kernel forgets the watch as well, nothing is cached under the directory any more
+static void remove_watch(file_cache *cache, file_cache_watch *watch)
+{
+    file_cache_watch **link = find_watch(cache, watch->watch_descriptor);
+
+    *link = watch->hash_next;
+
+    // fails harmlessly when the directory is gone and the kernel dropped the watch first
+    inotify_rm_watch(cache->inotify_fd, watch->watch_descriptor);
+    free(watch);
+}
+
+static void unlink_entry(file_cache *cache, file_cache_entry *entry)
+{
+    for(size_t i = 0; i < entry->num_links; i++)
+    {
+        file_cache_link *link = &entry->links[i];
+
+        if(link->watch_prev != NULL)
+        {
+            link->watch_prev->watch_next = link->watch_next;
+        }
+        else
+        {
+            link->watch->links = link->watch_next;
+        }
+        if(link->watch_next != NULL)
+        {
+            link->watch_next->watch_prev = link->watch_prev;
+        }
+
+        if(link->hash_prev != NULL)
+        {
+            link->hash_prev->hash_next = link->hash_next;
+        }
+        else
+        {
+            cache->link_buckets[link->hash & (cache->num_buckets - 1)] = link->hash_next;
+        }
+        if(link->hash_next != NULL)
+        {
+            link->hash_next->hash_prev = link->hash_prev;
+        }
+
+        if(link->watch->links == NULL)
+        {
+            remove_watch(cache, link->watch);
+        }
+    }
+
+    free(entry->links);
+    entry->links     = NULL;
+    entry->num_links = 0;
+}
+#endif
+
+// Unlinks the entry and drops the cache's reference, responses still sending it keep it open
+static void remove_entry(file_cache *cache, file_cache_entry *entry)
+{
+    if(entry->response != NULL)
+    {
+        drop_response(cache, entry);
+    }
+#ifdef __linux__
+    unlink_entry(cache, entry);
+#endif
+
+    file_cache_entry **link = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+
+    while(*link != entry)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    lru_unlink(&cache->lru, &entry->lru);
+    entry->cached = 0;
+    cache->num_entries--;
+    file_cache_release(entry);
+}
+
+void file_cache_destroy(file_cache *cache)
+{
+    while(cache->lru.head != NULL)
+    {
+        remove_entry(cache, LRU_ENTRY(cache->lru.head, file_cache_entry, lru));
+    }
+
+    free((void *)cache->buckets);
+    free((void *)cache->watch_buckets);
+    free((void *)cache->link_buckets);
+    cache->buckets       = NULL;
+    cache->watch_buckets = NULL;
+    cache->link_buckets  = NULL;
+
+    if(cache->inotify_fd != -1)
+    {
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+    }
+}
+
+file_cache_entry *file_cache_lookup(file_cache *cache, const char *url_path, size_t url_path_length)
+{
+    uint64_t          hash;
+    file_cache_entry *entry;
+
+    if(cache->max_entries == 0)
+    {
+        return NULL;
+    }
+
+    hash  = hash_bytes(url_path, url_path_length);
+    entry = cache->buckets[hash & (cache->num_buckets - 1)];
+    while(entry != NULL)
+    {
+        if(entry->hash == hash && entry->url_path_length == url_path_length && memcmp(entry->url_path, url_path, url_path_length) == 0)
+        {
+            if(cache->lru.head != &entry->lru)
+            {
+                lru_unlink(&cache->lru, &entry->lru);
+                lru_push_front(&cache->lru, &entry->lru);
+            }
+            entry->references++;
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+#ifdef __linux__
+// Links the entry to the directory through its name there, watching the directory if nothing else does
+static int add_link(file_cache *cache, file_cache_entry *entry, int watch_descriptor, const char *name, size_t name_length, bool names_file)
+{
+    file_cache_watch **watch_link = find_watch(cache, watch_descriptor);
+    file_cache_watch  *watch      = *watch_link;
+    file_cache_link   *link       = &entry->links[entry->num_links];
+    size_t             bucket;
+
+    if(watch == NULL)
+    {
+        watch = calloc(1, sizeof(file_cache_watch));
+        if(watch == NULL)
+        {
+            inotify_rm_watch(cache->inotify_fd, watch_descriptor);
+            return -1;
+        }
+        watch->watch_descriptor = watch_descriptor;
+        *watch_link             = watch;
+    }
+
+    link->entry       = entry;
+    link->watch       = watch;
+    link->name        = name;
+    link->name_length = name_length;
+    link->hash        = hash_link(watch_descriptor, name, name_length);
+    link->names_file  = names_file;
+
+    link->watch_prev = NULL;
+    link->watch_next = watch->links;
+    if(watch->links != NULL)
+    {
+        watch->links->watch_prev = link;
+    }
+    watch->links = link;
+
+    bucket          = link->hash & (cache->num_buckets - 1);
+    link->hash_prev = NULL;
+    link->hash_next = cache->link_buckets[bucket];
+    if(cache->link_buckets[bucket] != NULL)
+    {
+        cache->link_buckets[bucket]->hash_prev = link;
+    }
+    cache->link_buckets[bucket] = link;
+    entry->num_links++;
+    return 0;
+}
+
+// Watches every directory from the root down to the one holding the file,
+// since inotify is not recursive. Each '/' is cut off in place while its
+// directory is added, path is the entry's own copy.
+static int link_path(file_cache *cache, file_cache_entry *entry, char *path)
+{
+    char *separator = path + cache->root_length;
+
+    while(separator != NULL)
+    {
+        char        *name        = separator + 1;
+        char        *next        = strchr(name, '/');
+        const size_t name_length = next == NULL ? strlen(name) : (size_t)(next - name);
+        int          watch_descriptor;
+
+        // "//" in a request path names no directory of its own
+        if(name_length > 0)
+        {
+            // cut at the very first '/' what is left is "/" itself
+            *separator       = '\0';
+            watch_descriptor = inotify_add_watch(cache->inotify_fd, separator == path ? "/" : path, FILE_CACHE_WATCH_MASK);
+            *separator       = '/';
+            if(watch_descriptor == -1)
+            {
+                if(errno == ENOSPC && !atomic_flag_test_and_set(&watch_limit_reported))
+                {
+                    fprintf(stderr, "Warning: out of inotify watches (fs.inotify.max_user_watches), files in directories not yet watched are no longer cached\n");
+                }
+                return -1;
+            }
+            if(add_link(cache, entry, watch_descriptor, name, name_length, next == NULL) == -1)
+            {
+                return -1;
+            }
+        }
+        separator = next;
+    }
+    return 0;
+}
+
+static size_t count_separators(const char *path)
+{
+    size_t count = 0;
+
+    for(path = strchr(path, '/'); path != NULL; path = strchr(path + 1, '/'))
+    {
+        count++;
+    }
+    return count;
+}
+
+// The requested path notices a link being swapped (current -> release2), the
+// resolved one a directory it points to being renamed. Without links both are the same.
+static int watch_paths(file_cache *cache, file_cache_entry *entry)
+{
+    const bool same_path = strcmp(entry->requested_path, entry->resolved_path) == 0;
+
+    if(strncmp(entry->requested_path, cache->root, cache->root_length) != 0 || entry->requested_path[cache->root_length] != '/' || strncmp(entry->resolved_path, cache->root, cache->root_length) != 0 ||
+       entry->resolved_path[cache->root_length] != '/')
+    {
+        return -1;
+    }
+
+    entry->links = malloc((count_separators(entry->resolved_path) + (same_path ? 0 : count_separators(entry->requested_path))) * sizeof(file_cache_link));
+    if(entry->links == NULL)
+    {
+        return -1;
+    }
+    if(link_path(cache, entry, entry->resolved_path) == -1 || (!same_path && link_path(cache, entry, entry->requested_path) == -1))
+    {
+        unlink_entry(cache, entry);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+file_cache_entry *file_cache_insert(file_cache *cache, const char *url_path, size_t url_path_length, const char *requested_path, const char *resolved_path, int fd, const struct stat *st, const char *content_type)
+{
+    file_cache_entry *entry;
+    size_t            bucket;
+    size_t            requested_path_length;
+    size_t            resolved_path_length;
+
+    entry = calloc(1, sizeof(file_cache_entry));
+    if(entry == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    requested_path_length = strlen(requested_path) + 1;
+    resolved_path_length  = strlen(resolved_path) + 1;
+    entry->requested_path = malloc(requested_path_length);
+    entry->resolved_path  = malloc(resolved_path_length);
+    if(entry->requested_path == NULL || entry->resolved_path == NULL)
+    {
+        close(fd);
+        free(entry->requested_path);
+        free(entry->resolved_path);
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->requested_path, requested_path, requested_path_length);
+    memcpy(entry->resolved_path, resolved_path, resolved_path_length);
+
+    entry->content_type = content_type;
+    entry->fd           = fd;
+    entry->size         = st->st_size;
+    entry->inode        = st->st_ino;
+    entry->references   = 1;
+#ifdef __linux__
+    entry->mtime = st->st_mtim;
+#else
+    entry->mtime.tv_sec = st->st_mtime;
+#endif
+    snprintf(entry->etag, sizeof(entry->etag), "\"%jx-%jx-%jx\"", (uintmax_t)entry->inode, (uintmax_t)entry->size, (uintmax_t)entry->mtime.tv_sec);
+
+    // formatted once per file rather than once per response
+    if(http_format_date(entry->mtime.tv_sec, entry->last_modified) == -1)
+    {
+        entry->last_modified[0] = '\0';
+    }
+
+    if(cache->max_entries == 0)
+    {
+        return entry;
+    }
+
+    entry->url_path = malloc(url_path_length);
+    if(entry->url_path == NULL)
+    {
+        // still usable for this one response, it just is not kept
+        return entry;
+    }
+#ifdef __linux__
+    if(watch_paths(cache, entry) == -1)
+    {
+        return entry;
+    }
+#endif
+    memcpy(entry->url_path, url_path, url_path_length);
+    entry->url_path_length = url_path_length;
+    entry->hash            = hash_bytes(url_path, url_path_length);
+
+    // only once the new entry holds its watches, so directories both use stay watched
+    if(cache->num_entries >= cache->max_entries)
+    {
+        remove_entry(cache, LRU_ENTRY(cache->lru.tail, file_cache_entry, lru));
+    }
+
+    bucket                 = entry->hash & (cache->num_buckets - 1);
+    entry->hash_next       = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push_front(&cache->lru, &entry->lru);
+    entry->cached = 1;
+    entry->references++;
+    cache->num_entries++;
+    return entry;
+}
+
+cached_response *file_cache_lookup_response(file_cache *cache, file_cache_entry *entry, time_t now, const char date[HTTP_DATE_CAPACITY])
+{
+    if(cache->response_budget == 0 || !entry->cached || entry->size > SMALL_FILE_RESPONSE_LIMIT)
+    {
+        return NULL;
+    }
+
+    // The date is always as wide, so only the cache's own reference means it can
+    // be rewritten in place. One being sent is left alone and rebuilt by the next store.
+    if(entry->response != NULL && entry->response->date_second != now)
+    {
+        if(entry->response->references == 1 && entry->response->date_offset != 0)
+        {
+            memcpy(entry->response->data + entry->response->date_offset, date, HTTP_DATE_CAPACITY - 1);
+            entry->response->date_second = now;
+        }
+        else
+        {
+            drop_response(cache, entry);
+        }
+    }
+    if(entry->response == NULL)
+    {
+        cache->response_misses++;
+        return NULL;
+    }
+
+    cache->response_hits++;
+    if(cache->response_lru.head != &entry->response_lru)
+    {
+        lru_unlink(&cache->response_lru, &entry->response_lru);
+        lru_push_front(&cache->response_lru, &entry->response_lru);
+    }
+    entry->response->references++;
+    return entry->response;
+}
+
+// Where the value of the Date header starts, 0 if there is none of the usual width
+static size_t find_date(const char *headers, size_t header_length)
+{
+    const size_t prefix_length = sizeof(DATE_HEADER) - 1;
+
+    for(size_t i = 0; i + prefix_length + HTTP_DATE_CAPACITY - 1 + 2 <= header_length; i++)
+    {
+        if(memcmp(headers + i, DATE_HEADER, prefix_length) == 0)
+        {
+            const size_t value = i + prefix_length;
+
+            return memcmp(headers + value + HTTP_DATE_CAPACITY - 1, "\r\n", 2) == 0 ? value : 0;
+        }
+    }
+    return 0;
+}
+
+cached_response *file_cache_store_response(file_cache *cache, file_cache_entry *entry, const char *headers, size_t header_length, time_t date_second)
+{
+    cached_response *response;
+    size_t           length;
+    size_t           body_read = 0;
+
+    if(cache->response_budget == 0 || !entry->cached || entry->response != NULL || entry->size > SMALL_FILE_RESPONSE_LIMIT)
+    {
+        return NULL;
+    }
+
+    length = header_length + (size_t)entry->size;
+    if(length > cache->response_budget)
+    {
+        return NULL;
+    }
+
+    response = malloc(sizeof(cached_response) + length);
+    if(response == NULL)
+    {
+        return NULL;
+    }
+    memcpy(response->data, headers, header_length);
+
+    // the only time the body is read into memory, every later hit is one send()
+    while(body_read < (size_t)entry->size)
+    {
+        ssize_t result = pread(entry->fd, response->data + header_length + body_read, (size_t)entry->size - body_read, (off_t)body_read);
+
+        if(result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(result <= 0)
+        {
+            free(response);
+            return NULL;
+        }
+        body_read += (size_t)result;
+    }
+
+    while(cache->response_bytes + length > cache->response_budget)
+    {
+        drop_response(cache, LRU_ENTRY(cache->response_lru.tail, file_cache_entry, response_lru));
+    }
+
+    response->references    = 2;    // the entry and the caller
+    response->header_length = header_length;
+    response->length        = length;
+    response->date_second   = date_second;
+    response->date_offset   = find_date(headers, header_length);
+    entry->response         = response;
+    cache->response_bytes += length;
+    lru_push_front(&cache->response_lru, &entry->response_lru);
+    return response;
+}
+
+#ifdef __linux__
+// The first entry linked to the directory through name, or the first one whose
+// file name is name without its last extension and which has missing siblings
+static file_cache_link *find_link(const file_cache *cache, int watch_descriptor, const char *name, size_t name_length, bool sibling)
+{
+    const uint64_t   hash = hash_link(watch_descriptor, name, name_length);
+    file_cache_link *link = cache->link_buckets[hash & (cache->num_buckets - 1)];
+
+    while(link != NULL)
+    {
+        if(link->hash == hash && link->watch->watch_descriptor == watch_descriptor && link->name_length == name_length && memcmp(link->name, name, name_length) == 0 &&
+           (!sibling || (link->names_file && link->entry->missing_siblings != 0)))
+        {
+            return link;
+        }
+        link = link->hash_next;
+    }
+    return NULL;
+}
+
+// An event without a name concerns the watched directory itself, so everything
+// under it goes. A name drops whatever is looked up through it: a file, a
+// directory or link further down the path, or a precompressed sibling appearing.
+static void invalidate(file_cache *cache, int watch_descriptor, const char *name)
+{
+    file_cache_watch *watch;
+    file_cache_link  *link;
+    const char       *extension;
+    size_t            name_length;
+
+    if(name == NULL)
+    {
+        while((watch = *find_watch(cache, watch_descriptor)) != NULL)
+        {
+            remove_entry(cache, watch->links->entry);
+        }
+        return;
+    }
+
+    name_length = strlen(name);
+    while((link = find_link(cache, watch_descriptor, name, name_length, false)) != NULL)
+    {
+        remove_entry(cache, link->entry);
+    }
+
+    extension = strrchr(name, '.');
+    if(extension == NULL || extension == name)
+    {
+        return;
+    }
+    while((link = find_link(cache, watch_descriptor, name, (size_t)(extension - name), true)) != NULL)
+    {
+        remove_entry(cache, link->entry);
+    }
+}
+#endif
+
+void file_cache_process_events(file_cache *cache)
+{
+#ifdef __linux__
+    char buffer[INOTIFY_READ_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(true)
+    {
+        ssize_t length = read(cache->inotify_fd, buffer, sizeof(buffer));
+
+        if(length == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(length <= 0)
+        {
+            // EAGAIN, drained
+            return;
+        }
+
+        for(ssize_t offset = 0; offset < length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost, nothing in the cache can be trusted
+                while(cache->lru.head != NULL)
+                {
+                    remove_entry(cache, LRU_ENTRY(cache->lru.head, file_cache_entry, lru));
+                }
+            }
+            else
+            {
+                invalidate(cache, event->wd, event->len > 0 ? event->name : NULL);
+            }
+            offset += (ssize_t)(sizeof(struct inotify_event) + event->len);
+        }
+    }
+#endif
+}
@@ -0,0 +1,743 @@
+#include "../include/http_parser.h"
+#include "../include/http_scan.h"
+#include <string.h>
+#include <strings.h>
+
+#define RANGE_UNIT "bytes="
+#define ZERO_WEIGHT "q=0"
+#define WEAK_PREFIX "W/"
+#define IMF_FIXDATE "%a, %d %b %Y %H:%M:%S GMT"
+
+enum
+{
+    DECIMAL_BASE = 10,
+
+    // offsets into an IMF-fixdate
+    IMF_DAY    = 5,
+    IMF_MONTH  = 8,
+    IMF_YEAR   = 12,
+    IMF_HOUR   = 17,
+    IMF_MINUTE = 20,
+    IMF_SECOND = 23,
+
+    MONTHS_PER_YEAR            = 12,
+    MAX_DAY_OF_MONTH           = 31,
+    HOURS_PER_DAY              = 24,
+    MINUTES_PER_HOUR           = 60,
+    MAX_SECOND                 = 60,    // leap second
+    SECONDS_PER_MINUTE         = 60,
+    SECONDS_PER_HOUR           = 3600,
+    SECONDS_PER_DAY            = 86400,
+    DAYS_PER_YEAR              = 365,
+    YEARS_PER_ERA              = 400,
+    DAYS_PER_ERA               = 146097,
+    DAYS_PER_FIVE_MARCH_MONTHS = 153,    // Mar-Jul and Aug-Dec both have 153 days
+    DAYS_FROM_ERA_TO_EPOCH     = 719468, // 0000-03-01 to 1970-01-01
+};
+
+// control characters other than horizontal tab, never allowed in a path or header value
+static bool is_control_char(unsigned char c)
+{
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+// Jumps over the ordinary bytes of a header value, keeping track of where the
+// value ends once trailing whitespace is left out
+static size_t skip_header_value(http_parser *parser, const char *buffer, size_t position, size_t length)
+{
+    const size_t stop = http_scan->value(buffer, position, length);
+    size_t       end  = stop;
+
+    while(end > position && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t'))
+    {
+        end--;
+    }
+    if(end > position)
+    {
+        parser->token_end = end;
+    }
+    return stop;
+}
+
+// Methods are case-sensitive. Switching on the length and first character leaves
+// at most one candidate to compare.
+static enum http_method lookup_method(const char *name, size_t length)
+{
+    enum http_method candidate = HTTP_METHOD_UNKNOWN;
+    const char      *text      = NULL;
+
+    switch(length)
+    {
+        case 3:
+            candidate = name[0] == 'G' ? HTTP_METHOD_GET : HTTP_METHOD_PUT;
+            text      = name[0] == 'G' ? "GET" : "PUT";
+            break;
+        case 4:
+            candidate = name[0] == 'H' ? HTTP_METHOD_HEAD : HTTP_METHOD_POST;
+            text      = name[0] == 'H' ? "HEAD" : "POST";
+            break;
+        case 5:
+            candidate = name[0] == 'T' ? HTTP_METHOD_TRACE : HTTP_METHOD_PATCH;
+            text      = name[0] == 'T' ? "TRACE" : "PATCH";
+            break;
+        case 6:
+            candidate = HTTP_METHOD_DELETE;
+            text      = "DELETE";
+            break;
+        case 7:
+            candidate = name[0] == 'O' ? HTTP_METHOD_OPTIONS : HTTP_METHOD_CONNECT;
+            text      = name[0] == 'O' ? "OPTIONS" : "CONNECT";
+            break;
+        default:
+            return HTTP_METHOD_UNKNOWN;
+    }
+    return memcmp(name, text, length) == 0 ? candidate : HTTP_METHOD_UNKNOWN;
+}
+
+// Header names are case-insensitive. Apart from the pairs with 10 and 17
+// characters every known name has a different length, so the length (and for
+// those pairs the first character) picks the one candidate.
+static enum http_header_id lookup_header(const char *name, size_t length)
+{
+    enum http_header_id candidate;
+    const char         *text;
+
+    switch(length)
+    {
+        case 4:
+            candidate = HTTP_HEADER_HOST;
+            text      = "host";
+            break;
+        case 5:
+            candidate = HTTP_HEADER_RANGE;
+            text      = "range";
+            break;
+        case 7:
+            candidate = HTTP_HEADER_REFERER;
+            text      = "referer";
+            break;
+        case 8:
+            candidate = HTTP_HEADER_IF_RANGE;
+            text      = "if-range";
+            break;
+        case 10:
+            candidate = (name[0] | 0x20) == 'c' ? HTTP_HEADER_CONNECTION : HTTP_HEADER_USER_AGENT;
+            text      = (name[0] | 0x20) == 'c' ? "connection" : "user-agent";
+            break;
+        case 13:
+            candidate = HTTP_HEADER_IF_NONE_MATCH;
+            text      = "if-none-match";
+            break;
+        case 14:
+            candidate = HTTP_HEADER_CONTENT_LENGTH;
+            text      = "content-length";
+            break;
+        case 15:
+            candidate = HTTP_HEADER_ACCEPT_ENCODING;
+            text      = "accept-encoding";
+            break;
+        case 17:
+            candidate = (name[0] | 0x20) == 'i' ? HTTP_HEADER_IF_MODIFIED_SINCE : HTTP_HEADER_TRANSFER_ENCODING;
+            text      = (name[0] | 0x20) == 'i' ? "if-modified-since" : "transfer-encoding";
+            break;
+        default:
+            return HTTP_HEADER_OTHER;
+    }
+    return strncasecmp(name, text, length) == 0 ? candidate : HTTP_HEADER_OTHER;
+}
+
+static http_slice make_slice(size_t start, size_t end)
+{
+    http_slice slice;
+
+    slice.offset = start;
+    slice.length = end - start;
+    return slice;
+}
+
+void http_parser_init(http_parser *parser, http_request *request, size_t start)
+{
+    parser->state       = PARSE_METHOD;
+    parser->position    = start;
+    parser->token_start = start;
+    parser->token_end   = start;
+
+    memset(request, 0, sizeof(*request));
+}
+
+int http_parser_execute(http_parser *parser, http_request *request, const char *buffer, size_t length)
+{
+    size_t position = parser->position;
+
+    if(parser->state == PARSE_DONE)
+    {
+        return HTTP_PARSE_COMPLETE;
+    }
+
+    while(position < length)
+    {
+        unsigned char c;
+
+        // runs of ordinary bytes are skipped in bulk, only delimiters go through the switch
+        if(parser->state == PARSE_PATH)
+        {
+            position = http_scan->path(buffer, position, length);
+        }
+        else if(parser->state == PARSE_HEADER_NAME)
+        {
+            position = http_scan->token(buffer, position, length);
+        }
+        else if(parser->state == PARSE_HEADER_VALUE)
+        {
+            position = skip_header_value(parser, buffer, position, length);
+        }
+        if(position == length)
+        {
+            break;
+        }
+
+        c = (unsigned char)buffer[position];
+        switch(parser->state)
+        {
+            case PARSE_METHOD:
+                if(c == ' ')
+                {
+                    if(position == parser->token_start)
+                    {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    request->method    = make_slice(parser->token_start, position);
+                    request->method_id = lookup_method(buffer + parser->token_start, request->method.length);
+                    parser->state      = PARSE_SPACES_BEFORE_PATH;
+                }
+                else if((c == '\r' || c == '\n') && position == parser->token_start)
+                {
+                    // stray empty lines before a request are ignored
+                    parser->token_start++;
+                }
+                else if(!http_is_token_char(c))
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PARSE_SPACES_BEFORE_PATH:
+                if(c != ' ')
+                {
+                    parser->token_start = position;
+                    parser->state       = PARSE_PATH;
+                    continue;
+                }
+                break;
+
+            case PARSE_PATH:
+                if(c == ' ')
+                {
+                    request->path = make_slice(parser->token_start, position);
+                    parser->state = PARSE_SPACES_BEFORE_VERSION;
+                }
+                else if(is_control_char(c) || c == '\t')
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PARSE_SPACES_BEFORE_VERSION:
+                if(c != ' ')
+                {
+                    parser->token_start = position;
+                    parser->state       = PARSE_VERSION;
+                    continue;
+                }
+                break;
+
+            case PARSE_VERSION:
+                if(c == '\r')
+                {
+                    if(position == parser->token_start)
+                    {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    request->protocolVersion = make_slice(parser->token_start, position);
+                    parser->state            = PARSE_REQUEST_LINE_LF;
+                }
+                else if(!http_is_token_char(c) && c != '/')
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PARSE_REQUEST_LINE_LF:
+            case PARSE_HEADER_LF:
+                if(c != '\n')
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                parser->state = PARSE_HEADER_START;
+                break;
+
+            case PARSE_HEADER_START:
+                if(c == '\r')
+                {
+                    parser->state = PARSE_END_LF;
+                }
+                else if(http_is_token_char(c))
+                {
+                    if(request->num_headers == MAX_HTTP_HEADERS)
+                    {
+                        return HTTP_PARSE_TOO_MANY_HEADERS;
+                    }
+                    parser->token_start = position;
+                    parser->state       = PARSE_HEADER_NAME;
+                }
+                else
+                {
+                    // includes obsolete line folding, which RFC 9112 lets a server reject
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PARSE_HEADER_NAME:
+                if(c == ':')
+                {
+                    http_header *header = &request->headers[request->num_headers];
+
+                    header->name  = make_slice(parser->token_start, position);
+                    header->id    = lookup_header(buffer + header->name.offset, header->name.length);
+                    parser->state = PARSE_HEADER_VALUE_START;
+                }
+                else if(!http_is_token_char(c))
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case PARSE_HEADER_VALUE_START:
+                if(c != ' ' && c != '\t')
+                {
+                    parser->token_start = position;
+                    parser->token_end   = position;
+                    parser->state       = PARSE_HEADER_VALUE;
+                    continue;
+                }
+                break;
+
+            case PARSE_HEADER_VALUE:
+                if(c == '\r')
+                {
+                    http_header *header = &request->headers[request->num_headers];
+
+                    header->value = make_slice(parser->token_start, parser->token_end);
+                    if(header->id != HTTP_HEADER_OTHER && request->known_headers[header->id] == 0)
+                    {
+                        request->known_headers[header->id] = (uint8_t)(request->num_headers + 1);
+                    }
+                    else if(header->id != HTTP_HEADER_OTHER)
+                    {
+                        request->repeated_headers |= (uint16_t)(1U << header->id);
+                    }
+                    request->num_headers++;
+                    parser->state = PARSE_HEADER_LF;
+                }
+                else if(c != ' ' && c != '\t')
+                {
+                    if(is_control_char(c))
+                    {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    parser->token_end = position + 1;
+                }
+                break;
+
+            case PARSE_END_LF:
+                if(c != '\n')
+                {
+                    return HTTP_PARSE_ERROR;
+                }
+                parser->state    = PARSE_DONE;
+                parser->position = position + 1;
+                return HTTP_PARSE_COMPLETE;
+
+            case PARSE_DONE:
+            default:
+                return HTTP_PARSE_ERROR;
+        }
+        position++;
+    }
+
+    parser->position = position;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+const http_header *http_request_header(const http_request *request, enum http_header_id id)
+{
+    const uint8_t index = request->known_headers[id];
+
+    return index == 0 ? NULL : &request->headers[index - 1];
+}
+
+bool http_request_header_repeated(const http_request *request, enum http_header_id id)
+{
+    return (request->repeated_headers & (1U << id)) != 0;
+}
+
+bool http_header_has_token(const char *buffer, const http_header *header, const char *token)
+{
+    const size_t token_length = strlen(token);
+    const char  *value        = buffer + header->value.offset;
+    size_t       start        = 0;
+
+    while(start < header->value.length)
+    {
+        const char *comma = memchr(value + start, ',', header->value.length - start);
+        size_t      end   = comma == NULL ? header->value.length : (size_t)(comma - value);
+        size_t      next  = end + 1;
+
+        // list elements may have whitespace around them
+        while(start < end && (value[start] == ' ' || value[start] == '\t'))
+        {
+            start++;
+        }
+        while(end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+        {
+            end--;
+        }
+        if(end - start == token_length && strncasecmp(value + start, token, token_length) == 0)
+        {
+            return true;
+        }
+        start = next;
+    }
+    return false;
+}
+
+bool http_slice_equals(const char *buffer, http_slice slice, const char *literal)
+{
+    return strlen(literal) == slice.length && memcmp(buffer + slice.offset, literal, slice.length) == 0;
+}
+
+bool http_slice_equals_ignore_case(const char *buffer, http_slice slice, const char *literal)
+{
+    return strlen(literal) == slice.length && strncasecmp(buffer + slice.offset, literal, slice.length) == 0;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// "q=0", "q=0." and "q=0.000" and the like refuse, any other weight accepts
+static bool has_zero_weight(const char *parameters, size_t length)
+{
+    const size_t zero_length = sizeof(ZERO_WEIGHT) - 1;
+    size_t       position    = 0;
+
+    while(position < length)
+    {
+        const char *semicolon = memchr(parameters + position, ';', length - position);
+        size_t      end       = semicolon == NULL ? length : (size_t)(semicolon - parameters);
+        size_t      start     = position;
+
+        while(start < end && is_space(parameters[start]))
+        {
+            start++;
+        }
+        while(end > start && is_space(parameters[end - 1]))
+        {
+            end--;
+        }
+        if(end - start >= zero_length && strncasecmp(parameters + start, ZERO_WEIGHT, zero_length) == 0)
+        {
+            start += zero_length;
+            if(start < end && parameters[start] == '.')
+            {
+                start++;
+            }
+            while(start < end && parameters[start] == '0')
+            {
+                start++;
+            }
+            return start == end;
+        }
+        position = (semicolon == NULL ? length : (size_t)(semicolon - parameters)) + 1;
+    }
+    return false;
+}
+
+bool http_header_accepts(const char *buffer, const http_header *header, const char *token)
+{
+    const size_t token_length = strlen(token);
+    const char  *value        = buffer + header->value.offset;
+    size_t       start        = 0;
+    int          wildcard     = -1; // -1 unless "*" is listed, then whether it accepts
+
+    while(start < header->value.length)
+    {
+        const char *comma     = memchr(value + start, ',', header->value.length - start);
+        size_t      end       = comma == NULL ? header->value.length : (size_t)(comma - value);
+        const char *semicolon = memchr(value + start, ';', end - start);
+        size_t      name_end  = semicolon == NULL ? end : (size_t)(semicolon - value);
+        const bool  accepted  = semicolon == NULL || !has_zero_weight(semicolon + 1, end - name_end - 1);
+        size_t      next      = end + 1;
+
+        while(start < name_end && is_space(value[start]))
+        {
+            start++;
+        }
+        while(name_end > start && is_space(value[name_end - 1]))
+        {
+            name_end--;
+        }
+        if(name_end - start == token_length && strncasecmp(value + start, token, token_length) == 0)
+        {
+            return accepted;
+        }
+        if(name_end - start == 1 && value[start] == '*')
+        {
+            wildcard = accepted;
+        }
+        start = next;
+    }
+    return wildcard == 1;
+}
+
+// The opaque tag, quotes included, without the W/ that marks a weak one
+static const char *opaque_tag(const char *etag, size_t *length)
+{
+    const size_t prefix_length = sizeof(WEAK_PREFIX) - 1;
+
+    if(*length > prefix_length && memcmp(etag, WEAK_PREFIX, prefix_length) == 0)
+    {
+        *length -= prefix_length;
+        return etag + prefix_length;
+    }
+    return etag;
+}
+
+bool http_header_matches_etag(const char *buffer, const http_header *header, const char *etag)
+{
+    const char *value       = buffer + header->value.offset;
+    size_t      etag_length = strlen(etag);
+    const char *opaque      = opaque_tag(etag, &etag_length);
+    size_t      position    = 0;
+
+    while(position < header->value.length)
+    {
+        const char *close_quote;
+        const char *tag;
+        size_t      tag_length;
+
+        if(is_space(value[position]) || value[position] == ',')
+        {
+            position++;
+            continue;
+        }
+        if(value[position] == '*')
+        {
+            return true;
+        }
+
+        // a tag may hold commas, so it ends at its closing quote
+        tag         = value + position;
+        close_quote = memchr(value + position, '"', header->value.length - position);
+        if(close_quote == NULL)
+        {
+            return false;
+        }
+        close_quote = memchr(close_quote + 1, '"', header->value.length - (size_t)(close_quote + 1 - value));
+        if(close_quote == NULL)
+        {
+            return false;
+        }
+        tag_length = (size_t)(close_quote + 1 - tag);
+        tag        = opaque_tag(tag, &tag_length);
+        if(tag_length == etag_length && memcmp(tag, opaque, etag_length) == 0)
+        {
+            return true;
+        }
+        position = (size_t)(close_quote + 1 - value);
+    }
+    return false;
+}
+
+// Reads the decimal number at value[*position], saturating at UINT64_MAX.
+// Leaves number alone unless there is at least one digit.
+static bool parse_number(const char *value, size_t length, size_t *position, uint64_t *number)
+{
+    const size_t start  = *position;
+    uint64_t     parsed = 0;
+
+    while(*position < length && value[*position] >= '0' && value[*position] <= '9')
+    {
+        const uint64_t digit = (uint64_t)(value[*position] - '0');
+
+        parsed = parsed > (UINT64_MAX - digit) / DECIMAL_BASE ? UINT64_MAX : (parsed * DECIMAL_BASE) + digit;
+        (*position)++;
+    }
+    if(*position == start)
+    {
+        return false;
+    }
+    *number = parsed;
+    return true;
+}
+
+int http_parse_range(const char *value, size_t length, uint64_t size, http_byte_range *ranges, size_t max_ranges)
+{
+    const size_t unit_length = sizeof(RANGE_UNIT) - 1;
+    size_t       position    = unit_length;
+    size_t       count       = 0;
+    size_t       specs       = 0;
+
+    if(length < unit_length || strncasecmp(value, RANGE_UNIT, unit_length) != 0)
+    {
+        return -1;
+    }
+
+    while(position < length)
+    {
+        uint64_t first = 0;
+        uint64_t last  = UINT64_MAX;
+        bool     has_first;
+
+        while(position < length && is_space(value[position]))
+        {
+            position++;
+        }
+
+        // empty list elements are allowed
+        if(position < length && value[position] == ',')
+        {
+            position++;
+            continue;
+        }
+
+        has_first = parse_number(value, length, &position, &first);
+        if(position == length || value[position] != '-')
+        {
+            return -1;
+        }
+        position++;
+        if(!parse_number(value, length, &position, &last) && !has_first)
+        {
+            return -1;
+        }
+        while(position < length && is_space(value[position]))
+        {
+            position++;
+        }
+        if(position < length && value[position++] != ',')
+        {
+            return -1;
+        }
+
+        // a range that is too many makes the whole header ignored, as does one that is backwards
+        if(++specs > max_ranges || (has_first && last < first))
+        {
+            return -1;
+        }
+
+        if(!has_first)
+        {
+            // "-n" is the last n bytes
+            if(last == 0 || size == 0)
+            {
+                continue;
+            }
+            first = last < size ? size - last : 0;
+            last  = size - 1;
+        }
+        else if(first >= size)
+        {
+            continue;
+        }
+        else if(last >= size)
+        {
+            last = size - 1;
+        }
+
+        ranges[count].first  = first;
+        ranges[count].length = last - first + 1;
+        count++;
+    }
+    return specs == 0 ? -1 : (int)count;
+}
+
+// Whole days from 1970-01-01 in the proleptic Gregorian calendar. Years are
+// counted from March so the leap day comes last, month is 0 for January.
+static int64_t days_from_civil(int year, int month, int day)
+{
+    const int     march_year   = year - (month < 2);
+    const int     era          = march_year / YEARS_PER_ERA;
+    const int     year_of_era  = march_year - (era * YEARS_PER_ERA);
+    const int     march_month  = month < 2 ? month + MONTHS_PER_YEAR - 2 : month - 2;
+    const int     day_of_year  = (((DAYS_PER_FIVE_MARCH_MONTHS * march_month) + 2) / 5) + day - 1;
+    const int64_t day_of_era   = ((int64_t)year_of_era * DAYS_PER_YEAR) + (year_of_era / 4) - (year_of_era / 100) + day_of_year;
+
+    return ((int64_t)era * DAYS_PER_ERA) + day_of_era - DAYS_FROM_ERA_TO_EPOCH;
+}
+
+static int parse_digits(const char *value, size_t count)
+{
+    int number = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        number = (number * DECIMAL_BASE) + (value[i] - '0');
+    }
+    return number;
+}
+
+int http_parse_date(const char *value, size_t length, time_t *seconds)
+{
+    // '0' stands for a digit and 'a' for a letter, anything else must match
+    static const char PATTERN[] = "aaa, 00 aaa 0000 00:00:00 GMT";
+    static const char MONTHS[]  = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int               month     = 0;
+    int               day;
+    int               hour;
+    int               minute;
+    int               second;
+
+    if(length != sizeof(PATTERN) - 1)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < length; i++)
+    {
+        const bool matches = PATTERN[i] == '0' ? (value[i] >= '0' && value[i] <= '9') : PATTERN[i] == 'a' || value[i] == PATTERN[i];
+
+        if(!matches)
+        {
+            return -1;
+        }
+    }
+
+    while(month < MONTHS_PER_YEAR && memcmp(value + IMF_MONTH, MONTHS + (month * 3), 3) != 0)
+    {
+        month++;
+    }
+    day    = parse_digits(value + IMF_DAY, 2);
+    hour   = parse_digits(value + IMF_HOUR, 2);
+    minute = parse_digits(value + IMF_MINUTE, 2);
+    second = parse_digits(value + IMF_SECOND, 2);
+    if(month == MONTHS_PER_YEAR || day < 1 || day > MAX_DAY_OF_MONTH || hour >= HOURS_PER_DAY || minute >= MINUTES_PER_HOUR || second > MAX_SECOND)
+    {
+        return -1;
+    }
+
+    *seconds = (time_t)((days_from_civil(parse_digits(value + IMF_YEAR, 4), month, day) * SECONDS_PER_DAY) + (hour * SECONDS_PER_HOUR) + (minute * SECONDS_PER_MINUTE) + second);
+    return 0;
+}
+
+int http_format_date(time_t seconds, char date[HTTP_DATE_CAPACITY])
+{
+    struct tm tm;
+
+    // the C locale is never changed, so the day and month names are English
+    if(gmtime_r(&seconds, &tm) == NULL || strftime(date, HTTP_DATE_CAPACITY, IMF_FIXDATE, &tm) != HTTP_DATE_CAPACITY - 1)
+    {
+        return -1;
+    }
+    return 0;
+}
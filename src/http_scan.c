@@ -0,0 +1,260 @@
+#include "../include/http_scan.h"
+#include <errno.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define HTTP_SCAN_X86 1
+    #include <immintrin.h>
+#endif
+
+// tchar from RFC 9110, the characters allowed in methods and header names
+bool http_is_token_char(unsigned char c)
+{
+    if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+    {
+        return true;
+    }
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static size_t scalar_scan_path(const char *buffer, size_t start, size_t end)
+{
+    while(start < end)
+    {
+        const unsigned char c = (unsigned char)buffer[start];
+        if(c <= ' ' || c == 0x7f)
+        {
+            break;
+        }
+        start++;
+    }
+    return start;
+}
+
+static size_t scalar_scan_value(const char *buffer, size_t start, size_t end)
+{
+    while(start < end)
+    {
+        const unsigned char c = (unsigned char)buffer[start];
+        if((c < ' ' && c != '\t') || c == 0x7f)
+        {
+            break;
+        }
+        start++;
+    }
+    return start;
+}
+
+static size_t scalar_scan_token(const char *buffer, size_t start, size_t end)
+{
+    while(start < end && http_is_token_char((unsigned char)buffer[start]))
+    {
+        start++;
+    }
+    return start;
+}
+
+static const struct http_scan_ops scalar_scan_ops = {
+    .name  = "scalar",
+    .path  = scalar_scan_path,
+    .value = scalar_scan_value,
+    .token = scalar_scan_token,
+};
+
+#ifdef HTTP_SCAN_X86
+enum
+{
+    SSE42_BLOCK = 16,
+    AVX2_BLOCK  = 32,
+};
+
+// PCMPESTRI range pairs, padded to a full register. The lengths are explicit,
+// so NUL can start a range.
+static const char PATH_STOP_RANGES[SSE42_BLOCK]  = {0x00, ' ', 0x7f, 0x7f};
+static const char VALUE_STOP_RANGES[SSE42_BLOCK] = {0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f};
+
+// A superset of the non-token bytes squeezed into the eight ranges PCMPESTRI
+// allows: 0x7b-0xff also covers '|' and '~', which the parser then steps over.
+static const char TOKEN_STOP_RANGES[SSE42_BLOCK] = {0x00, ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', (char)0xff};
+
+enum
+{
+    PATH_STOP_RANGES_LENGTH  = 4,
+    VALUE_STOP_RANGES_LENGTH = 6,
+    TOKEN_STOP_RANGES_LENGTH = 16,
+};
+
+__attribute__((target("sse4.2"))) static size_t sse42_scan(const char *buffer, size_t start, size_t end, const char *ranges, int ranges_length)
+{
+    const __m128i ranges_vector = _mm_loadu_si128((const __m128i *)ranges);
+
+    while(end - start >= SSE42_BLOCK)
+    {
+        const __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + start));
+        const int     index = _mm_cmpestri(ranges_vector, ranges_length, chunk, SSE42_BLOCK, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+
+        if(index != SSE42_BLOCK)
+        {
+            return start + (size_t)index;
+        }
+        start += SSE42_BLOCK;
+    }
+    return start;
+}
+
+__attribute__((target("sse4.2"))) static size_t sse42_scan_path(const char *buffer, size_t start, size_t end)
+{
+    return scalar_scan_path(buffer, sse42_scan(buffer, start, end, PATH_STOP_RANGES, PATH_STOP_RANGES_LENGTH), end);
+}
+
+__attribute__((target("sse4.2"))) static size_t sse42_scan_value(const char *buffer, size_t start, size_t end)
+{
+    return scalar_scan_value(buffer, sse42_scan(buffer, start, end, VALUE_STOP_RANGES, VALUE_STOP_RANGES_LENGTH), end);
+}
+
+__attribute__((target("sse4.2"))) static size_t sse42_scan_token(const char *buffer, size_t start, size_t end)
+{
+    return scalar_scan_token(buffer, sse42_scan(buffer, start, end, TOKEN_STOP_RANGES, TOKEN_STOP_RANGES_LENGTH), end);
+}
+
+static const struct http_scan_ops sse42_scan_ops = {
+    .name  = "sse4.2",
+    .path  = sse42_scan_path,
+    .value = sse42_scan_value,
+    .token = sse42_scan_token,
+};
+
+// Token bytes as a nibble bitmap: a byte is a tchar when the bit for its high
+// nibble is set in the entry for its low nibble. Both halves repeat per 128-bit lane.
+static const unsigned char TOKEN_LOW_NIBBLE_BITS[AVX2_BLOCK] = {
+    0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+    0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+};
+static const unsigned char TOKEN_HIGH_NIBBLE_BITS[AVX2_BLOCK] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Bytes <= limit, found as min(byte, limit) == byte since AVX2 has no unsigned compare
+__attribute__((target("avx2"))) static __m256i avx2_at_most(__m256i chunk, char limit)
+{
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, _mm256_set1_epi8(limit)), chunk);
+}
+
+__attribute__((target("avx2"))) static size_t avx2_scan_path(const char *buffer, size_t start, size_t end)
+{
+    while(end - start >= AVX2_BLOCK)
+    {
+        const __m256i  chunk = _mm256_loadu_si256((const __m256i *)(buffer + start));
+        const __m256i  stop  = _mm256_or_si256(avx2_at_most(chunk, ' '), _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f)));
+        const unsigned mask  = (unsigned)_mm256_movemask_epi8(stop);
+
+        if(mask != 0)
+        {
+            return start + (size_t)__builtin_ctz(mask);
+        }
+        start += AVX2_BLOCK;
+    }
+    return scalar_scan_path(buffer, start, end);
+}
+
+__attribute__((target("avx2"))) static size_t avx2_scan_value(const char *buffer, size_t start, size_t end)
+{
+    while(end - start >= AVX2_BLOCK)
+    {
+        const __m256i  chunk   = _mm256_loadu_si256((const __m256i *)(buffer + start));
+        const __m256i  control = _mm256_andnot_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')), avx2_at_most(chunk, 0x1f));
+        const __m256i  stop    = _mm256_or_si256(control, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f)));
+        const unsigned mask    = (unsigned)_mm256_movemask_epi8(stop);
+
+        if(mask != 0)
+        {
+            return start + (size_t)__builtin_ctz(mask);
+        }
+        start += AVX2_BLOCK;
+    }
+    return scalar_scan_value(buffer, start, end);
+}
+
+__attribute__((target("avx2"))) static size_t avx2_scan_token(const char *buffer, size_t start, size_t end)
+{
+    const __m256i low_bits  = _mm256_loadu_si256((const __m256i *)TOKEN_LOW_NIBBLE_BITS);
+    const __m256i high_bits = _mm256_loadu_si256((const __m256i *)TOKEN_HIGH_NIBBLE_BITS);
+    const __m256i nibble    = _mm256_set1_epi8(0x0f);
+
+    while(end - start >= AVX2_BLOCK)
+    {
+        const __m256i  chunk = _mm256_loadu_si256((const __m256i *)(buffer + start));
+        const __m256i  low   = _mm256_shuffle_epi8(low_bits, _mm256_and_si256(chunk, nibble));
+        const __m256i  high  = _mm256_shuffle_epi8(high_bits, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble));
+        const __m256i  stop  = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+        const unsigned mask  = (unsigned)_mm256_movemask_epi8(stop);
+
+        if(mask != 0)
+        {
+            return start + (size_t)__builtin_ctz(mask);
+        }
+        start += AVX2_BLOCK;
+    }
+    return scalar_scan_token(buffer, start, end);
+}
+
+static const struct http_scan_ops avx2_scan_ops = {
+    .name  = "avx2",
+    .path  = avx2_scan_path,
+    .value = avx2_scan_value,
+    .token = avx2_scan_token,
+};
+#endif
+
+const struct http_scan_ops *http_scan = &scalar_scan_ops;
+
+void http_scan_init(void)
+{
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        http_scan = &avx2_scan_ops;
+        return;
+    }
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+        http_scan = &sse42_scan_ops;
+        return;
+    }
+#endif
+    http_scan = &scalar_scan_ops;
+}
+
+int http_scan_select(enum http_scan_type type)
+{
+    switch(type)
+    {
+        case HTTP_SCAN_SCALAR:
+            http_scan = &scalar_scan_ops;
+            return 0;
+#ifdef HTTP_SCAN_X86
+        case HTTP_SCAN_SSE42:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("sse4.2"))
+            {
+                break;
+            }
+            http_scan = &sse42_scan_ops;
+            return 0;
+        case HTTP_SCAN_AVX2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("avx2"))
+            {
+                break;
+            }
+            http_scan = &avx2_scan_ops;
+            return 0;
+#endif
+        default:
+            break;
+    }
+    errno = ENOTSUP;
+    return -1;
+}
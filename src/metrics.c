@@ -0,0 +1,195 @@
+#include "../include/metrics.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define US_PER_SECOND 1e6
+
+static const double QUANTILES[]            = {0.5, 0.9, 0.99, 0.999};
+static const char  *STATUS_CLASS_LABELS[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+int metrics_init(metrics_registry *registry, size_t num_shards)
+{
+    registry->shards = aligned_alloc(METRICS_CACHE_LINE, num_shards * sizeof(metrics_shard));
+    if(registry->shards == NULL)
+    {
+        return -1;
+    }
+    memset(registry->shards, 0, num_shards * sizeof(metrics_shard));
+    registry->num_shards = num_shards;
+    return 0;
+}
+
+void metrics_destroy(metrics_registry *registry)
+{
+    free(registry->shards);
+    registry->shards     = NULL;
+    registry->num_shards = 0;
+}
+
+static size_t histogram_bucket(uint64_t value)
+{
+    int exponent;
+
+    if(value < METRICS_HISTOGRAM_EXACT)
+    {
+        return (size_t)value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    if(exponent > METRICS_HISTOGRAM_MAX_EXPONENT)
+    {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    // the bits right below the leading one pick the sub-bucket
+    return METRICS_HISTOGRAM_EXACT + ((size_t)(exponent - METRICS_HISTOGRAM_MIN_EXPONENT) * METRICS_HISTOGRAM_SUB_BUCKETS) +
+           (size_t)((value >> (exponent - METRICS_HISTOGRAM_SUB_BUCKET_BITS)) & (METRICS_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The largest value that lands in the bucket, so a reported quantile is never too low
+static uint64_t histogram_bucket_upper_bound(size_t bucket)
+{
+    size_t   exponent;
+    uint64_t sub_bucket;
+
+    if(bucket < METRICS_HISTOGRAM_EXACT)
+    {
+        return bucket;
+    }
+
+    exponent   = METRICS_HISTOGRAM_MIN_EXPONENT + ((bucket - METRICS_HISTOGRAM_EXACT) / METRICS_HISTOGRAM_SUB_BUCKETS);
+    sub_bucket = (bucket - METRICS_HISTOGRAM_EXACT) % METRICS_HISTOGRAM_SUB_BUCKETS;
+    return ((METRICS_HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - METRICS_HISTOGRAM_SUB_BUCKET_BITS)) - 1;
+}
+
+void metrics_record_response(metrics_shard *shard, int status_code, uint64_t bytes_sent, uint64_t microseconds)
+{
+    const int status_class = (status_code / 100) - 1;
+
+    if(status_class >= 0 && status_class < METRICS_STATUS_CLASSES)
+    {
+        metrics_add(&shard->responses[status_class], 1);
+    }
+    metrics_add(&shard->bytes_sent, bytes_sent);
+
+    metrics_add(&shard->latency.buckets[histogram_bucket(microseconds)], 1);
+    metrics_add(&shard->latency.count, 1);
+    metrics_add(&shard->latency.sum, microseconds);
+}
+
+static uint64_t sum_counter(const metrics_registry *registry, size_t offset)
+{
+    uint64_t total = 0;
+
+    for(size_t i = 0; i < registry->num_shards; i++)
+    {
+        const metrics_counter *counter = (const metrics_counter *)((const char *)&registry->shards[i] + offset);
+
+        total += atomic_load_explicit(counter, memory_order_relaxed);
+    }
+    return total;
+}
+
+struct text_buffer
+{
+    char  *data;
+    size_t length;
+    bool   overflowed;
+};
+
+__attribute__((format(printf, 2, 3))) static void append(struct text_buffer *text, const char *format, ...)
+{
+    va_list args;
+    int     written;
+
+    if(text->overflowed)
+    {
+        return;
+    }
+
+    va_start(args, format);
+    written = vsnprintf(text->data + text->length, METRICS_TEXT_CAPACITY - text->length, format, args);
+    va_end(args);
+
+    if(written < 0 || (size_t)written >= METRICS_TEXT_CAPACITY - text->length)
+    {
+        text->overflowed = true;
+        return;
+    }
+    text->length += (size_t)written;
+}
+
+static void append_counter(struct text_buffer *text, const char *name, const char *help, const char *type, uint64_t value)
+{
+    append(text, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, (unsigned long long)value);
+}
+
+char *metrics_render(const metrics_registry *registry, size_t *length)
+{
+    struct text_buffer text = {0};
+    uint64_t           buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t           count = 0;
+
+    text.data = malloc(METRICS_TEXT_CAPACITY);
+    if(text.data == NULL)
+    {
+        return NULL;
+    }
+
+    append_counter(&text, "http_connections_active", "Open client connections.", "gauge", sum_counter(registry, offsetof(metrics_shard, connections_active)));
+    append_counter(&text, "http_connection_buffer_bytes", "Pooled buffers held by connections with a request in flight.", "gauge", sum_counter(registry, offsetof(metrics_shard, connection_buffer_bytes)));
+    append_counter(&text, "http_connections_accepted_total", "Connections accepted.", "counter", sum_counter(registry, offsetof(metrics_shard, connections_accepted)));
+    append_counter(&text, "http_response_bytes_total", "Bytes written to clients, headers included.", "counter", sum_counter(registry, offsetof(metrics_shard, bytes_sent)));
+    append_counter(&text, "http_parse_errors_total", "Requests rejected before they could be parsed.", "counter", sum_counter(registry, offsetof(metrics_shard, parse_errors)));
+    append_counter(&text, "http_file_cache_hits_total", "Open-file cache hits.", "counter", sum_counter(registry, offsetof(metrics_shard, file_cache_hits)));
+    append_counter(&text, "http_file_cache_misses_total", "Open-file cache misses.", "counter", sum_counter(registry, offsetof(metrics_shard, file_cache_misses)));
+    append_counter(&text, "http_response_cache_hits_total", "In-memory response cache hits.", "counter", sum_counter(registry, offsetof(metrics_shard, response_cache_hits)));
+    append_counter(&text, "http_response_cache_misses_total", "In-memory response cache misses.", "counter", sum_counter(registry, offsetof(metrics_shard, response_cache_misses)));
+    append_counter(&text, "http_compression_cache_hits_total", "Bodies served from the on-the-fly gzip cache.", "counter", sum_counter(registry, offsetof(metrics_shard, compression_cache_hits)));
+    append_counter(&text, "http_compression_cache_misses_total", "Files queued for on-the-fly gzip compression.", "counter", sum_counter(registry, offsetof(metrics_shard, compression_cache_misses)));
+
+    append(&text, "# HELP http_responses_total Responses by status class.\n# TYPE http_responses_total counter\n");
+    for(size_t i = 0; i < METRICS_STATUS_CLASSES; i++)
+    {
+        append(&text, "http_responses_total{code=\"%s\"} %llu\n", STATUS_CLASS_LABELS[i], (unsigned long long)sum_counter(registry, offsetof(metrics_shard, responses) + (i * sizeof(metrics_counter))));
+    }
+
+    // the shards are merged bucket by bucket, quantiles come from the merged histogram
+    for(size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        buckets[i] = sum_counter(registry, offsetof(metrics_shard, latency.buckets) + (i * sizeof(metrics_counter)));
+        count += buckets[i];
+    }
+
+    append(&text, "# HELP http_request_duration_seconds First request byte read to last response byte written.\n# TYPE http_request_duration_seconds summary\n");
+    for(size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++)
+    {
+        const uint64_t rank       = (uint64_t)((QUANTILES[q] * (double)count) + 0.5);
+        uint64_t       cumulative = 0;
+        uint64_t       value      = 0;
+
+        for(size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS && count > 0; i++)
+        {
+            cumulative += buckets[i];
+            if(cumulative >= rank && buckets[i] > 0)
+            {
+                value = histogram_bucket_upper_bound(i);
+                break;
+            }
+        }
+        append(&text, "http_request_duration_seconds{quantile=\"%g\"} %.6f\n", QUANTILES[q], (double)value / US_PER_SECOND);
+    }
+    append(&text, "http_request_duration_seconds_sum %.6f\n", (double)sum_counter(registry, offsetof(metrics_shard, latency.sum)) / US_PER_SECOND);
+    append(&text, "http_request_duration_seconds_count %llu\n", (unsigned long long)count);
+
+    if(text.overflowed)
+    {
+        free(text.data);
+        return NULL;
+    }
+    *length = text.length;
+    return text.data;
+}
@@ -0,0 +1,52 @@
+#include "../include/path_map.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIRECTORY_INDEX_FILE "index.html"
+
+char *path_map_resolve(arena *a, const char *root, size_t root_length, const char *url_path, size_t url_path_length, char **requested_path)
+{
+    const char *index_file;
+    size_t      combined_length;
+    char       *combined_path;
+    char       *real_path;
+    bool        path_is_valid;
+
+    // a root of "/" adds nothing, the request path brings the separator
+    if(root_length == 1)
+    {
+        root_length = 0;
+    }
+
+    // a directory is served through its index file
+    index_file      = url_path[url_path_length - 1] == '/' ? DIRECTORY_INDEX_FILE : "";
+    combined_length = root_length + url_path_length + strlen(index_file);
+
+    combined_path = arena_alloc(a, (sizeof(char) * combined_length) + 1);
+    real_path     = arena_alloc(a, PATH_MAX);
+    if(combined_path == NULL || real_path == NULL)
+    {
+        return NULL;
+    }
+
+    // the request path always starts with '/', so it doubles as the separator
+    memcpy(combined_path, root, root_length);
+    memcpy(combined_path + root_length, url_path, url_path_length);
+    strcpy(combined_path + root_length + url_path_length, index_file);
+
+    if(realpath(combined_path, real_path) == NULL)
+    {
+        return NULL;
+    }
+
+    // the resolved path must stay inside the root, "/www2" must not pass for "/www"
+    path_is_valid = strncmp(root, real_path, root_length) == 0 && (real_path[root_length] == '/' || real_path[root_length] == '\0');
+    if(requested_path != NULL)
+    {
+        *requested_path = combined_path;
+    }
+
+    return path_is_valid ? real_path : NULL;
+}
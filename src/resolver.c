@@ -0,0 +1,296 @@
+#include "../include/resolver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Family and host address, so every port a client connects from shares one entry.
+// Returns the key length, 0 for families that are not resolved.
+static size_t address_key(const struct sockaddr *addr, unsigned char key[RESOLVER_KEY_CAPACITY])
+{
+    memcpy(key, &addr->sa_family, sizeof(addr->sa_family));
+    if(addr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+        memcpy(key + sizeof(addr->sa_family), &in->sin_addr, sizeof(in->sin_addr));
+        return sizeof(addr->sa_family) + sizeof(in->sin_addr);
+    }
+    if(addr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+        memcpy(key + sizeof(addr->sa_family), &in6->sin6_addr, sizeof(in6->sin6_addr));
+        return sizeof(addr->sa_family) + sizeof(in6->sin6_addr);
+    }
+    return 0;
+}
+
+static void remove_entry(host_resolver *resolver, resolver_entry *entry)
+{
+    resolver_entry **link = &resolver->buckets[entry->hash & (resolver->num_buckets - 1)];
+
+    while(*link != entry)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    lru_unlink(&resolver->lru, &entry->lru);
+    resolver->num_entries--;
+    free(entry);
+}
+
+static resolver_entry *find_entry(host_resolver *resolver, const unsigned char *key, size_t key_length, uint64_t hash)
+{
+    resolver_entry *entry = resolver->buckets[hash & (resolver->num_buckets - 1)];
+
+    while(entry != NULL)
+    {
+        if(entry->hash == hash && entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0)
+        {
+            if(resolver->lru.head != &entry->lru)
+            {
+                lru_unlink(&resolver->lru, &entry->lru);
+                lru_push_front(&resolver->lru, &entry->lru);
+            }
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+// Makes room by dropping the least recently used address
+static resolver_entry *insert_entry(host_resolver *resolver, const unsigned char *key, size_t key_length, uint64_t hash)
+{
+    resolver_entry *entry;
+    size_t          bucket;
+
+    if(resolver->num_entries == resolver->max_entries)
+    {
+        remove_entry(resolver, LRU_ENTRY(resolver->lru.tail, resolver_entry, lru));
+    }
+
+    entry = calloc(1, sizeof(resolver_entry));
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    memcpy(entry->key, key, key_length);
+    entry->key_length = key_length;
+    entry->hash       = hash;
+
+    bucket                    = hash & (resolver->num_buckets - 1);
+    entry->hash_next          = resolver->buckets[bucket];
+    resolver->buckets[bucket] = entry;
+    lru_push_front(&resolver->lru, &entry->lru);
+    resolver->num_entries++;
+    return entry;
+}
+
+static void *resolver_main(void *arg)
+{
+    host_resolver *self = arg;
+
+    while(true)
+    {
+        resolver_result result;
+
+        pthread_mutex_lock(&self->lock);
+        while(!self->stopping && self->queue_length == 0)
+        {
+            pthread_cond_wait(&self->wakeup, &self->lock);
+        }
+        if(self->stopping)
+        {
+            pthread_mutex_unlock(&self->lock);
+            return NULL;
+        }
+        result           = self->queue[self->queue_head];
+        self->queue_head = (self->queue_head + 1) % RESOLVER_QUEUE_CAPACITY;
+        self->queue_length--;
+        pthread_mutex_unlock(&self->lock);
+
+        // the one call that may block for seconds, an address without a name is kept numeric
+        if(getnameinfo((const struct sockaddr *)&result.addr, result.addr_len, result.host, sizeof(result.host), NULL, 0, NI_NAMEREQD) != 0 &&
+           getnameinfo((const struct sockaddr *)&result.addr, result.addr_len, result.host, sizeof(result.host), NULL, 0, NI_NUMERICHOST) != 0)
+        {
+            snprintf(result.host, sizeof(result.host), "?");
+        }
+
+        // the write end is non-blocking, a result is dropped rather than stall shutdown
+        // when the event loop has stopped reading
+        while(write(self->result_fds[1], &result, sizeof(result)) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+int resolver_init(host_resolver *resolver, size_t max_entries)
+{
+    int result;
+
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->result_fds[0] = -1;
+    resolver->result_fds[1] = -1;
+
+    // about one entry per bucket when full
+    resolver->num_buckets = 1;
+    while(resolver->num_buckets < max_entries)
+    {
+        resolver->num_buckets *= 2;
+    }
+    resolver->max_entries = max_entries;
+    resolver->buckets     = calloc(resolver->num_buckets, sizeof(resolver_entry *));
+    if(resolver->buckets == NULL)
+    {
+        return -1;
+    }
+
+    if(pipe(resolver->result_fds) == -1)
+    {
+        free(resolver->buckets);
+        resolver->buckets = NULL;
+        return -1;
+    }
+    for(size_t i = 0; i < 2; i++)
+    {
+        if(fcntl(resolver->result_fds[i], F_SETFD, FD_CLOEXEC) == -1 || fcntl(resolver->result_fds[i], F_SETFL, O_NONBLOCK) == -1)
+        {
+            close(resolver->result_fds[0]);
+            close(resolver->result_fds[1]);
+            free(resolver->buckets);
+            resolver->buckets = NULL;
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->wakeup, NULL);
+
+    result = start_background_thread(&resolver->thread, resolver_main, resolver);
+    if(result != 0)
+    {
+        pthread_cond_destroy(&resolver->wakeup);
+        pthread_mutex_destroy(&resolver->lock);
+        close(resolver->result_fds[0]);
+        close(resolver->result_fds[1]);
+        free(resolver->buckets);
+        resolver->buckets = NULL;
+        errno             = result;
+        return -1;
+    }
+    return 0;
+}
+
+void resolver_destroy(host_resolver *resolver)
+{
+    if(resolver->buckets == NULL)
+    {
+        return;
+    }
+
+    // a lookup in progress is waited for, the rest of the queue is dropped
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopping = true;
+    pthread_cond_signal(&resolver->wakeup);
+    pthread_mutex_unlock(&resolver->lock);
+    pthread_join(resolver->thread, NULL);
+
+    pthread_cond_destroy(&resolver->wakeup);
+    pthread_mutex_destroy(&resolver->lock);
+    close(resolver->result_fds[0]);
+    close(resolver->result_fds[1]);
+
+    while(resolver->lru.head != NULL)
+    {
+        remove_entry(resolver, LRU_ENTRY(resolver->lru.head, resolver_entry, lru));
+    }
+    free(resolver->buckets);
+    resolver->buckets = NULL;
+}
+
+const char *resolver_lookup(host_resolver *resolver, const struct sockaddr *addr, socklen_t addr_len, void *data, uint32_t generation)
+{
+    unsigned char   key[RESOLVER_KEY_CAPACITY];
+    size_t          key_length;
+    uint64_t        hash;
+    resolver_entry *entry;
+    bool            queued = false;
+
+    key_length = address_key(addr, key);
+    if(key_length == 0 || addr_len > sizeof(struct sockaddr_storage))
+    {
+        return NULL;
+    }
+
+    hash  = hash_bytes(key, key_length);
+    entry = find_entry(resolver, key, key_length, hash);
+    if(entry != NULL)
+    {
+        return entry->resolved ? entry->host : NULL;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    if(resolver->queue_length < RESOLVER_QUEUE_CAPACITY)
+    {
+        resolver_result *request = &resolver->queue[(resolver->queue_head + resolver->queue_length) % RESOLVER_QUEUE_CAPACITY];
+
+        memcpy(&request->addr, addr, addr_len);
+        request->addr_len   = addr_len;
+        request->data       = data;
+        request->generation = generation;
+        resolver->queue_length++;
+        pthread_cond_signal(&resolver->wakeup);
+        queued = true;
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    // a pending entry keeps later connections from the same address from queueing it again
+    if(queued)
+    {
+        insert_entry(resolver, key, key_length, hash);
+    }
+    return NULL;
+}
+
+int resolver_next_result(host_resolver *resolver, resolver_result *result)
+{
+    unsigned char   key[RESOLVER_KEY_CAPACITY];
+    size_t          key_length;
+    uint64_t        hash;
+    resolver_entry *entry;
+    ssize_t         length;
+
+    do
+    {
+        length = read(resolver->result_fds[0], result, sizeof(*result));
+    } while(length == -1 && errno == EINTR);
+
+    // results are written whole, anything else means the pipe is drained
+    if(length != (ssize_t)sizeof(*result))
+    {
+        return 0;
+    }
+    result->host[sizeof(result->host) - 1] = '\0';
+
+    key_length = address_key((const struct sockaddr *)&result->addr, key);
+    hash       = hash_bytes(key, key_length);
+    entry      = find_entry(resolver, key, key_length, hash);
+    if(entry == NULL)
+    {
+        // evicted while the lookup was running
+        entry = insert_entry(resolver, key, key_length, hash);
+    }
+    if(entry != NULL)
+    {
+        entry->resolved = true;
+        memcpy(entry->host, result->host, sizeof(entry->host));
+    }
+    return 1;
+}
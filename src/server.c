@@ -1,35 +1,120 @@
 #define _POSIX_C_SOURCE 200809L    // NOLINT
+#ifdef __linux__
+    #define _GNU_SOURCE    // NOLINT pthread_setaffinity_np
+#endif
 
 #include "../include/server.h"
+#include "../include/http_scan.h"
+#include "../include/path_map.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
 #ifndef NI_MAXHOST
     #define NI_MAXHOST 1025
 #endif
 #ifndef NI_MAXSERV
     #define NI_MAXSERV 32
 #endif
+#ifndef MSG_MORE
+    #define MSG_MORE 0
+#endif
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0    // SIGPIPE is ignored as well
+#endif
+
+#define SERVER_NAME "http_server_1"
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+#define ACCEPT_RANGES_HEADER "Accept-Ranges: bytes\r\n"
+#define VARY_HEADER "Vary: Accept-Encoding\r\n"
+#define BROTLI_ENCODING_HEADERS VARY_HEADER "Content-Encoding: br\r\n"
+#define GZIP_ENCODING_HEADERS VARY_HEADER "Content-Encoding: gzip\r\n"
+
+struct content_type_mapping
+{
+    const char *extension;
+    const char *content_type;
+    bool        compressible;
+};
+
+static const struct content_type_mapping CONTENT_TYPES[] = {
+    {"html", "text/html; charset=utf-8",       true },
+    {"htm",  "text/html; charset=utf-8",       true },
+    {"css",  "text/css; charset=utf-8",        true },
+    {"js",   "text/javascript; charset=utf-8", true },
+    {"json", "application/json",               true },
+    {"txt",  "text/plain; charset=utf-8",      true },
+    {"xml",  "application/xml",                true },
+    {"svg",  "image/svg+xml",                  true },
+    {"png",  "image/png",                      false},
+    {"jpg",  "image/jpeg",                     false},
+    {"jpeg", "image/jpeg",                     false},
+    {"gif",  "image/gif",                      false},
+    {"ico",  "image/x-icon",                   false},
+    {"webp", "image/webp",                     false},
+    {"pdf",  "application/pdf",                false},
+    {"wasm", "application/wasm",               true },
+};
+
+// A precompressed sibling, "a.js.br" next to "a.js", and the headers it goes out with
+struct content_encoding
+{
+    const char *token; // in Accept-Encoding
+    const char *extension;
+    const char *headers;
+};
 
+// the client's q-values are not weighed against each other, brotli is preferred as it compresses best
+static const struct content_encoding PRECOMPRESSED_ENCODINGS[] = {
+    {"br",   ".br", BROTLI_ENCODING_HEADERS},
+    {"gzip", ".gz", GZIP_ENCODING_HEADERS  },
+};
 enum
 {
-    INITIAL_POLLFDS_CAPACITY = 11
+    MAX_EVENTS_PER_WAIT = 64,
+    US_PER_SECOND       = 1000000,
+    NS_PER_US           = 1000,
+    BYTES_PER_KIB       = 1024,
 };
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables
 static volatile sig_atomic_t exit_flag = 0;
 
-static int parse_http_request(const server_context *ctx, client_state *state);
+// response bytes queued in memory by every worker, held against queue_limit
+static atomic_size_t total_queued_bytes = 0;
+
+static int parse_http_request(client_state *state);
+
+static void handle_request(server_context *ctx, client_state *state);
+
+static void send_error_response(client_state *state, int status_code);
+
+static void handle_get(server_context *ctx, client_state *state);
+
+static const char *content_type_for(const char *path);
+
+static void handle_head(server_context *ctx, client_state *state);
+
+static uint64_t monotonic_us(void);
 
 static server_context init_context()
 {
@@ -41,10 +126,29 @@ static server_context init_context()
     ctx.exit_code        = EXIT_SUCCESS;
     ctx.exit_message     = NULL;
     ctx.listen_fd        = -1;
+    ctx.admin_fd         = -1;
     ctx.num_clients      = 0;
-    ctx.pollfds          = NULL;
-    ctx.clients          = NULL;
-    ctx.pollfds_capacity = 0;
+    ctx.max_header_size  = DEFAULT_MAX_HEADER_SIZE;
+    ctx.idle_timeout_ms    = (uint64_t)DEFAULT_IDLE_TIMEOUT_SECONDS * MS_PER_SECOND;
+    ctx.header_timeout_ms  = (uint64_t)DEFAULT_HEADER_TIMEOUT_SECONDS * MS_PER_SECOND;
+    ctx.accept_batch       = DEFAULT_ACCEPT_BATCH;
+    ctx.num_threads        = 1;
+    ctx.file_cache_entries = DEFAULT_FILE_CACHE_ENTRIES;
+    ctx.compression_threads = DEFAULT_COMPRESSION_THREADS;
+    ctx.compression_budget  = DEFAULT_COMPRESSION_CACHE_BUDGET;
+    ctx.connection_queue_limit = DEFAULT_CONNECTION_QUEUE_LIMIT;
+    ctx.queue_limit            = DEFAULT_QUEUE_LIMIT;
+    ctx.pin_threads      = false;
+    ctx.resolve_hostnames = false;
+    ctx.log_level         = LOG_LEVEL_INFO;
+    ctx.log_format        = LOG_FORMAT_COMBINED;
+    ctx.wakeup_fds[0]    = -1;
+    ctx.wakeup_fds[1]    = -1;
+#ifdef __linux__
+    ctx.backend_type = EVENT_BACKEND_EPOLL;
+#else
+    ctx.backend_type = EVENT_BACKEND_POLL;
+#endif
 
     return ctx;
 }
@@ -65,414 +169,1699 @@ static int convert_address(server_context *ctx);
 
 static void init_server_socket(server_context *ctx);
 
-static void init_poll_fds(server_context *ctx);
+static void init_admin_socket(server_context *ctx);
+
+static void init_event_backend(server_context *ctx);
+
+static void init_file_cache(server_context *ctx);
+
+static void init_resolver(server_context *ctx);
+
+static void init_compressor(server_context *ctx);
+
+static void init_access_log(server_context *ctx, access_log *log);
+
+static void cleanup_access_log(server_context *ctx);
+
+static void init_metrics(server_context *ctx, metrics_registry *registry);
+
+static void cleanup_metrics(server_context *ctx);
+
+static void cleanup_buffer_pool(void);
 
 static void event_loop(server_context *ctx);
 
-static void accept_client(server_context *ctx);
+static void run_workers(server_context *ctx);
 
-static void close_client(server_context *ctx, const client_state *state);
+static void accept_clients(server_context *ctx, int listen_fd, bool admin);
 
-static void cleanup_server(const server_context *ctx);
+static int format_peer_address(const client_state *state, char host[NI_MAXHOST], char service[NI_MAXSERV]);
 
-static void read_request(server_context *ctx, client_state *state)
-{
-    const char  *request_sentinel        = "\r\n\r\n";
-    const size_t request_sentinel_length = strlen(request_sentinel);
+static void serve_client(server_context *ctx, client_state *state);
+
+static void close_client(server_context *ctx, client_state *state);
 
-    // markp: added freeing existing buffer if it exists to prevent leak/overwrite
-    // needed to set to null after free so closeing client doesn't double-free if error
-    if(state->request_buffer)
+static void cleanup_server(server_context *ctx);
+
+// Connections borrow this when bytes arrive and give it back once idle again
+static int borrow_exchange(client_state *state)
+{
+    if(state->exchange != NULL)
     {
-        free(state->request_buffer);
-        state->request_buffer = NULL;
+        return 0;
     }
 
-    // Allocate request buffer
-    state->request_buffer = malloc(BASE_REQUEST_BUFFER_CAPACITY);
-    if(state->request_buffer == NULL)
+    state->exchange = buffer_pool_acquire(sizeof(client_exchange));
+    if(state->exchange == NULL)
     {
-        close_client(ctx, state);
-        return;
+        return -1;
     }
-    state->request_buffer_capacity = BASE_REQUEST_BUFFER_CAPACITY;
+    memset(&state->exchange->response, 0, sizeof(state->exchange->response));
+    state->exchange->response.file_fd = -1;
+    state->exchange->queue_head       = 0;
+    state->exchange->queue_length     = 0;
+    state->exchange->queued_bytes     = 0;
+    http_parser_init(&state->exchange->parser, &state->exchange->request, 0);
+    return 0;
+}
+
+// Only between requests: nothing half read, nothing left to send
+static void return_idle_buffers(client_state *state)
+{
+    buffer_pool_release(state->request_buffer);
+    state->request_buffer          = NULL;
+    state->request_buffer_capacity = 0;
     state->request_buffer_filled   = 0;
+    state->request_start           = 0;
 
-    bool isEndOfRequest;
-    do
-    {
-        size_t remaining_buffer_space = state->request_buffer_capacity - state->request_buffer_filled;
+    buffer_pool_release(state->exchange);
+    state->exchange = NULL;
+    arena_destroy(&state->arena);
+}
 
-        // Reallocate if there is not much space
-        if(remaining_buffer_space < REQUEST_BUFFER_INCREASE_THRESHOLD)
-        {
-            const size_t new_capacity       = state->request_buffer_capacity * 2;
-            void        *new_buffer_pointer = realloc(state->request_buffer, new_capacity);
-            if(new_buffer_pointer == NULL)
-            {
-                free(state->request_buffer);
-                state->request_buffer_capacity = 0;
-                state->request_buffer_filled   = 0;
-                close_client(ctx, state);
-                return;
-            }
-            state->request_buffer          = new_buffer_pointer;
-            state->request_buffer_capacity = new_capacity;
-        }
+static int grow_request_buffer(const server_context *ctx, client_state *state)
+{
+    size_t new_capacity;
+    char  *new_buffer_pointer;
 
-        // Read into the buffer
-        const ssize_t result = read(state->socket, state->request_buffer + state->request_buffer_filled, 1);
-        switch(result)
-        {
-            case -1:    // ERROR
-                if(errno != EINTR)
-                {
-                    // i made close_client, fixing build
-                    //  free(state->request_buffer);
-                    //  state->request_buffer_capacity = 0;
-                    //  state->request_buffer_filled   = 0;
-                    close_client(ctx, state);
-                    return;
-                }
-                break;    // mark p added
-            case 0:       // EOF
-                // mark p made close_client, fixing build
-                //  free(state->request_buffer);
-                //  state->request_buffer_capacity = 0;
-                //  state->request_buffer_filled   = 0;
-                close_client(ctx, state);
-                return;
-            default:
-                state->request_buffer_filled += result;
-        }
+    if(state->request_buffer_capacity >= ctx->max_header_size)
+    {
+        return -1;
+    }
+
+    // + 1 so there is always room for the terminating '\0', the rest of the size class is used as well
+    new_capacity = state->request_buffer_capacity == 0 ? BASE_REQUEST_BUFFER_CAPACITY : buffer_pool_size((state->request_buffer_capacity + 1) * 2) - 1;
+    if(new_capacity > ctx->max_header_size)
+    {
+        new_capacity = ctx->max_header_size;
+    }
 
-        isEndOfRequest = strncmp(state->request_buffer + state->request_buffer_filled - request_sentinel_length, request_sentinel, request_sentinel_length) == 0;
-    } while(isEndOfRequest);
-    state->request_buffer[state->request_buffer_filled] = '\0';
-    parse_http_request(ctx, state);
+    new_buffer_pointer = buffer_pool_acquire(new_capacity + 1);
+    if(new_buffer_pointer == NULL)
+    {
+        return -1;
+    }
+    if(state->request_buffer != NULL)
+    {
+        memcpy(new_buffer_pointer, state->request_buffer, state->request_buffer_filled);
+        buffer_pool_release(state->request_buffer);
+    }
+    state->request_buffer          = new_buffer_pointer;
+    state->request_buffer_capacity = new_capacity;
+    return 0;
 }
 
-struct split_string
+// Latency is measured for the access log and the metrics, otherwise the clock is never read
+static bool is_timing_requests(const server_context *ctx)
 {
-    ssize_t count;
-    char  **strings;
-};
+    return ctx->metrics_shard != NULL || ctx->log_level >= LOG_LEVEL_ACCESS;
+}
 
-static int get_tokens_in_str(const char *string, const char *delimiter)
+static void count_parse_error(const server_context *ctx)
 {
-    char *temp_string;
-    char *token;
-    char *save_ptr;
+    if(ctx->metrics_shard != NULL)
+    {
+        metrics_add(&ctx->metrics_shard->parse_errors, 1);
+    }
+}
 
-    int count = 0;
+// What the event backend already read comes first. A socket the backend reads
+// is never read here as well, once its bytes run out nothing more is in until
+// its next event.
+static ssize_t receive(server_context *ctx, client_state *state, char *buffer, size_t capacity)
+{
+    received_data *received = state->received;
+    size_t         length;
 
-    temp_string = strdup(string);
-    if(temp_string == NULL)
+    if(!ctx->backend.receives)
+    {
+        return read(state->socket, buffer, capacity);
+    }
+    if(received == NULL)
     {
-        perror("Memory allocation failed when getting tokens in string\n");
+        if(state->received_end)
+        {
+            return 0;
+        }
+        errno = EAGAIN;
         return -1;
     }
-    token = strtok_r(temp_string, delimiter, &save_ptr);
-    while(token != NULL)
+
+    length = received->length - received->offset;
+    if(length > capacity)
+    {
+        length = capacity;
+    }
+    memcpy(buffer, received->data + received->offset, length);
+    received->offset += length;
+    if(received->offset == received->length)
     {
-        count++;
-        token = strtok_r(NULL, delimiter, &save_ptr);
+        state->received = received->next;
+        event_backend_release(&ctx->backend, received);
     }
-    free(temp_string);
-    return count;
+    return (ssize_t)length;
 }
 
-static void free_split_string(struct split_string *split_string)
+// Pulls whatever the (non-blocking) socket has into the connection's buffer.
+// A request may arrive over several poll wakeups, so the buffer and the parser
+// state survive between calls and only the new bytes are parsed. Bytes left
+// over from the previous request on the connection are parsed before reading.
+static int read_request(server_context *ctx, client_state *state)
 {
-    if(split_string->strings == NULL)
+    while(true)
     {
-        return;
-    }
+        const int parse_result = parse_http_request(state);
 
-    // Free all of the duped strings
-    for(int i = 0; i < split_string->count; i++)
-    {
-        if(split_string->strings[i] == NULL)
+        if(parse_result == HTTP_PARSE_COMPLETE)
         {
-            continue;
+            // the request is sliced straight out of the buffer, anything past
+            // state->exchange->parser.position belongs to whatever the client sends next
+            return READ_COMPLETE;
+        }
+        if(parse_result == HTTP_PARSE_ERROR)
+        {
+            count_parse_error(ctx);
+            send_error_response(state, HTTP_BAD_REQUEST);
+            return READ_REJECTED;
+        }
+        if(parse_result == HTTP_PARSE_TOO_MANY_HEADERS)
+        {
+            count_parse_error(ctx);
+            send_error_response(state, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+            return READ_REJECTED;
+        }
+
+        // the requests before this one are answered, their bytes make room for
+        // more and the partial request after them is parsed again from the front
+        if(state->request_start > 0)
+        {
+            state->request_buffer_filled -= state->request_start;
+            memmove(state->request_buffer, state->request_buffer + state->request_start, state->request_buffer_filled);
+            state->request_start = 0;
+            http_parser_init(&state->exchange->parser, &state->exchange->request, 0);
+        }
+
+        size_t remaining_buffer_space = state->request_buffer_capacity - state->request_buffer_filled;
+
+        // Grow if there is not much space, the header can never go over max_header_size
+        if(remaining_buffer_space < REQUEST_BUFFER_INCREASE_THRESHOLD && grow_request_buffer(ctx, state) == 0)
+        {
+            remaining_buffer_space = state->request_buffer_capacity - state->request_buffer_filled;
+        }
+
+        if(remaining_buffer_space == 0)
+        {
+            count_parse_error(ctx);
+            send_error_response(state, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+            return READ_REJECTED;
+        }
+
+        const ssize_t result = receive(ctx, state, state->request_buffer + state->request_buffer_filled, remaining_buffer_space);
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Drained the socket, wait for the next wakeup
+                return READ_WAITING;
+            }
+            return READ_FAILED;
+        }
+        if(result == 0)    // EOF
+        {
+            return READ_FAILED;
+        }
+        state->request_buffer_filled += (size_t)result;
+
+        // the clock starts with the first byte, however long the rest takes to arrive
+        if(state->request_started_us == 0 && is_timing_requests(ctx))
+        {
+            state->request_started_us = monotonic_us();
         }
-        free(split_string->strings[i]);
-        split_string->strings[i] = NULL;
     }
-    // Free the array itself
-    free((void *)split_string->strings);
-    split_string->strings = NULL;
 }
 
-// Returns with result.strings == NULL to signal failure
-static struct split_string str_split(const char *string, const char *delimiter)
+static int parse_http_request(client_state *state)
+{
+    return http_parser_execute(&state->exchange->parser, &state->exchange->request, state->request_buffer, state->request_buffer_filled);
+}
+
+typedef void (*method_handler)(server_context *ctx, client_state *state);
+
+// Indexed by the method the parser recognised, NULL for methods the server does not implement
+static const method_handler METHOD_HANDLERS[HTTP_METHOD_COUNT] = {
+    [HTTP_METHOD_GET]  = handle_get,
+    [HTTP_METHOD_HEAD] = handle_head,
+};
+
+static bool is_valid_method(const client_state *state)
+{
+    return METHOD_HANDLERS[state->exchange->request.method_id] != NULL;
+}
+
+// Whether every Content-Length header carries the same value as the first
+static bool content_lengths_agree(const client_state *state)
 {
-    char               *token;
-    struct split_string result = {0};
-    char               *temp_string;
-    char               *token_dup;
-    int                 tokens_count;
-    char               *save_ptr;
+    const http_request *request = &state->exchange->request;
+    const http_header  *first   = http_request_header(request, HTTP_HEADER_CONTENT_LENGTH);
 
-    if(delimiter == NULL || delimiter[0] == '\0' || string == NULL || string[0] == '\0')
+    for(size_t i = 0; i < request->num_headers; i++)
     {
-        result.strings = NULL;
-        return result;
+        const http_header *header = &request->headers[i];
+
+        if(header->id == HTTP_HEADER_CONTENT_LENGTH &&
+           (header->value.length != first->value.length || memcmp(state->request_buffer + header->value.offset, state->request_buffer + first->value.offset, first->value.length) != 0))
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    tokens_count = get_tokens_in_str(string, delimiter);
-    if(tokens_count <= 0)
+// Returns the status to answer with, HTTP_OK when the request can be dispatched
+static int validate_http_request(client_state *state)
+{
+    if(http_slice_equals(state->request_buffer, state->exchange->request.protocolVersion, "HTTP/1.1"))
     {
-        result.strings = NULL;
-        return result;
+        state->http_minor_version = 1;
+    }
+    else if(http_slice_equals(state->request_buffer, state->exchange->request.protocolVersion, "HTTP/1.0"))
+    {
+        state->http_minor_version = 0;
+    }
+    else
+    {
+        return HTTP_VERSION_NOT_SUPPORTED;
     }
 
-    result.count   = tokens_count;
-    result.strings = (char **)malloc(sizeof(char *) * result.count);
-    if(result.strings == NULL)
+    if(!is_valid_method(state))
     {
-        return result;
+        return HTTP_NOT_IMPLEMENTED;
     }
-    memset((void *)result.strings, 0, (sizeof(char *) * result.count));
 
-    temp_string = strdup(string);
-    if(temp_string == NULL)
+    if(state->exchange->request.path.length == 0 || state->request_buffer[state->exchange->request.path.offset] != '/')
     {
-        perror("Memory allocation failed when getting tokens in string\n");
-        free((void *)result.strings);
-        result.strings = NULL;
-        return result;
+        return HTTP_BAD_REQUEST;
     }
-    token = strtok_r(temp_string, delimiter, &save_ptr);
-    for(size_t i = 0; i < result.count; i++)
+
+    // an HTTP/1.1 request without Host, or any with more than one, must be rejected (RFC 9112 section 3.2)
+    if((state->http_minor_version == 1 && http_request_header(&state->exchange->request, HTTP_HEADER_HOST) == NULL) ||
+       http_request_header_repeated(&state->exchange->request, HTTP_HEADER_HOST))
     {
-        if(token == NULL)
-        {
-            // Somehow not enough tokens
-            fputs("str_split error: less tokens than expected\n", stderr);
-            free(temp_string);
-            free_split_string(&result);
-            result.strings = NULL;
-            return result;
-        }
-        token_dup = strdup(token);
-        if(token_dup == NULL)
-        {
-            perror("Memory allocation failed when splitting strings\n");
-            free(temp_string);
-            free_split_string(&result);
-            result.strings = NULL;
-            return result;
-        }
-        result.strings[i] = token_dup;
+        return HTTP_BAD_REQUEST;
+    }
 
-        token = strtok_r(NULL, delimiter, &save_ptr);
+    // Framing a proxy in front could read differently (RFC 9112 section 6.3).
+    // Whatever it took for the body would otherwise pass for the next request.
+    if(http_request_header(&state->exchange->request, HTTP_HEADER_CONTENT_LENGTH) != NULL &&
+       (http_request_header(&state->exchange->request, HTTP_HEADER_TRANSFER_ENCODING) != NULL || !content_lengths_agree(state)))
+    {
+        return HTTP_BAD_REQUEST;
     }
-    free(temp_string);
 
-    return result;
+    return HTTP_OK;
 }
 
-static int parse_http_request(const server_context *ctx, client_state *state)
+// HTTP/1.1 connections persist unless the client says close, HTTP/1.0 ones only
+// when it asks for keep-alive. Request bodies are never read, so a request that
+// carries one ends the connection rather than being mistaken for the next request.
+static bool wants_keep_alive(const client_state *state)
 {
-    struct split_string lines;
-    lines = str_split(state->request_buffer, "\r\n");
+    const http_header *connection     = http_request_header(&state->exchange->request, HTTP_HEADER_CONNECTION);
+    const http_header *content_length = http_request_header(&state->exchange->request, HTTP_HEADER_CONTENT_LENGTH);
 
-    if(lines.count < 1 || lines.strings == NULL)
+    if(exit_flag)
     {
-        free_split_string(&lines);
-        return -1;
+        return false;
     }
 
-    struct split_string mainParts = str_split(lines.strings[0], " ");
-    if(mainParts.count != 3 || mainParts.strings == NULL)
+    if(http_request_header(&state->exchange->request, HTTP_HEADER_TRANSFER_ENCODING) != NULL || (content_length != NULL && !http_slice_equals(state->request_buffer, content_length->value, "0")))
     {
-        free_split_string(&lines);
-        free_split_string(&mainParts);
-        return -1;
+        return false;
     }
 
-    state->request.method          = strdup(mainParts.strings[0]);
-    state->request.path            = strdup(mainParts.strings[1]);
-    state->request.protocolVersion = strdup(mainParts.strings[2]);
-
-    for(int line = 1; line < lines.count; line++)
+    if(state->http_minor_version == 1)
     {
-        // lines.strings[line] // New header
+        return connection == NULL || !http_header_has_token(state->request_buffer, connection, "close");
     }
+    return connection != NULL && http_header_has_token(state->request_buffer, connection, "keep-alive");
+}
 
-    free_split_string(&mainParts);
-    free_split_string(&lines);
-    return 0;
+static void dispatch_method(server_context *ctx, client_state *state)
+{
+    METHOD_HANDLERS[state->exchange->request.method_id](ctx, state);
 }
 
-static bool is_valid_method(const char *const str)
+// GET and HEAD on metrics_path, or anything the admin port is asked for
+static bool is_metrics_request(const server_context *ctx, const client_state *state)
 {
-    for(size_t i = 0; i < VALID_HTTP_METHODS_LENGTH; i++)
+    const char *url_path = state->request_buffer + state->exchange->request.path.offset;
+    const char *query    = memchr(url_path, '?', state->exchange->request.path.length);
+    size_t      url_path_length;
+
+    if(ctx->metrics == NULL || (state->exchange->request.method_id != HTTP_METHOD_GET && state->exchange->request.method_id != HTTP_METHOD_HEAD))
     {
-        if(strcmp(str, VALID_HTTP_METHODS[i]) != 0)
-        {
-            return true;
-        }
+        return false;
     }
-    return false;
+    if(state->admin)
+    {
+        return true;
+    }
+    if(ctx->metrics_path == NULL)
+    {
+        return false;
+    }
+
+    url_path_length = query == NULL ? state->exchange->request.path.length : (size_t)(query - url_path);
+    return url_path_length == strlen(ctx->metrics_path) && memcmp(url_path, ctx->metrics_path, url_path_length) == 0;
 }
 
-static int validate_http_request(const client_state *state)
+static void send_metrics_response(server_context *ctx, client_state *state);
+
+static void handle_request(server_context *ctx, client_state *state)
 {
-    if(strcmp(state->request.protocolVersion, "HTTP/1.0") != 0)
+    const int status = validate_http_request(state);
+
+    // a request that was not understood ends the connection after its error response
+    if(status != HTTP_OK)
     {
-        return -1;
+        send_error_response(state, status);
+        return;
     }
 
-    if(!is_valid_method(state->request.method))
+    state->exchange->response.keep_alive = wants_keep_alive(state);
+    if(is_metrics_request(ctx, state))
     {
-        return -1;
+        send_metrics_response(ctx, state);
+        return;
     }
-
-    return 0;
+    dispatch_method(ctx, state);
 }
 
-static void dispatch_method(const client_state *state)
+// The request path without its query string, which is what files are cached by
+static const char *request_url_path(const client_state *state, size_t *length)
 {
+    const char *url_path = state->request_buffer + state->exchange->request.path.offset;
+    const char *query    = memchr(url_path, '?', state->exchange->request.path.length);
+
+    *length = query == NULL ? state->exchange->request.path.length : (size_t)(query - url_path);
+    return url_path;
 }
 
-static void map_url_to_path(const server_context *ctx, client_state *state)
+// requested_path is set to the path before links are followed, the file cache watches both
+static void map_url_to_path(const server_context *ctx, client_state *state, char **requested_path)
 {
-    size_t root_directory_length;
-    size_t request_path_length;
-    size_t combined_length;
-    char  *combined_path;
-    char  *real_path;
-    bool   path_is_valid;
+    size_t      url_path_length;
+    const char *url_path = request_url_path(state, &url_path_length);
 
-    state->file_path      = NULL;
-    root_directory_length = strlen(ctx->root_directory);
-    request_path_length   = strlen(state->request.path);
-    combined_length       = root_directory_length + request_path_length;
+    state->file_path = path_map_resolve(&state->arena, ctx->root_directory, strlen(ctx->root_directory), url_path, url_path_length, requested_path);
+}
 
-    combined_path = malloc((sizeof(char) * combined_length) + 2);
-    if(combined_path == NULL)
+// Opens the mapped file, returns the status to answer with
+static int check_file(const client_state *state, int *fd, struct stat *st)
+{
+    *fd = open(state->file_path, O_RDONLY | O_CLOEXEC);
+    if(*fd == -1)
     {
-        return;
+        return errno == EACCES ? HTTP_FORBIDDEN : HTTP_NOT_FOUND;
     }
 
-    strncpy(combined_path, ctx->root_directory, root_directory_length);
-    combined_path[root_directory_length] = '/';
-    strncpy(combined_path + root_directory_length + 1, ctx->root_directory, request_path_length);
-
-    real_path = realpath(combined_path, NULL);
-    free(combined_path);
-    if(real_path == NULL)
+    if(fstat(*fd, st) == -1)
     {
-        return;
+        close(*fd);
+        return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    path_is_valid = strncmp(ctx->root_directory, real_path, root_directory_length) == 0;
-
-    if(path_is_valid)
+    if(!S_ISREG(st->st_mode))
     {
-        state->file_path = real_path;
+        close(*fd);
+        return HTTP_FORBIDDEN;
     }
+
+    return HTTP_OK;
+}
+
+// The body is never read into memory, it is sent straight from the fd
+static void read_file(client_state *state)
+{
+    state->exchange->response.file_offset    = 0;
+    state->exchange->response.file_remaining = state->exchange->response.file_size;
 }
 
-static void check_file()
+static void release_file(client_response *response)
 {
+    if(response->file_entry != NULL)
+    {
+        file_cache_release(response->file_entry);
+        response->file_entry = NULL;
+    }
+    response->file_fd = -1;
 }
 
-static void read_file(const server_context *ctx)
+// Drops whatever the response holds and leaves it empty for the next request,
+// its headers and log line go with the arena
+static void release_response(client_response *response)
 {
+    if(response->cached != NULL)
+    {
+        cached_response_release(response->cached);
+    }
+    release_file(response);
+
+    memset(response, 0, sizeof(*response));
+    response->file_fd = -1;
 }
 
-static void send_response_headers(const server_context *ctx)
+static const char *status_text(int status_code)
 {
+    switch(status_code)
+    {
+        case HTTP_OK:
+            return "OK";
+        case HTTP_PARTIAL_CONTENT:
+            return "Partial Content";
+        case HTTP_NOT_MODIFIED:
+            return "Not Modified";
+        case HTTP_BAD_REQUEST:
+            return "Bad Request";
+        case HTTP_FORBIDDEN:
+            return "Forbidden";
+        case HTTP_NOT_FOUND:
+            return "Not Found";
+        case HTTP_RANGE_NOT_SATISFIABLE:
+            return "Range Not Satisfiable";
+        case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:
+            return "Request Header Fields Too Large";
+        case HTTP_NOT_IMPLEMENTED:
+            return "Not Implemented";
+        case HTTP_VERSION_NOT_SUPPORTED:
+            return "HTTP Version Not Supported";
+        default:
+            return "Internal Server Error";
+    }
 }
 
-static void send_response_body(const server_context *ctx)
+static const char *content_type_for(const char *path)
 {
+    const char *extension = strrchr(path, '.');
+
+    if(extension == NULL || strchr(extension, '/') != NULL)
+    {
+        return DEFAULT_CONTENT_TYPE;
+    }
+
+    for(size_t i = 0; i < sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]); i++)
+    {
+        if(strcmp(extension + 1, CONTENT_TYPES[i].extension) == 0)
+        {
+            return CONTENT_TYPES[i].content_type;
+        }
+    }
+    return DEFAULT_CONTENT_TYPE;
 }
 
-static void send_error_response(const server_context *ctx)
+// Only types listed as text-like are worth compressing, everything else is already packed
+static bool is_compressible(const char *content_type)
 {
+    for(size_t i = 0; i < sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]); i++)
+    {
+        if(CONTENT_TYPES[i].content_type == content_type)
+        {
+            return CONTENT_TYPES[i].compressible;
+        }
+    }
+    return false;
 }
 
-static void set_status(const server_context *ctx)
+static void set_status(client_state *state, int status_code)
 {
+    state->exchange->response.status_code = status_code;
 }
 
-static void handle_get(const client_state *state)
+// The only response header that depends on the connection rather than on the file
+static const char *connection_header(const client_state *state)
 {
+    if(!state->exchange->response.keep_alive)
+    {
+        return "Connection: close\r\n";
+    }
+
+    // persistent is the default for HTTP/1.1 but has to be confirmed to HTTP/1.0 clients
+    return state->http_minor_version == 0 ? "Connection: keep-alive\r\n" : "";
 }
 
-static void handle_head(const client_state *state)
+// The Date header is formatted at most once a second per worker rather than once per response
+static _Thread_local time_t date_second = -1;
+static _Thread_local char   date_text[HTTP_DATE_CAPACITY];
+
+// Returns the second the cached date names
+static time_t refresh_date(void)
 {
+    const time_t now = time(NULL);
+
+    if(now != date_second && http_format_date(now, date_text) == 0)
+    {
+        date_second = now;
+    }
+    return date_second;
 }
 
-static void handle_post(const client_state *state)
+// The entity tag of the representation being served. A body gzipped on the fly
+// is a variant of its own, so it gets the file's tag with "-gz" inside the quotes.
+static void format_etag(const client_response *response, char *buffer, size_t capacity)
 {
+    const char *etag = response->file_entry->etag;
+
+    if(!response->gzip_etag)
+    {
+        snprintf(buffer, capacity, "%s", etag);
+        return;
+    }
+    snprintf(buffer, capacity, "%.*s-gz\"", (int)(strlen(etag) - 1), etag);
 }
 
-int main(const int argc, char **argv)
+// ETag and Last-Modified of the file being served, only for responses that
+// carry it or stand for it. Returns the length written, or -1 if it did not fit.
+static int format_validators(const client_response *response, char *buffer, size_t capacity)
 {
-    server_context ctx;
-    ctx      = init_context();
-    ctx.argc = argc;
-    ctx.argv = argv;
+    const file_cache_entry *entry = response->file_entry;
 
-    parse_arguments(&ctx);
-    validate_arguments(&ctx);
-    init_server_socket(&ctx);
-    init_poll_fds(&ctx);
-    event_loop(&ctx);
+    if(entry == NULL || (response->status_code != HTTP_OK && response->status_code != HTTP_PARTIAL_CONTENT && response->status_code != HTTP_NOT_MODIFIED))
+    {
+        buffer[0] = '\0';
+        return 0;
+    }
 
-    cleanup_server(&ctx);
+    char etag[FILE_CACHE_ETAG_CAPACITY + sizeof("-gz")];
+
+    format_etag(response, etag, sizeof(etag));
 
-    return EXIT_SUCCESS;
+    const int length = snprintf(buffer,
+                                capacity,
+                                "ETag: %s\r\n"
+                                "%s%s%s",
+                                etag,
+                                entry->last_modified[0] == '\0' ? "" : "Last-Modified: ",
+                                entry->last_modified,
+                                entry->last_modified[0] == '\0' ? "" : "\r\n");
+    return length < 0 || (size_t)length >= capacity ? -1 : length;
 }
 
-__attribute__((noreturn)) static void quit(const server_context *ctx)
+// Formats the status line and headers, extra_headers are complete lines and
+// extra_capacity leaves room for a body right after the headers. The encoding
+// headers of a negotiated body and the validators of a file are added on their own.
+static int prepare_response_headers(client_state *state, const char *content_type, off_t content_length, const char *extra_headers, size_t extra_capacity)
 {
-    if(ctx->exit_message != NULL)
+    int  length;
+    char validators[sizeof("ETag: \r\nLast-Modified: \r\n") + FILE_CACHE_ETAG_CAPACITY + sizeof("-gz") + HTTP_DATE_CAPACITY];
+
+    refresh_date();
+    if(format_validators(&state->exchange->response, validators, sizeof(validators)) == -1)
     {
-        fputs(ctx->exit_message, stderr);
+        return -1;
     }
-    exit(ctx->exit_code);
-}
 
-// Main for testing parse_http_request
-// int main()
-// {
-//     client_state state = {0};
-//
-//     // Different requests to test
-//     // const char *req = "GET    /weird   HTTP/1.0\r\nhOsT:example.com\r\nUser-Agent:TestAgent/0.1\r\nAccept: */*\r\n\r\n";
-//     // const char *req = "GET http://example.com/path/to/resource?x=1&y=2 HTTP/1.0\r\nUser-Agent: TestAgent/0.1\r\nAccept: text/html\r\n\r\n";
-//     const char *req      = "GET /index.html HTTP/1.0\r\nHost: example.com\r\nUser-Agent: TestAgent/0.1\r\nAccept: */*\r\n\r\n";
-//     state.request_buffer = strdup(req);
-//
-//     parse_http_request(NULL, &state);
-//     free(state.request_buffer);
-//
-//     printf("%s\n%s\n%s\n", state.request.method, state.request.path, state.request.protocolVersion);
-//
-//     free(state.request.method);
-//     free(state.request.path);
-//     free(state.request.protocolVersion);
-//
-//     return EXIT_SUCCESS;
-// }
+    state->exchange->response.headers = arena_alloc(&state->arena, RESPONSE_HEADERS_CAPACITY + extra_capacity);
+    if(state->exchange->response.headers == NULL)
+    {
+        return -1;
+    }
 
-// bad parse arguments I think
+    length = snprintf(state->exchange->response.headers,
+                      RESPONSE_HEADERS_CAPACITY,
+                      "HTTP/1.1 %d %s\r\n"
+                      "Server: %s\r\n"
+                      "Date: %s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %lld\r\n"
+                      "%s"
+                      "%s"
+                      "%s"
+                      "%s"
+                      "\r\n",
+                      state->exchange->response.status_code,
+                      status_text(state->exchange->response.status_code),
+                      SERVER_NAME,
+                      date_text,
+                      content_type,
+                      (long long)content_length,
+                      validators,
+                      state->exchange->response.encoding_headers == NULL ? "" : state->exchange->response.encoding_headers,
+                      extra_headers,
+                      connection_header(state));
+    if(length < 0 || length >= RESPONSE_HEADERS_CAPACITY)
+    {
+        state->exchange->response.headers = NULL;
+        return -1;
+    }
 
-// static void parse_arguments(server_context *ctx)
-// {
-//     int         opt;
-//     const char *optstring = "h:p:f:"; //lol the bug was no colon after f
-//     opterr                = 0;
+    state->exchange->response.data   = state->exchange->response.headers;
+    state->exchange->response.length = (size_t)length;
+    state->exchange->response.sent   = 0;
+    state->exchange->response.ready  = true;
+    return 0;
+}
 
-//     while((opt = getopt(ctx->argc, ctx->argv, optstring)) != -1)
-//     {
-//         switch(opt)
+// Points the connection at a shared, fully serialized response, the file is no longer needed
+static void attach_cached_response(client_state *state, cached_response *response, bool headers_only)
+{
+    release_file(&state->exchange->response);
+    set_status(state, HTTP_OK);
+    state->exchange->response.cached         = response;
+    state->exchange->response.data           = response->data;
+    state->exchange->response.length         = headers_only ? response->header_length : response->length;
+    state->exchange->response.sent           = 0;
+    state->exchange->response.file_remaining = 0;
+    state->exchange->response.ready          = true;
+}
+
+// Cached responses are the HTTP/1.1 keep-alive ones, without a Connection header
+static bool use_cached_response(server_context *ctx, client_state *state, bool headers_only)
+{
+    cached_response *response;
+
+    if(connection_header(state)[0] != '\0')
+    {
+        return false;
+    }
+
+    response = file_cache_lookup_response(&ctx->file_cache, state->exchange->response.file_entry, refresh_date(), date_text);
+
+    // the cache counts only the files it could keep, its totals are copied as they are
+    if(ctx->metrics_shard != NULL)
+    {
+        metrics_set(&ctx->metrics_shard->response_cache_hits, ctx->file_cache.response_hits);
+        metrics_set(&ctx->metrics_shard->response_cache_misses, ctx->file_cache.response_misses);
+    }
+    if(response == NULL)
+    {
+        return false;
+    }
+    attach_cached_response(state, response, headers_only);
+    return true;
+}
+
+// Keeps small files fully serialized so the next hit is a single send()
+static void cache_response(server_context *ctx, client_state *state)
+{
+    cached_response *response;
+
+    if(connection_header(state)[0] != '\0')
+    {
+        return;
+    }
+
+    // stamped with the second its headers were formatted in, not a fresh one
+    response = file_cache_store_response(&ctx->file_cache, state->exchange->response.file_entry, state->exchange->response.headers, state->exchange->response.length, date_second);
+    if(response == NULL)
+    {
+        return;
+    }
+    state->exchange->response.headers = NULL;
+    attach_cached_response(state, response, false);
+}
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * US_PER_SECOND) + ((uint64_t)now.tv_nsec / NS_PER_US);
+}
+
+// Writes the access log line up to the status code while the request is still
+// in the buffer. The byte count and latency follow once the response is sent.
+// Everything the client sent is escaped, so a '"' or a newline cannot forge fields.
+static void start_access_log(const server_context *ctx, client_state *state)
+{
+    const char         *buffer  = state->request_buffer;
+    const http_request *request = &state->exchange->request;
+    char                line[ACCESS_LOG_LINE_CAPACITY];
+    char                host[NI_MAXHOST];
+    char                service[NI_MAXSERV];
+    char                request_line[ACCESS_LOG_FIELD_CAPACITY];
+    int                 prefix_length;
+    int                 suffix_length = 0;
+
+    if(ctx->log_level < LOG_LEVEL_ACCESS)
+    {
+        return;
+    }
+
+    if(format_peer_address(state, host, service) != 0)
+    {
+        snprintf(host, sizeof(host), "-");
+    }
+
+    if(request->protocolVersion.length == 0)
+    {
+        // rejected before the request line was complete
+        snprintf(request_line, sizeof(request_line), "-");
+    }
+    else
+    {
+        // the slices are separated by a single space in the buffer, escaped one after another
+        size_t length = access_log_escape(request_line, sizeof(request_line), buffer + request->method.offset, request->method.length);
+
+        if(length + 1 < sizeof(request_line))
+        {
+            request_line[length++] = ' ';
+            length += access_log_escape(request_line + length, sizeof(request_line) - length, buffer + request->path.offset, request->path.length);
+        }
+        if(length + 1 < sizeof(request_line))
+        {
+            request_line[length++] = ' ';
+            access_log_escape(request_line + length, sizeof(request_line) - length, buffer + request->protocolVersion.offset, request->protocolVersion.length);
+        }
+    }
+    prefix_length = snprintf(line, sizeof(line), "%s - - [%s] \"%s\" %d", host, log_ring_date(ctx->log_ring), request_line, state->exchange->response.status_code);
+    if(prefix_length < 0 || (size_t)prefix_length >= sizeof(line))
+    {
+        return;
+    }
+
+    if(ctx->log_format == LOG_FORMAT_COMBINED)
+    {
+        const http_header *referer    = http_request_header(request, HTTP_HEADER_REFERER);
+        const http_header *user_agent = http_request_header(request, HTTP_HEADER_USER_AGENT);
+        const size_t       available  = sizeof(line) - (size_t)prefix_length - 1;
+        char               escaped_referer[ACCESS_LOG_FIELD_CAPACITY];
+        char               escaped_user_agent[ACCESS_LOG_FIELD_CAPACITY];
+
+        access_log_escape(escaped_referer, sizeof(escaped_referer), referer == NULL ? "-" : buffer + referer->value.offset, referer == NULL ? 1 : referer->value.length);
+        access_log_escape(escaped_user_agent, sizeof(escaped_user_agent), user_agent == NULL ? "-" : buffer + user_agent->value.offset, user_agent == NULL ? 1 : user_agent->value.length);
+        suffix_length = snprintf(line + prefix_length + 1, available, " \"%s\" \"%s\"", escaped_referer, escaped_user_agent);
+        if(suffix_length < 0)
+        {
+            suffix_length = 0;
+        }
+        else if((size_t)suffix_length >= available)
+        {
+            suffix_length = (int)available - 1;
+        }
+    }
+    line[prefix_length]                     = '\0';
+    line[prefix_length + 1 + suffix_length] = '\0';
+
+    state->exchange->response.log_line = arena_alloc(&state->arena, (size_t)prefix_length + (size_t)suffix_length + 2);
+    if(state->exchange->response.log_line == NULL)
+    {
+        return;
+    }
+    memcpy(state->exchange->response.log_line, line, (size_t)prefix_length + (size_t)suffix_length + 2);
+    state->exchange->response.log_prefix_length = (uint32_t)prefix_length;
+}
+
+// Records the response in the metrics and queues its log line for the writer
+// thread, also for responses cut short by a closing connection
+static void finish_response(const server_context *ctx, client_response *response)
+{
+    uint64_t latency_us;
+
+    if(response->started_us == 0)
+    {
+        return;
+    }
+    latency_us           = monotonic_us() - response->started_us;
+    response->started_us = 0;
+
+    if(ctx->metrics_shard != NULL)
+    {
+        metrics_record_response(ctx->metrics_shard, response->status_code, response->bytes_sent, latency_us);
+    }
+
+    if(response->log_line != NULL)
+    {
+        log_ring_printf(ctx->log_ring,
+                        "%s %llu%s %llu\n",
+                        response->log_line,
+                        (unsigned long long)response->bytes_sent,
+                        response->log_line + response->log_prefix_length + 1,
+                        (unsigned long long)latency_us);
+        response->log_line = NULL;
+    }
+}
+
+static client_response *queued_response(client_state *state, size_t index)
+{
+    return &state->exchange->queued_responses[(state->exchange->queue_head + index) % MAX_QUEUED_RESPONSES];
+}
+
+// The headers and in-memory body, including the part delimiters and a shared
+// cached or compressed body, which stays alive while it is referenced
+static size_t response_memory(const client_response *response)
+{
+    size_t bytes = response->length;
+
+    for(size_t i = 0; i < response->num_parts; i++)
+    {
+        bytes += response->parts[i].header_length;
+    }
+    return bytes;
+}
+
+// Moves the response just put together to the back of the send queue
+static void queue_response(client_state *state)
+{
+    state->exchange->response.queued_bytes = response_memory(&state->exchange->response);
+    state->exchange->queued_bytes += state->exchange->response.queued_bytes;
+    atomic_fetch_add_explicit(&total_queued_bytes, state->exchange->response.queued_bytes, memory_order_relaxed);
+
+    *queued_response(state, state->exchange->queue_length) = state->exchange->response;
+    state->exchange->queue_length++;
+    if(!state->exchange->response.keep_alive)
+    {
+        state->closing = true;
+    }
+
+    memset(&state->exchange->response, 0, sizeof(state->exchange->response));
+    state->exchange->response.file_fd = -1;
+}
+
+// The last response out takes everything its requests allocated with it, no
+// request is half handled between read_requests and flush_responses
+static void dequeue_response(client_state *state)
+{
+    state->exchange->queued_bytes -= queued_response(state, 0)->queued_bytes;
+    atomic_fetch_sub_explicit(&total_queued_bytes, queued_response(state, 0)->queued_bytes, memory_order_relaxed);
+    release_response(queued_response(state, 0));
+    state->exchange->queue_head = (state->exchange->queue_head + 1) % MAX_QUEUED_RESPONSES;
+    state->exchange->queue_length--;
+    if(state->exchange->queue_length == 0)
+    {
+        arena_reset(&state->arena);
+    }
+}
+
+// Sends the in-memory part (headers, small bodies, cached responses) of every
+// queued response with one sendmsg. A file body has to go out before anything
+// queued behind it, so the batch stops at the first response that has one.
+static int send_queued_headers(const server_context *ctx, client_state *state)
+{
+    while(state->exchange->queue_length > 0 && queued_response(state, 0)->sent < queued_response(state, 0)->length)
+    {
+        struct iovec  iov[MAX_QUEUED_RESPONSES];
+        struct msghdr message      = {0};
+        size_t        iov_count    = 0;
+        bool          body_follows = false;
+        ssize_t       result;
+        size_t        written;
+
+        while(iov_count < state->exchange->queue_length && !body_follows)
+        {
+            const client_response *response = queued_response(state, iov_count);
+
+            iov[iov_count].iov_base = (void *)(response->data + response->sent);
+            iov[iov_count].iov_len  = response->length - response->sent;
+            body_follows            = response->file_remaining > 0 || response->next_part < response->num_parts;
+            iov_count++;
+        }
+        message.msg_iov    = iov;
+        message.msg_iovlen = iov_count;
+
+        // MSG_MORE holds the headers back so they leave in the same segment as the start of the body
+        result = sendmsg(state->socket, &message, MSG_NOSIGNAL | (body_follows ? MSG_MORE : 0));
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SEND_BLOCKED : SEND_FAILED;
+        }
+
+        // what went out finishes the responses at the front in order
+        written = (size_t)result;
+        while(written > 0)
+        {
+            client_response *response = queued_response(state, 0);
+            const size_t     unsent   = response->length - response->sent;
+            const size_t     taken    = written < unsent ? written : unsent;
+
+            response->sent += taken;
+            response->bytes_sent += taken;
+            written -= taken;
+            if(response->sent == response->length && response->file_remaining == 0 && response->next_part == response->num_parts)
+            {
+                finish_response(ctx, response);
+                dequeue_response(state);
+            }
+        }
+    }
+    return SEND_COMPLETE;
+}
+
+// Zero-copy where the platform allows it, a bounce buffer elsewhere
+static ssize_t send_file_chunk(int socket, int file_fd, off_t *offset, size_t count)
+{
+#ifdef __linux__
+    return sendfile(socket, file_fd, offset, count);
+#else
+    char    buffer[SENDFILE_FALLBACK_BUFFER_SIZE];
+    ssize_t read_bytes;
+    ssize_t sent_bytes;
+
+    if(count > sizeof(buffer))
+    {
+        count = sizeof(buffer);
+    }
+
+    read_bytes = pread(file_fd, buffer, count, *offset);
+    if(read_bytes <= 0)
+    {
+        return read_bytes;
+    }
+
+    sent_bytes = send(socket, buffer, (size_t)read_bytes, MSG_NOSIGNAL);
+    if(sent_bytes > 0)
+    {
+        *offset += sent_bytes;
+    }
+    return sent_bytes;
+#endif
+}
+
+static int send_response_body(int socket, client_response *response)
+{
+    size_t budget = SENDFILE_CHUNK_SIZE;
+
+    while(response->file_remaining > 0)
+    {
+        size_t  count;
+        ssize_t result;
+
+        // a fast reader of a huge file must not keep the other connections waiting
+        if(budget == 0)
+        {
+            return SEND_BLOCKED;
+        }
+
+        count  = (uintmax_t)response->file_remaining < budget ? (size_t)response->file_remaining : budget;
+        result = send_file_chunk(socket, response->file_fd, &response->file_offset, count);
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SEND_BLOCKED : SEND_FAILED;
+        }
+        if(result == 0)
+        {
+            // the file shrank under us, the promised Content-Length can no longer be met
+            return SEND_FAILED;
+        }
+        response->file_remaining -= result;
+        response->bytes_sent += (uint64_t)result;
+        budget -= (size_t)result;
+    }
+    return SEND_COMPLETE;
+}
+
+// Moves a multipart/byteranges or compressed response on to its next part, false once every part is sent
+static bool next_response_part(client_response *response)
+{
+    const response_part *part;
+
+    if(response->next_part == response->num_parts)
+    {
+        return false;
+    }
+
+    part                     = &response->parts[response->next_part++];
+    response->data           = part->header;
+    response->length         = part->header_length;
+    response->sent           = 0;
+    response->file_offset    = part->file_offset;
+    response->file_remaining = part->file_length;
+    return true;
+}
+
+// Sends queued responses in order until the queue is empty or the socket is full
+static int flush_responses(const server_context *ctx, client_state *state)
+{
+    while(state->exchange->queue_length > 0)
+    {
+        int result = send_queued_headers(ctx, state);
+
+        if(result != SEND_COMPLETE || state->exchange->queue_length == 0)
+        {
+            return result;
+        }
+
+        // only the head is left half sent, with its file body still to go
+        result = send_response_body(state->socket, queued_response(state, 0));
+        if(result != SEND_COMPLETE)
+        {
+            return result;
+        }
+        if(next_response_part(queued_response(state, 0)))
+        {
+            continue;
+        }
+        finish_response(ctx, queued_response(state, 0));
+        dequeue_response(state);
+    }
+    return SEND_COMPLETE;
+}
+
+// A short text body naming the status, extra_headers are complete lines
+static void send_status_response(client_state *state, int status_code, const char *extra_headers)
+{
+    char body[ERROR_BODY_CAPACITY];
+    int  body_length;
+
+    // the short body is never compressed
+    set_status(state, status_code);
+    state->exchange->response.encoding_headers = NULL;
+    body_length = snprintf(body, sizeof(body), "%d %s\n", status_code, status_text(status_code));
+    if(body_length < 0 || (size_t)body_length >= sizeof(body) || prepare_response_headers(state, "text/plain", body_length, extra_headers, (size_t)body_length) == -1)
+    {
+        // without a response to send serve_client drops the connection
+        return;
+    }
+
+    // the body goes right behind the headers so the whole response is a single send
+    memcpy(state->exchange->response.headers + state->exchange->response.length, body, (size_t)body_length);
+    state->exchange->response.length += (size_t)body_length;
+}
+
+static void send_error_response(client_state *state, int status_code)
+{
+    send_status_response(state, status_code, "");
+}
+
+// Sums every worker's shard, so any worker answers for the whole server
+static void send_metrics_response(server_context *ctx, client_state *state)
+{
+    const bool headers_only = state->exchange->request.method_id == HTTP_METHOD_HEAD;
+    size_t     body_length;
+    char      *body;
+
+    body = metrics_render(ctx->metrics, &body_length);
+    if(body == NULL)
+    {
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    set_status(state, HTTP_OK);
+    if(prepare_response_headers(state, METRICS_CONTENT_TYPE, (off_t)body_length, "", headers_only ? 0 : body_length) == -1)
+    {
+        free(body);
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    if(!headers_only)
+    {
+        memcpy(state->exchange->response.headers + state->exchange->response.length, body, body_length);
+        state->exchange->response.length += body_length;
+    }
+    free(body);
+}
+
+// A cache hit goes straight to the open fd, a miss resolves, opens and caches the file
+static int open_requested_file(server_context *ctx, client_state *state)
+{
+    size_t       url_path_length;
+    const char  *url_path = request_url_path(state, &url_path_length);
+    char        *requested_path;
+    struct stat  st;
+    int          fd;
+    int          status;
+
+    state->exchange->response.file_entry = file_cache_lookup(&ctx->file_cache, url_path, url_path_length);
+    if(ctx->metrics_shard != NULL && ctx->file_cache.max_entries > 0)
+    {
+        metrics_add(state->exchange->response.file_entry != NULL ? &ctx->metrics_shard->file_cache_hits : &ctx->metrics_shard->file_cache_misses, 1);
+    }
+    if(state->exchange->response.file_entry == NULL)
+    {
+        map_url_to_path(ctx, state, &requested_path);
+        if(state->file_path == NULL)
+        {
+            return HTTP_NOT_FOUND;
+        }
+
+        status = check_file(state, &fd, &st);
+        if(status != HTTP_OK)
+        {
+            return status;
+        }
+
+        // the cache owns the fd from here on and keeps its own copy of the path
+        state->exchange->response.file_entry = file_cache_insert(&ctx->file_cache, url_path, url_path_length, requested_path, state->file_path, fd, &st, content_type_for(state->file_path));
+        state->file_path  = NULL;
+        if(state->exchange->response.file_entry == NULL)
+        {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    state->exchange->response.file_fd   = state->exchange->response.file_entry->fd;
+    state->exchange->response.file_size = state->exchange->response.file_entry->size;
+    return HTTP_OK;
+}
+
+// Opens name.br or name.gz next to the file. It is cached like any file, under
+// the request path with the extension after a space, which no request path holds.
+static file_cache_entry *open_sibling(server_context *ctx, client_state *state, size_t encoding)
+{
+    const char       *extension        = PRECOMPRESSED_ENCODINGS[encoding].extension;
+    const size_t      extension_length = strlen(extension);
+    const unsigned    missing_bit      = 1U << encoding;
+    file_cache_entry *entry            = state->exchange->response.file_entry;
+    file_cache_entry *sibling;
+    size_t            url_path_length;
+    const char       *url_path = request_url_path(state, &url_path_length);
+    size_t            path_length;
+    size_t            requested_path_length;
+    char             *key;
+    char             *path;
+    char             *requested_path;
+    struct stat       st;
+    int               fd;
+
+    if((entry->missing_siblings & missing_bit) != 0)
+    {
+        return NULL;
+    }
+
+    key = arena_alloc(&state->arena, url_path_length + 1 + extension_length);
+    if(key == NULL)
+    {
+        return NULL;
+    }
+    memcpy(key, url_path, url_path_length);
+    key[url_path_length] = ' ';
+    memcpy(key + url_path_length + 1, extension, extension_length);
+
+    sibling = file_cache_lookup(&ctx->file_cache, key, url_path_length + 1 + extension_length);
+    if(sibling != NULL)
+    {
+        return sibling;
+    }
+
+    path_length           = strlen(entry->resolved_path);
+    requested_path_length = strlen(entry->requested_path);
+    path                  = arena_alloc(&state->arena, path_length + extension_length + 1);
+    requested_path        = arena_alloc(&state->arena, requested_path_length + extension_length + 1);
+    if(path == NULL || requested_path == NULL)
+    {
+        return NULL;
+    }
+    memcpy(path, entry->resolved_path, path_length);
+    memcpy(path + path_length, extension, extension_length + 1);
+    memcpy(requested_path, entry->requested_path, requested_path_length);
+    memcpy(requested_path + requested_path_length, extension, extension_length + 1);
+
+    // the sibling was not resolved against the root, so a link is never followed out of it
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if(fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    if(fd == -1)
+    {
+        // remembered until the file cache sees a file of that name appear
+        entry->missing_siblings |= missing_bit;
+        return NULL;
+    }
+    return file_cache_insert(&ctx->file_cache, key, url_path_length + 1 + extension_length, requested_path, path, fd, &st, entry->content_type);
+}
+
+// Picks what to send for a text file the client takes compressed: a .br or .gz
+// file next to it, else a gzip body compressed on the fly once the pool has it
+// ready, else the file itself. Every choice carries Vary for caches in between.
+// Returns true when the response is to be the compressed body, left in cached.
+static bool negotiate_encoding(server_context *ctx, client_state *state)
+{
+    client_response   *response = &state->exchange->response;
+    const http_header *accept   = http_request_header(&state->exchange->request, HTTP_HEADER_ACCEPT_ENCODING);
+
+    if(!is_compressible(response->file_entry->content_type))
+    {
+        return false;
+    }
+    response->encoding_headers = VARY_HEADER;
+    if(accept == NULL)
+    {
+        return false;
+    }
+
+    for(size_t i = 0; i < sizeof(PRECOMPRESSED_ENCODINGS) / sizeof(PRECOMPRESSED_ENCODINGS[0]); i++)
+    {
+        file_cache_entry *sibling;
+
+        if(!http_header_accepts(state->request_buffer, accept, PRECOMPRESSED_ENCODINGS[i].token))
+        {
+            continue;
+        }
+        sibling = open_sibling(ctx, state, i);
+        if(sibling != NULL)
+        {
+            release_file(response);
+            response->file_entry       = sibling;
+            response->file_fd          = sibling->fd;
+            response->file_size        = sibling->size;
+            response->encoding_headers = PRECOMPRESSED_ENCODINGS[i].headers;
+            return false;
+        }
+    }
+
+    // ranges of a body compressed on the fly are not offered, they come from the file itself
+    if(http_request_header(&state->exchange->request, HTTP_HEADER_RANGE) != NULL || !http_header_accepts(state->request_buffer, accept, "gzip"))
+    {
+        return false;
+    }
+    response->cached = compressor_lookup(&ctx->compressor, response->file_entry->resolved_path, &response->file_entry->mtime, response->file_size);
+    if(ctx->metrics_shard != NULL && ctx->compressor.num_threads > 0)
+    {
+        metrics_set(&ctx->metrics_shard->compression_cache_hits, ctx->compressor.hits);
+        metrics_set(&ctx->metrics_shard->compression_cache_misses, ctx->compressor.misses);
+    }
+    if(response->cached == NULL)
+    {
+        return false;
+    }
+    response->encoding_headers = GZIP_ENCODING_HEADERS;
+    response->gzip_etag        = true;
+    return true;
+}
+
+// The headers go out first, then the shared gzip body as the one part after them
+static void send_compressed_response(client_state *state, bool headers_only)
+{
+    client_response *response = &state->exchange->response;
+
+    set_status(state, HTTP_OK);
+    if(prepare_response_headers(state, response->file_entry->content_type, (off_t)response->cached->length, "", 0) == -1)
+    {
+        release_file(response);
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    release_file(response);
+    if(headers_only)
+    {
+        return;
+    }
+
+    response->parts = arena_alloc(&state->arena, sizeof(response_part));
+    if(response->parts == NULL)
+    {
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    response->parts[0].header        = response->cached->data;
+    response->parts[0].header_length = response->cached->length;
+    response->parts[0].file_offset   = 0;
+    response->parts[0].file_length   = 0;
+    response->num_parts              = 1;
+    response->next_part              = 0;
+}
+
+// If-Range makes the Range conditional on the file still being the one the
+// client has part of, as told by its entity tag or modification time
+static bool if_range_matches(const client_state *state)
+{
+    const http_header      *if_range = http_request_header(&state->exchange->request, HTTP_HEADER_IF_RANGE);
+    const file_cache_entry *entry    = state->exchange->response.file_entry;
+    time_t                  date;
+
+    if(if_range == NULL)
+    {
+        return true;
+    }
+
+    // strong comparison, so a weak tag (W/"...") never matches
+    if(state->request_buffer[if_range->value.offset] == '"')
+    {
+        return http_slice_equals(state->request_buffer, if_range->value, entry->etag);
+    }
+    return http_parse_date(state->request_buffer + if_range->value.offset, if_range->value.length, &date) == 0 && date == entry->mtime.tv_sec;
+}
+
+// One part per range, each a delimiter and part headers followed by the range
+// itself. Only the part headers live in memory, the ranges go out with sendfile.
+static int prepare_multipart_response(client_state *state, const http_byte_range *ranges, size_t num_ranges)
+{
+    client_response *response       = &state->exchange->response;
+    char            *first_header   = NULL;
+    size_t           first_length   = 0;
+    off_t            content_length = 0;
+    char             boundary[sizeof("0123456789abcdef")];
+    char             content_type[sizeof("multipart/byteranges; boundary=") + sizeof(boundary)];
+
+    // the parts after the first, then the closing delimiter
+    response->parts = arena_alloc(&state->arena, num_ranges * sizeof(response_part));
+    if(response->parts == NULL)
+    {
+        return -1;
+    }
+    snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)(monotonic_us() ^ response->file_entry->hash));
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+
+    for(size_t i = 0; i <= num_ranges; i++)
+    {
+        char *header = arena_alloc(&state->arena, PART_HEADER_CAPACITY);
+        int   length;
+
+        if(header == NULL)
+        {
+            return -1;
+        }
+        if(i == num_ranges)
+        {
+            length = snprintf(header, PART_HEADER_CAPACITY, "\r\n--%s--\r\n", boundary);
+        }
+        else
+        {
+            length = snprintf(header,
+                              PART_HEADER_CAPACITY,
+                              "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %llu-%llu/%lld\r\n\r\n",
+                              i == 0 ? "" : "\r\n",
+                              boundary,
+                              response->file_entry->content_type,
+                              (unsigned long long)ranges[i].first,
+                              (unsigned long long)(ranges[i].first + ranges[i].length - 1),
+                              (long long)response->file_size);
+        }
+        if(length < 0 || length >= PART_HEADER_CAPACITY)
+        {
+            return -1;
+        }
+
+        content_length += length;
+        if(i == 0)
+        {
+            first_header = header;
+            first_length = (size_t)length;
+            continue;
+        }
+        response->parts[i - 1].header        = header;
+        response->parts[i - 1].header_length = (size_t)length;
+        response->parts[i - 1].file_offset   = i == num_ranges ? 0 : (off_t)ranges[i].first;
+        response->parts[i - 1].file_length   = i == num_ranges ? 0 : (off_t)ranges[i].length;
+    }
+    for(size_t i = 0; i < num_ranges; i++)
+    {
+        content_length += (off_t)ranges[i].length;
+    }
+
+    // the first part's headers go right behind the response headers
+    if(prepare_response_headers(state, content_type, content_length, ACCEPT_RANGES_HEADER, first_length) == -1)
+    {
+        return -1;
+    }
+    memcpy(response->headers + response->length, first_header, first_length);
+    response->length += first_length;
+    response->num_parts      = (uint32_t)num_ranges;
+    response->next_part      = 0;
+    response->file_offset    = (off_t)ranges[0].first;
+    response->file_remaining = (off_t)ranges[0].length;
+    return 0;
+}
+
+// Answers a Range request with 206 or 416. Returns false when the whole file
+// should be sent instead: no Range, a failed If-Range, or a Range that is ignored.
+static bool send_range_response(client_state *state)
+{
+    const http_header *range    = http_request_header(&state->exchange->request, HTTP_HEADER_RANGE);
+    client_response   *response = &state->exchange->response;
+    http_byte_range    ranges[MAX_BYTE_RANGES];
+    char               extra_headers[RANGE_HEADERS_CAPACITY];
+    int                num_ranges;
+
+    if(range == NULL || !if_range_matches(state))
+    {
+        return false;
+    }
+
+    num_ranges = http_parse_range(state->request_buffer + range->value.offset, range->value.length, (uint64_t)response->file_size, ranges, MAX_BYTE_RANGES);
+    if(num_ranges == -1)
+    {
+        return false;
+    }
+
+    if(num_ranges == 0)
+    {
+        release_file(response);
+        snprintf(extra_headers, sizeof(extra_headers), ACCEPT_RANGES_HEADER "Content-Range: bytes */%lld\r\n", (long long)response->file_size);
+        send_status_response(state, HTTP_RANGE_NOT_SATISFIABLE, extra_headers);
+        return true;
+    }
+
+    set_status(state, HTTP_PARTIAL_CONTENT);
+    if(num_ranges == 1)
+    {
+        snprintf(extra_headers,
+                 sizeof(extra_headers),
+                 ACCEPT_RANGES_HEADER "Content-Range: bytes %llu-%llu/%lld\r\n",
+                 (unsigned long long)ranges[0].first,
+                 (unsigned long long)(ranges[0].first + ranges[0].length - 1),
+                 (long long)response->file_size);
+        if(prepare_response_headers(state, response->file_entry->content_type, (off_t)ranges[0].length, extra_headers, 0) == -1)
+        {
+            send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+            return true;
+        }
+
+        // sendfile starts at the offset, nothing before it is read
+        response->file_offset    = (off_t)ranges[0].first;
+        response->file_remaining = (off_t)ranges[0].length;
+        return true;
+    }
+
+    if(prepare_multipart_response(state, ranges, (size_t)num_ranges) == -1)
+    {
+        response->parts     = NULL;
+        response->num_parts = 0;
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+    }
+    return true;
+}
+
+// If-None-Match decides on its own when it is present, If-Modified-Since only
+// otherwise. Both are answered from the entry's stat data, the file is never read.
+static bool is_not_modified(const client_state *state)
+{
+    const client_response *response      = &state->exchange->response;
+    const http_header     *if_none_match = http_request_header(&state->exchange->request, HTTP_HEADER_IF_NONE_MATCH);
+    const http_header     *if_modified   = http_request_header(&state->exchange->request, HTTP_HEADER_IF_MODIFIED_SINCE);
+    time_t                 date;
+    char                   etag[FILE_CACHE_ETAG_CAPACITY + sizeof("-gz")];
+
+    if(if_none_match != NULL)
+    {
+        format_etag(response, etag, sizeof(etag));
+        return http_header_matches_etag(state->request_buffer, if_none_match, etag);
+    }
+    return if_modified != NULL && http_parse_date(state->request_buffer + if_modified->value.offset, if_modified->value.length, &date) == 0 && response->file_entry->mtime.tv_sec <= date;
+}
+
+// Answers a revalidation with 304 and the validators, no body and no Content-Length.
+// Returns false when the request is not conditional or the file has changed.
+static bool send_not_modified(client_state *state)
+{
+    client_response *response = &state->exchange->response;
+    char             validators[sizeof("ETag: \r\nLast-Modified: \r\n") + FILE_CACHE_ETAG_CAPACITY + sizeof("-gz") + HTTP_DATE_CAPACITY];
+    int              length;
+
+    if(!is_not_modified(state))
+    {
+        return false;
+    }
+
+    // a gzip body negotiated for a 200 is not sent
+    if(response->cached != NULL)
+    {
+        cached_response_release(response->cached);
+        response->cached = NULL;
+    }
+    set_status(state, HTTP_NOT_MODIFIED);
+    refresh_date();
+    response->headers = arena_alloc(&state->arena, RESPONSE_HEADERS_CAPACITY);
+    length            = -1;
+    if(response->headers != NULL && format_validators(response, validators, sizeof(validators)) != -1)
+    {
+        // Vary still applies, Content-Encoding belongs to the body left out
+        length = snprintf(response->headers,
+                          RESPONSE_HEADERS_CAPACITY,
+                          "HTTP/1.1 %d %s\r\n"
+                          "Server: %s\r\n"
+                          "Date: %s\r\n"
+                          "%s"
+                          "%s"
+                          "%s"
+                          "\r\n",
+                          HTTP_NOT_MODIFIED,
+                          status_text(HTTP_NOT_MODIFIED),
+                          SERVER_NAME,
+                          date_text,
+                          validators,
+                          response->encoding_headers == NULL ? "" : VARY_HEADER,
+                          connection_header(state));
+    }
+    release_file(response);
+    if(length < 0 || length >= RESPONSE_HEADERS_CAPACITY)
+    {
+        response->headers = NULL;
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return true;
+    }
+
+    response->data   = response->headers;
+    response->length = (size_t)length;
+    response->sent   = 0;
+    response->ready  = true;
+    return true;
+}
+
+static void handle_get(server_context *ctx, client_state *state)
+{
+    const int status = open_requested_file(ctx, state);
+
+    if(status != HTTP_OK)
+    {
+        send_error_response(state, status);
+        return;
+    }
+
+    const bool compressed = negotiate_encoding(ctx, state);
+
+    if(send_not_modified(state))
+    {
+        return;
+    }
+    if(compressed)
+    {
+        send_compressed_response(state, false);
+        return;
+    }
+    if(send_range_response(state) || use_cached_response(ctx, state, false))
+    {
+        return;
+    }
+
+    read_file(state);
+    set_status(state, HTTP_OK);
+    if(prepare_response_headers(state, state->exchange->response.file_entry->content_type, state->exchange->response.file_size, ACCEPT_RANGES_HEADER, 0) == -1)
+    {
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    cache_response(ctx, state);
+}
+
+static void handle_head(server_context *ctx, client_state *state)
+{
+    const int status = open_requested_file(ctx, state);
+
+    if(status != HTTP_OK)
+    {
+        send_error_response(state, status);
+        return;
+    }
+
+    const bool compressed = negotiate_encoding(ctx, state);
+
+    if(send_not_modified(state))
+    {
+        return;
+    }
+    if(compressed)
+    {
+        send_compressed_response(state, true);
+        return;
+    }
+    if(use_cached_response(ctx, state, true))
+    {
+        return;
+    }
+
+    set_status(state, HTTP_OK);
+    const int headers_result = prepare_response_headers(state, state->exchange->response.file_entry->content_type, state->exchange->response.file_size, ACCEPT_RANGES_HEADER, 0);
+
+    // same headers as GET, but the file itself is never sent
+    release_file(&state->exchange->response);
+    if(headers_result == -1)
+    {
+        send_error_response(state, HTTP_INTERNAL_SERVER_ERROR);
+    }
+}
+
+int main(const int argc, char **argv)
+{
+    server_context ctx;
+    access_log       log;
+    metrics_registry metrics;
+    ctx      = init_context();
+    ctx.argc = argc;
+    ctx.argv = argv;
+
+    parse_arguments(&ctx);
+    validate_arguments(&ctx);
+    setup_signal_handler();
+
+    // before any worker starts, the kernels are shared by all of them
+    http_scan_init();
+    printf("Scanning requests with the %s kernels\n", http_scan->name);
+    printf("Idle connections hold %zu bytes each, buffers are pooled while a request is in flight\n", sizeof(client_state));
+
+    init_access_log(&ctx, &log);
+    init_metrics(&ctx, &metrics);
+
+    if(ctx.num_threads > 1)
+    {
+        run_workers(&ctx);
+        cleanup_access_log(&ctx);
+        cleanup_metrics(&ctx);
+        cleanup_buffer_pool();
+        return ctx.exit_code;
+    }
+
+    init_server_socket(&ctx);
+    init_admin_socket(&ctx);
+    init_event_backend(&ctx);
+    init_file_cache(&ctx);
+    init_resolver(&ctx);
+    init_compressor(&ctx);
+    event_loop(&ctx);
+
+    cleanup_server(&ctx);
+    cleanup_access_log(&ctx);
+    cleanup_metrics(&ctx);
+    cleanup_buffer_pool();
+
+    return ctx.exit_code;
+}
+
+__attribute__((noreturn)) static void quit(const server_context *ctx)
+{
+    if(ctx->exit_message != NULL)
+    {
+        fputs(ctx->exit_message, stderr);
+    }
+    exit(ctx->exit_code);
+}
+
+// bad parse arguments I think
+
+// static void parse_arguments(server_context *ctx)
+// {
+//     int         opt;
+//     const char *optstring = "h:p:f:"; //lol the bug was no colon after f
+//     opterr                = 0;
+
+//     while((opt = getopt(ctx->argc, ctx->argv, optstring)) != -1)
+//     {
+//         switch(opt)
 //         {
 //             case 'p':
 //                 ctx->user_entered_port = optarg;
@@ -509,7 +1898,7 @@ static void parse_arguments(server_context *ctx)
     char *real_root_directory;
     // leading colon ':' tells getopt to return ':' for missing arguments
     // instead of printing its own default error message.
-    const char *optstring = ":p:f:i:h";
+    const char *optstring = ":p:f:i:m:k:r:l:d:e:c:b:z:Z:q:Q:t:L:F:o:M:P:anh";
     opterr                = 0;
 
     while((opt = getopt(ctx->argc, ctx->argv, optstring)) != -1)
@@ -532,6 +1921,66 @@ static void parse_arguments(server_context *ctx)
             case 'i':
                 ctx->ip_address = optarg;
                 break;
+            case 'm':
+                ctx->user_entered_max_header_size = optarg;
+                break;
+            case 'k':
+                ctx->user_entered_idle_timeout = optarg;
+                break;
+            case 'r':
+                ctx->user_entered_header_timeout = optarg;
+                break;
+            case 'l':
+                ctx->user_entered_accept_batch = optarg;
+                break;
+            case 'd':
+                ctx->user_entered_defer_accept = optarg;
+                break;
+            case 'e':
+                ctx->user_entered_backend = optarg;
+                break;
+            case 'c':
+                ctx->user_entered_cache_entries = optarg;
+                break;
+            case 'b':
+                ctx->user_entered_response_budget = optarg;
+                break;
+            case 'z':
+                ctx->user_entered_compression_threads = optarg;
+                break;
+            case 'Z':
+                ctx->user_entered_compression_budget = optarg;
+                break;
+            case 'q':
+                ctx->user_entered_connection_queue_limit = optarg;
+                break;
+            case 'Q':
+                ctx->user_entered_queue_limit = optarg;
+                break;
+            case 't':
+                ctx->user_entered_threads = optarg;
+                break;
+            case 'L':
+                ctx->user_entered_log_level = optarg;
+                break;
+            case 'F':
+                ctx->user_entered_log_format = optarg;
+                break;
+            case 'o':
+                ctx->log_path = optarg;
+                break;
+            case 'M':
+                ctx->metrics_path = optarg;
+                break;
+            case 'P':
+                ctx->user_entered_admin_port = optarg;
+                break;
+            case 'a':
+                ctx->pin_threads = true;
+                break;
+            case 'n':
+                ctx->resolve_hostnames = true;
+                break;
             case 'h':
                 ctx->exit_code = EXIT_SUCCESS;
                 print_usage(ctx);
@@ -541,7 +1990,7 @@ static void parse_arguments(server_context *ctx)
                 ctx->exit_code = EXIT_FAILURE;
                 print_usage(ctx);
             case '?':
-                // deals with unknown options (e.g. "-z")
+                // deals with unknown options (e.g. "-q")
                 fprintf(stderr, "Error: Unknown option '-%c'.\n", optopt);
                 ctx->exit_code = EXIT_FAILURE;
                 print_usage(ctx);
@@ -550,38 +1999,356 @@ static void parse_arguments(server_context *ctx)
                 print_usage(ctx);
         }
     }
-}
+}
+
+static void validate_arguments(server_context *ctx)
+{
+    // check the damn flags
+    if(ctx->user_entered_port == NULL)
+    {
+        fputs("Error: Port number is required (-p <port>).\n", stderr);
+        ctx->exit_code = EXIT_FAILURE;
+        print_usage(ctx);
+    }
+
+    if(ctx->root_directory == NULL)
+    {
+        fputs("Error: Root Directory is required (-f <dir>).\n", stderr);
+        ctx->exit_code = EXIT_FAILURE;
+        print_usage(ctx);
+    }
+
+    // validate port
+    char *endptr;
+    errno                           = 0;
+    unsigned long user_defined_port = strtoul(ctx->user_entered_port, &endptr, PORT_INPUT_BASE);
+
+    if(errno != 0 || *endptr != '\0' || user_defined_port > UINT16_MAX)
+    {
+        fprintf(stderr, "Error: Invalid port number '%s'. Must be 0-65535.\n", ctx->user_entered_port);
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    ctx->port_number = (uint16_t)user_defined_port;
+
+    // validate max header size
+    if(ctx->user_entered_max_header_size != NULL)
+    {
+        errno                                  = 0;
+        unsigned long user_defined_header_size = strtoul(ctx->user_entered_max_header_size, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_header_size == 0 || user_defined_header_size > MAX_HEADER_SIZE_LIMIT)
+        {
+            fprintf(stderr, "Error: Invalid max header size '%s'. Must be 1-%d.\n", ctx->user_entered_max_header_size, MAX_HEADER_SIZE_LIMIT);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->max_header_size = user_defined_header_size;
+    }
+
+    // validate idle timeout
+    if(ctx->user_entered_idle_timeout != NULL)
+    {
+        errno                                   = 0;
+        unsigned long user_defined_idle_timeout = strtoul(ctx->user_entered_idle_timeout, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_idle_timeout == 0 || user_defined_idle_timeout > MAX_TIMEOUT_SECONDS)
+        {
+            fprintf(stderr, "Error: Invalid idle timeout '%s'. Must be 1-%d seconds.\n", ctx->user_entered_idle_timeout, MAX_TIMEOUT_SECONDS);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->idle_timeout_ms = (uint64_t)user_defined_idle_timeout * MS_PER_SECOND;
+    }
+
+    // validate header timeout
+    if(ctx->user_entered_header_timeout != NULL)
+    {
+        errno                                     = 0;
+        unsigned long user_defined_header_timeout = strtoul(ctx->user_entered_header_timeout, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_header_timeout == 0 || user_defined_header_timeout > MAX_TIMEOUT_SECONDS)
+        {
+            fprintf(stderr, "Error: Invalid header timeout '%s'. Must be 1-%d seconds.\n", ctx->user_entered_header_timeout, MAX_TIMEOUT_SECONDS);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->header_timeout_ms = (uint64_t)user_defined_header_timeout * MS_PER_SECOND;
+    }
+
+    // validate accept batch
+    if(ctx->user_entered_accept_batch != NULL)
+    {
+        errno                                   = 0;
+        unsigned long user_defined_accept_batch = strtoul(ctx->user_entered_accept_batch, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_accept_batch == 0 || user_defined_accept_batch > MAX_ACCEPT_BATCH)
+        {
+            fprintf(stderr, "Error: Invalid accept batch '%s'. Must be 1-%d.\n", ctx->user_entered_accept_batch, MAX_ACCEPT_BATCH);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->accept_batch = user_defined_accept_batch;
+    }
+
+    // validate deferred accept
+    if(ctx->user_entered_defer_accept != NULL)
+    {
+        errno                                   = 0;
+        unsigned long user_defined_defer_accept = strtoul(ctx->user_entered_defer_accept, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_defer_accept > MAX_TIMEOUT_SECONDS)
+        {
+            fprintf(stderr, "Error: Invalid deferred accept timeout '%s'. Must be 0-%d seconds.\n", ctx->user_entered_defer_accept, MAX_TIMEOUT_SECONDS);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->defer_accept_seconds = (int)user_defined_defer_accept;
+    }
+
+#ifndef TCP_DEFER_ACCEPT
+    if(ctx->defer_accept_seconds > 0)
+    {
+        fputs("Error: Deferred accept (-d) needs TCP_DEFER_ACCEPT, which this platform does not have.\n", stderr);
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+#endif
+
+    // validate file cache size
+    if(ctx->user_entered_cache_entries != NULL)
+    {
+        errno                                    = 0;
+        unsigned long user_defined_cache_entries = strtoul(ctx->user_entered_cache_entries, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_cache_entries > MAX_FILE_CACHE_ENTRIES)
+        {
+            fprintf(stderr, "Error: Invalid file cache size '%s'. Must be 0-%d.\n", ctx->user_entered_cache_entries, MAX_FILE_CACHE_ENTRIES);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->file_cache_entries = user_defined_cache_entries;
+    }
+
+    // validate response cache budget
+    if(ctx->user_entered_response_budget != NULL)
+    {
+        errno                                      = 0;
+        unsigned long user_defined_response_budget = strtoul(ctx->user_entered_response_budget, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_response_budget > MAX_RESPONSE_CACHE_BUDGET)
+        {
+            fprintf(stderr, "Error: Invalid response cache budget '%s'. Must be 0-%d.\n", ctx->user_entered_response_budget, MAX_RESPONSE_CACHE_BUDGET);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->response_cache_budget = user_defined_response_budget;
+    }
+
+    // validate compression threads
+    if(ctx->user_entered_compression_threads != NULL)
+    {
+        errno                                          = 0;
+        unsigned long user_defined_compression_threads = strtoul(ctx->user_entered_compression_threads, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_compression_threads > MAX_COMPRESSION_THREADS)
+        {
+            fprintf(stderr, "Error: Invalid compression thread count '%s'. Must be 0-%d.\n", ctx->user_entered_compression_threads, MAX_COMPRESSION_THREADS);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->compression_threads = user_defined_compression_threads;
+    }
+
+    // validate compression cache budget
+    if(ctx->user_entered_compression_budget != NULL)
+    {
+        errno                                         = 0;
+        unsigned long user_defined_compression_budget = strtoul(ctx->user_entered_compression_budget, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_compression_budget > MAX_COMPRESSION_CACHE_BUDGET)
+        {
+            fprintf(stderr, "Error: Invalid compression cache budget '%s'. Must be 0-%d.\n", ctx->user_entered_compression_budget, MAX_COMPRESSION_CACHE_BUDGET);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->compression_budget = user_defined_compression_budget;
+    }
+
+    // validate per-connection queue limit
+    if(ctx->user_entered_connection_queue_limit != NULL)
+    {
+        errno                                       = 0;
+        unsigned long user_defined_connection_limit = strtoul(ctx->user_entered_connection_queue_limit, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_connection_limit > MAX_QUEUE_LIMIT)
+        {
+            fprintf(stderr, "Error: Invalid connection queue limit '%s'. Must be 0-%d.\n", ctx->user_entered_connection_queue_limit, MAX_QUEUE_LIMIT);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->connection_queue_limit = user_defined_connection_limit;
+    }
+
+    // validate server-wide queue limit
+    if(ctx->user_entered_queue_limit != NULL)
+    {
+        errno                            = 0;
+        unsigned long user_defined_limit = strtoul(ctx->user_entered_queue_limit, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_limit > MAX_QUEUE_LIMIT)
+        {
+            fprintf(stderr, "Error: Invalid queue limit '%s'. Must be 0-%d.\n", ctx->user_entered_queue_limit, MAX_QUEUE_LIMIT);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->queue_limit = user_defined_limit;
+    }
+
+    // validate thread count
+    if(ctx->user_entered_threads != NULL)
+    {
+        errno                              = 0;
+        unsigned long user_defined_threads = strtoul(ctx->user_entered_threads, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_threads == 0 || user_defined_threads > MAX_WORKER_THREADS)
+        {
+            fprintf(stderr, "Error: Invalid thread count '%s'. Must be 1-%d.\n", ctx->user_entered_threads, MAX_WORKER_THREADS);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->num_threads = user_defined_threads;
+    }
+
+#ifndef SO_REUSEPORT
+    if(ctx->num_threads > 1)
+    {
+        fputs("Error: Multiple threads need SO_REUSEPORT, which this platform does not have.\n", stderr);
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+#endif
 
-static void validate_arguments(server_context *ctx)
-{
-    // check the damn flags
-    if(ctx->user_entered_port == NULL)
+#ifndef __linux__
+    if(ctx->pin_threads)
     {
-        fputs("Error: Port number is required (-p <port>).\n", stderr);
+        fputs("Error: Pinning threads to CPUs (-a) is only available on Linux.\n", stderr);
         ctx->exit_code = EXIT_FAILURE;
-        print_usage(ctx);
+        quit(ctx);
     }
+#endif
 
-    if(ctx->root_directory == NULL)
+    // validate log level and format
+    if(ctx->user_entered_log_level != NULL)
     {
-        fputs("Error: Root Directory is required (-f <dir>).\n", stderr);
-        ctx->exit_code = EXIT_FAILURE;
-        print_usage(ctx);
+        if(strcmp(ctx->user_entered_log_level, "error") == 0)
+        {
+            ctx->log_level = LOG_LEVEL_ERROR;
+        }
+        else if(strcmp(ctx->user_entered_log_level, "info") == 0)
+        {
+            ctx->log_level = LOG_LEVEL_INFO;
+        }
+        else if(strcmp(ctx->user_entered_log_level, "access") == 0)
+        {
+            ctx->log_level = LOG_LEVEL_ACCESS;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown log level '%s'. Must be error, info or access.\n", ctx->user_entered_log_level);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
     }
 
-    // validate port
-    char *endptr;
-    errno                           = 0;
-    unsigned long user_defined_port = strtoul(ctx->user_entered_port, &endptr, PORT_INPUT_BASE);
+    if(ctx->user_entered_log_format != NULL)
+    {
+        if(strcmp(ctx->user_entered_log_format, "common") == 0)
+        {
+            ctx->log_format = LOG_FORMAT_COMMON;
+        }
+        else if(strcmp(ctx->user_entered_log_format, "combined") == 0)
+        {
+            ctx->log_format = LOG_FORMAT_COMBINED;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown log format '%s'. Must be common or combined.\n", ctx->user_entered_log_format);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+    }
 
-    if(errno != 0 || *endptr != '\0' || user_defined_port > UINT16_MAX)
+    // validate metrics path and admin port
+    if(ctx->metrics_path != NULL && ctx->metrics_path[0] != '/')
     {
-        fprintf(stderr, "Error: Invalid port number '%s'. Must be 0-65535.\n", ctx->user_entered_port);
+        fprintf(stderr, "Error: Invalid metrics path '%s'. Must start with '/'.\n", ctx->metrics_path);
         ctx->exit_code = EXIT_FAILURE;
         quit(ctx);
     }
 
-    ctx->port_number = (uint16_t)user_defined_port;
+    if(ctx->user_entered_admin_port != NULL)
+    {
+        errno                                 = 0;
+        unsigned long user_defined_admin_port = strtoul(ctx->user_entered_admin_port, &endptr, PORT_INPUT_BASE);
+
+        if(errno != 0 || *endptr != '\0' || user_defined_admin_port == 0 || user_defined_admin_port > UINT16_MAX || user_defined_admin_port == ctx->port_number)
+        {
+            fprintf(stderr, "Error: Invalid admin port '%s'. Must be 1-65535 and differ from the server port.\n", ctx->user_entered_admin_port);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+
+        ctx->admin_port = (uint16_t)user_defined_admin_port;
+    }
+
+    // validate event backend
+    if(ctx->user_entered_backend != NULL)
+    {
+        if(strcmp(ctx->user_entered_backend, "poll") == 0)
+        {
+            ctx->backend_type = EVENT_BACKEND_POLL;
+        }
+        else if(strcmp(ctx->user_entered_backend, "epoll") == 0)
+        {
+#ifdef __linux__
+            ctx->backend_type = EVENT_BACKEND_EPOLL;
+#else
+            fputs("Error: The epoll backend is only available on Linux.\n", stderr);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+#endif
+        }
+        else if(strcmp(ctx->user_entered_backend, "io_uring") == 0)
+        {
+#ifdef __linux__
+            ctx->backend_type = EVENT_BACKEND_IO_URING;
+#else
+            fputs("Error: The io_uring backend is only available on Linux.\n", stderr);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+#endif
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown event backend '%s'. Must be poll, epoll or io_uring.\n", ctx->user_entered_backend);
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
+        }
+    }
 
     // validate directory
     struct stat st;
@@ -624,27 +2391,53 @@ static void validate_arguments(server_context *ctx)
 __attribute__((noreturn)) static void print_usage(const server_context *ctx)
 {
     // updated usage
-    fprintf(stderr, "Usage: %s -p <port> -f <root_directory> [-i <ip_address>] [-h]\n", ctx->argv[0]);
+    fprintf(stderr, "Usage: %s -p <port> -f <root_directory> [-i <ip_address>] [-m <max_header_size>] [-k <seconds>] [-r <seconds>] [-l <connections>] [-d <seconds>] [-e <poll|epoll|io_uring>] [-c <cache_entries>] [-b <bytes>] [-z <threads>] [-Z <bytes>] [-q <bytes>] [-Q <bytes>] [-t <threads>] [-L <error|info|access>] [-F <common|combined>] [-o <path>] [-M <path>] [-P <port>] [-a] [-n] [-h]\n", ctx->argv[0]);
     fputs("\nOptions:\n", stderr);
     fputs("  -p <port>   Port number to listen on (Required)\n", stderr);
     fputs("  -f <path>   Path to document root (Required)\n", stderr);
     fputs("  -i <ip>     IP address to bind (Default: 127.0.0.1)\n", stderr);
+    fputs("  -m <bytes>  Maximum request header size (Default: 8192)\n", stderr);
+    fputs("  -k <secs>   Close keep-alive connections idle this long (Default: 5)\n", stderr);
+    fputs("  -r <secs>   Close connections whose request header takes longer than this to arrive (Default: 10)\n", stderr);
+    fputs("  -l <n>      Connections accepted per listener wakeup (Default: 64)\n", stderr);
+    fputs("  -d <secs>   Only wake for a connection once its request arrives, giving up after this long, 0 disables (Linux only, Default: 0)\n", stderr);
+    fputs("  -e <name>   Event backend, poll, epoll or io_uring, which falls back to epoll on older kernels (Default: epoll on Linux, poll elsewhere)\n", stderr);
+    fputs("  -c <n>      Open files cached per worker, 0 disables (Default: 1024)\n", stderr);
+    fputs("  -b <bytes>  Memory kept per worker for complete responses of small files, 0 disables (Default: 0)\n", stderr);
+    fputs("  -z <n>      Threads per worker compressing text files with gzip for clients that accept it, 0 only serves .br and .gz files found next to them (Default: 1)\n", stderr);
+    fputs("  -Z <bytes>  Memory kept per worker for gzip bodies compressed on the fly (Default: 16777216)\n", stderr);
+    fputs("  -q <bytes>  Unsent response bytes a connection may queue before its further pipelined requests wait (Default: 1048576)\n", stderr);
+    fputs("  -Q <bytes>  Unsent response bytes all connections together may queue, past it each waits with one response (Default: 67108864)\n", stderr);
+    fputs("  -t <n>      Number of worker threads, each with its own listener (Default: 1)\n", stderr);
+    fputs("  -L <level>  Log errors only, connections too (info) or every request as well (access) (Default: info)\n", stderr);
+    fputs("  -F <name>   Access log format, common or combined, both followed by the latency in microseconds (Default: combined)\n", stderr);
+    fputs("  -o <path>   Append the log to this file (Default: stdout)\n", stderr);
+    fputs("  -M <path>   Serve Prometheus metrics on this URL path, e.g. /metrics (Default: off)\n", stderr);
+    fputs("  -P <port>   Serve Prometheus metrics on every path of this port as well (Default: off)\n", stderr);
+    fputs("  -a          Pin each worker thread to its own CPU (Linux only)\n", stderr);
+    fputs("  -n          Log client host names, looked up in the background (Default: numeric addresses)\n", stderr);
     fputs("  -h          Display this help and exit\n", stderr);
     quit(ctx);
 }
 
 static void setup_signal_handler(void)
 {
-    struct sigaction sa = {0};
+    struct sigaction sa        = {0};
+    struct sigaction ignore_sa = {0};
 #ifdef __clang__
     #pragma clang diagnostic push
     #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
 #endif
-    sa.sa_handler = signal_handler;
+    sa.sa_handler        = signal_handler;
+    ignore_sa.sa_handler = SIG_IGN;
 #ifdef __clang__
     #pragma clang diagnostic pop
 #endif
     sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // a client that disconnects mid-response must not kill the server
+    sigaction(SIGPIPE, &ignore_sa, NULL);
 }
 
 static void signal_handler(int sig)
@@ -701,6 +2494,16 @@ static void init_server_socket(server_context *ctx)
         quit(ctx);
     }
 
+    // the accept loop runs until EAGAIN, so the listener must not block either
+    int listen_flags = fcntl(sockfd, F_GETFL);
+    if(listen_flags == -1 || fcntl(sockfd, F_SETFL, listen_flags | O_NONBLOCK) == -1)
+    {
+        fprintf(stderr, "Error: making the listener non-blocking failed\n");
+        close(sockfd);
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
     // skip the stupid timeout phase
     int enable;
     enable = 1;
@@ -712,6 +2515,26 @@ static void init_server_socket(server_context *ctx)
         quit(ctx);
     }
 
+#ifdef SO_REUSEPORT
+    // every worker binds its own listener to the same port, the kernel spreads connections across them
+    if(ctx->num_threads > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == -1)
+    {
+        fprintf(stderr, "Error: setsockopt SO_REUSEPORT failed\n");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+    // the kernel holds the connection back until the first request bytes are in
+    if(ctx->defer_accept_seconds > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &ctx->defer_accept_seconds, sizeof(int)) == -1)
+    {
+        fprintf(stderr, "Error: setsockopt TCP_DEFER_ACCEPT failed\n");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+#endif
+
     // bind
     char      addr_str[INET6_ADDRSTRLEN];
     socklen_t addr_len;
@@ -761,6 +2584,12 @@ static void init_server_socket(server_context *ctx)
         print_usage(ctx);
     }
 
+    // port 0 lets the kernel choose, remember its choice so the other workers bind the same port
+    if(ctx->port_number == 0 && getsockname(sockfd, (struct sockaddr *)&ctx->addr, &addr_len) == 0)
+    {
+        ctx->port_number = ntohs(ctx->addr.ss_family == AF_INET ? ((struct sockaddr_in *)&ctx->addr)->sin_port : ((struct sockaddr_in6 *)&ctx->addr)->sin6_port);
+    }
+
     printf("Bound to socket: %s:%u\n", addr_str, ctx->port_number);
 
     // listen
@@ -771,184 +2600,590 @@ static void init_server_socket(server_context *ctx)
         ctx->exit_code = EXIT_FAILURE;
         print_usage(ctx);
     }
-
-    printf("Listening for incoming connections...\n");
-
-    ctx->listen_fd = sockfd;
+
+    printf("Listening for incoming connections...\n");
+
+    ctx->listen_fd = sockfd;
+}
+
+// Metrics only, on the same address as the server. A scrape is rare enough for
+// one listener, so with several workers only the first one opens it.
+static void init_admin_socket(server_context *ctx)
+{
+    struct sockaddr_storage addr = ctx->addr;
+    socklen_t               addr_len;
+    int                     flags;
+    int                     enable = 1;
+
+    if(ctx->user_entered_admin_port == NULL)
+    {
+        return;
+    }
+
+    if(addr.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(ctx->admin_port);
+        addr_len                                = sizeof(struct sockaddr_in);
+    }
+    else
+    {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(ctx->admin_port);
+        addr_len                                  = sizeof(struct sockaddr_in6);
+    }
+
+    ctx->admin_fd = socket(addr.ss_family, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+    flags         = ctx->admin_fd == -1 ? -1 : fcntl(ctx->admin_fd, F_GETFL);
+    if(flags == -1 || fcntl(ctx->admin_fd, F_SETFL, flags | O_NONBLOCK) == -1 || fcntl(ctx->admin_fd, F_SETFD, FD_CLOEXEC) == -1 ||
+       setsockopt(ctx->admin_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1 || bind(ctx->admin_fd, (struct sockaddr *)&addr, addr_len) == -1 || listen(ctx->admin_fd, SOMAXCONN) == -1)
+    {
+        perror("Error: setting up the admin listener failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    printf("Serving metrics on admin port %u\n", ctx->admin_port);
+}
+
+static void init_event_backend(server_context *ctx)
+{
+    int result = event_backend_init(&ctx->backend, ctx->backend_type);
+
+    if(result == -1 && ctx->backend_type == EVENT_BACKEND_IO_URING)
+    {
+        // kernels before 5.13, or io_uring turned off through kernel.io_uring_disabled
+        fprintf(stderr, "Warning: io_uring is not available (%s), falling back to epoll\n", strerror(errno));
+        ctx->backend_type = EVENT_BACKEND_EPOLL;
+        result            = event_backend_init(&ctx->backend, ctx->backend_type);
+    }
+
+    if(result == -1)
+    {
+        perror("Error: event backend initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    printf("Using the %s event backend\n", event_backend_name(&ctx->backend));
+    ctx->backend.accept_batch = ctx->accept_batch;
+
+    // the listener and the wakeup pipe are told apart from clients by their data pointer
+    if(event_backend_add(&ctx->backend, ctx->listen_fd, EVENT_READ | EVENT_EXCLUSIVE | EVENT_ACCEPT, &ctx->listen_fd) == -1)
+    {
+        perror("Error: registering the listener failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    if(ctx->admin_fd != -1 && event_backend_add(&ctx->backend, ctx->admin_fd, EVENT_READ | EVENT_ACCEPT, &ctx->admin_fd) == -1)
+    {
+        perror("Error: registering the admin listener failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    if(ctx->wakeup_fds[0] != -1 && event_backend_add(&ctx->backend, ctx->wakeup_fds[0], EVENT_READ, &ctx->wakeup_fds[0]) == -1)
+    {
+        perror("Error: registering the wakeup pipe failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    client_table_init(&ctx->clients);
+    ctx->num_clients = 0;
+}
+
+// The open-file cache learns about changes under the root through inotify
+static void init_file_cache(server_context *ctx)
+{
+    if(file_cache_init(&ctx->file_cache, ctx->root_directory, ctx->file_cache_entries, ctx->response_cache_budget) == -1)
+    {
+        perror("Error: file cache initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    if(ctx->file_cache.inotify_fd != -1 && event_backend_add(&ctx->backend, ctx->file_cache.inotify_fd, EVENT_READ, &ctx->file_cache) == -1)
+    {
+        perror("Error: registering the file cache watch failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+}
+
+// One ring per worker, drained by a writer thread so logging never blocks the event loop
+static void init_access_log(server_context *ctx, access_log *log)
+{
+    if(ctx->log_level == LOG_LEVEL_ERROR)
+    {
+        return;
+    }
+
+    if(access_log_init(log, ctx->num_threads, ctx->log_path) == -1)
+    {
+        perror("Error: access log initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+    ctx->access_log = log;
+    ctx->log_ring   = &log->rings[0];
+}
+
+// After the workers stopped, so their last lines are written
+static void cleanup_access_log(server_context *ctx)
+{
+    uint64_t dropped;
+
+    if(ctx->access_log == NULL)
+    {
+        return;
+    }
+
+    dropped = access_log_dropped(ctx->access_log);
+    access_log_destroy(ctx->access_log);
+    ctx->access_log = NULL;
+    ctx->log_ring   = NULL;
+    if(dropped > 0)
+    {
+        fprintf(stderr, "Access log: %llu lines dropped while the writer fell behind\n", (unsigned long long)dropped);
+    }
+}
+
+// One shard per worker, summed only when someone scrapes them
+static void init_metrics(server_context *ctx, metrics_registry *registry)
+{
+    if(ctx->metrics_path == NULL && ctx->user_entered_admin_port == NULL)
+    {
+        return;
+    }
+
+    if(metrics_init(registry, ctx->num_threads) == -1)
+    {
+        perror("Error: metrics initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+    ctx->metrics       = registry;
+    ctx->metrics_shard = &registry->shards[0];
+}
+
+static void cleanup_metrics(server_context *ctx)
+{
+    if(ctx->metrics == NULL)
+    {
+        return;
+    }
+
+    metrics_destroy(ctx->metrics);
+    ctx->metrics       = NULL;
+    ctx->metrics_shard = NULL;
+}
+
+// After the workers stopped, every connection has given its buffers back
+static void cleanup_buffer_pool(void)
+{
+    printf("Buffer pool: %zu KiB reserved at the peak\n", buffer_pool_reserved_bytes() / BYTES_PER_KIB);
+    buffer_pool_destroy();
+}
+
+// Only started with -n, the resolver reports finished lookups through a pipe
+static void init_resolver(server_context *ctx)
+{
+    if(!ctx->resolve_hostnames)
+    {
+        return;
+    }
+
+    if(resolver_init(&ctx->resolver, DEFAULT_RESOLVER_CACHE_ENTRIES) == -1)
+    {
+        perror("Error: resolver initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    if(event_backend_add(&ctx->backend, ctx->resolver.result_fds[0], EVENT_READ, &ctx->resolver) == -1)
+    {
+        perror("Error: registering the resolver failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+}
+
+// The pool reports finished files through a pipe, nothing is registered without threads
+static void init_compressor(server_context *ctx)
+{
+    if(compressor_init(&ctx->compressor, ctx->compression_threads, ctx->compression_budget) == -1)
+    {
+        perror("Error: compressor initialization failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    if(ctx->compression_threads > 0 && event_backend_add(&ctx->backend, ctx->compressor.result_fds[0], EVENT_READ, &ctx->compressor) == -1)
+    {
+        perror("Error: registering the compressor failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+}
+
+// Purely numeric, so it never waits on DNS
+static int format_peer_address(const client_state *state, char host[NI_MAXHOST], char service[NI_MAXSERV])
+{
+    return getnameinfo((const struct sockaddr *)&state->peer_addr, state->peer_addr_len, host, NI_MAXHOST, service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+}
+
+// Returns a non-blocking, close-on-exec client socket, or -1 with errno set
+static int accept_connection(int listen_fd, struct sockaddr_storage *client_addr, socklen_t *addr_len)
+{
+    int client_fd;
+
+#ifdef __linux__
+    // both flags in the same syscall
+    do
+    {
+        client_fd = accept4(listen_fd, (struct sockaddr *)client_addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while(client_fd == -1 && errno == EINTR);
+#else
+    int flags;
+
+    do
+    {
+        client_fd = accept(listen_fd, (struct sockaddr *)client_addr, addr_len);
+    } while(client_fd == -1 && errno == EINTR);
+    if(client_fd == -1)
+    {
+        return -1;
+    }
+
+    flags = fcntl(client_fd, F_GETFL);
+    if(flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1 || fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        const int saved_errno = errno;
+
+        close(client_fd);
+        errno = saved_errno;
+        return -1;
+    }
+#endif
+    return client_fd;
+}
+
+// Formatting the address is left to here, it only happens when the line is wanted
+static void log_accepted_client(server_context *ctx, client_state *state)
+{
+    char client_host[NI_MAXHOST];
+    char client_service[NI_MAXSERV];
+
+    if(format_peer_address(state, client_host, client_service) == 0)
+    {
+        // a name only shows up once it is cached, otherwise it is logged when the lookup finishes
+        const char *name = ctx->resolve_hostnames ? resolver_lookup(&ctx->resolver, (struct sockaddr *)&state->peer_addr, state->peer_addr_len, state, state->generation) : NULL;
+
+        if(name != NULL)
+        {
+            log_ring_printf(ctx->log_ring, "Accepted a new connection from %s:%s (%s)\n", client_host, client_service, name);
+        }
+        else
+        {
+            log_ring_printf(ctx->log_ring, "Accepted a new connection from %s:%s\n", client_host, client_service);
+        }
+    }
+    else
+    {
+        log_ring_printf(ctx->log_ring, "unable to get client information\n");
+    }
 }
 
-static void init_poll_fds(struct server_context *ctx)
+static void register_client(server_context *ctx, int client_fd, const struct sockaddr_storage *client_addr, socklen_t addr_len, bool admin)
 {
-    // space for 1 listener and 10 clients to avoid realloc
-    ctx->pollfds_capacity = INITIAL_POLLFDS_CAPACITY;
-
-    // allocating client state array first
-    ctx->clients = malloc(sizeof(client_state) * ctx->pollfds_capacity);
-    if(ctx->clients == NULL)
+    client_state *state = client_table_acquire(&ctx->clients);
+    if(state == NULL)
     {
-        perror("Error: client malloc failed");
-        ctx->exit_code = EXIT_FAILURE;
-        print_usage(ctx);
+        perror("Error: client slab malloc failed");
+        close(client_fd);
+        return;
     }
+    state->socket = client_fd;
+    memcpy(&state->peer_addr, client_addr, addr_len);
+    state->peer_addr_len = addr_len;
+    state->admin         = admin;
 
-    // initialize clients, avoiding garbage values
-    for(nfds_t i = 0; i < ctx->pollfds_capacity; i++)
+    if(ctx->log_level >= LOG_LEVEL_INFO)
     {
-        ctx->clients[i].socket = -1;
+        log_accepted_client(ctx, state);
     }
 
-    // allocating pollfd array
-    ctx->pollfds = malloc(sizeof(struct pollfd) * (ctx->pollfds_capacity + 1));
-    if(ctx->pollfds == NULL)
+    if(event_backend_add(&ctx->backend, client_fd, EVENT_READ | EVENT_RECEIVE, state) == -1)
     {
-        perror("Error: pollfds malloc failed");
-        free(ctx->clients);
-        ctx->exit_code = EXIT_FAILURE;
-        print_usage(ctx);
+        perror("Error: registering client failed");
+        close(client_fd);
+        client_table_release(&ctx->clients, state);
+        return;
     }
 
-    // setting up listener which is at index 0
-    ctx->pollfds[0].fd      = ctx->listen_fd;
-    ctx->pollfds[0].events  = POLLIN;
-    ctx->pollfds[0].revents = 0;
-
-    for(nfds_t i = 1; i <= ctx->pollfds_capacity; i++)
+    state->timer.data = state;
+    timer_wheel_schedule(&ctx->timers, &state->timer, ctx->now_ms + ctx->idle_timeout_ms);
+    ctx->num_clients++;
+    if(ctx->metrics_shard != NULL)
     {
-        ctx->pollfds[i].fd      = -1;
-        ctx->pollfds[i].events  = 0;
-        ctx->pollfds[i].revents = 0;
+        metrics_add(&ctx->metrics_shard->connections_accepted, 1);
+        metrics_set(&ctx->metrics_shard->connections_active, ctx->num_clients);
     }
 
-    ctx->num_clients = 0;
+    // with deferred accept the request is already waiting, no need for another wakeup
+    if(ctx->defer_accept_seconds > 0 && !admin)
+    {
+        serve_client(ctx, state);
+    }
 }
 
-static void accept_client(server_context *ctx)
+// A backend that accepts by itself hands over the socket without the peer's address
+static void register_accepted_client(server_context *ctx, int client_fd, bool admin)
 {
     struct sockaddr_storage client_addr;
     socklen_t               addr_len = sizeof(client_addr);
-    int                     client_fd;
 
-    char client_host[NI_MAXHOST];
-    char client_service[NI_MAXSERV];
+    if(getpeername(client_fd, (struct sockaddr *)&client_addr, &addr_len) == -1)
+    {
+        // the client is already gone
+        close(client_fd);
+        return;
+    }
+    register_client(ctx, client_fd, &client_addr, addr_len, admin);
+}
 
-    errno = 0;
-    // accepting the client
-    client_fd = accept(ctx->listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+// Drains the listen queue, up to accept_batch connections per wakeup so a
+// connect storm cannot starve the clients already being served
+static void accept_clients(server_context *ctx, int listen_fd, bool admin)
+{
+    for(size_t accepted = 0; accepted < ctx->accept_batch; accepted++)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t               addr_len  = sizeof(client_addr);
+        const int               client_fd = accept_connection(listen_fd, &client_addr, &addr_len);
 
-    if(client_fd == -1)
+        if(client_fd == -1)
+        {
+            if(errno == ECONNABORTED || errno == EPROTO)
+            {
+                // the client gave up while queued, the next one may be fine
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Accept failed");
+            }
+            return;
+        }
+        register_client(ctx, client_fd, &client_addr, addr_len, admin);
+    }
+}
+
+// Whether a connection has queued as much as it may until some of it is sent. One
+// response is always allowed, so a connection is never held up by others alone.
+static bool is_queue_full(const server_context *ctx, const client_state *state)
+{
+    if(state->exchange->queue_length == 0)
+    {
+        return false;
+    }
+    return state->exchange->queue_length == MAX_QUEUED_RESPONSES || state->exchange->queued_bytes >= ctx->connection_queue_limit ||
+           atomic_load_explicit(&total_queued_bytes, memory_order_relaxed) >= ctx->queue_limit;
+}
+
+// Answers every complete request already in the buffer, queueing the responses
+// in order. Stops early when the queue is full or a response closes the connection.
+static int read_requests(server_context *ctx, client_state *state)
+{
+    while(!is_queue_full(ctx, state) && !state->closing)
     {
-        if(errno == EINTR)
+        const int result = read_request(ctx, state);
+
+        if(result == READ_FAILED || result == READ_WAITING)
+        {
+            return result;
+        }
+        if(result == READ_COMPLETE)
+        {
+            state->header_timer_started = false;
+            handle_request(ctx, state);
+        }
+
+        // not even an error response could be put together
+        if(!state->exchange->response.ready)
+        {
+            return READ_FAILED;
+        }
+        state->exchange->response.started_us = state->request_started_us;
+        start_access_log(ctx, state);
+        queue_response(state);
+
+        state->file_path          = NULL;
+        state->http_minor_version = 0;
+
+        // the next request starts where this one ended
+        state->request_start = state->exchange->parser.position;
+        http_parser_init(&state->exchange->parser, &state->exchange->request, state->request_start);
+
+        // a pipelined request already in the buffer arrived with this one
+        if(state->request_start == state->request_buffer_filled)
         {
-            perror("Accept failed");
+            state->request_started_us = 0;
         }
+    }
+    return READ_QUEUE_FULL;
+}
+
+// An idle connection gets idle_timeout_ms to start its next request. Once a
+// request starts arriving it has header_timeout_ms in total, however slowly it trickles in.
+static void arm_read_timer(server_context *ctx, client_state *state)
+{
+    if(state->request_buffer_filled == 0)
+    {
+        timer_wheel_schedule(&ctx->timers, &state->timer, ctx->now_ms + ctx->idle_timeout_ms);
         return;
     }
 
-    // getting name info of the connection
-    if(getnameinfo((struct sockaddr *)&client_addr, addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, 0) == 0)
+    if(!state->header_timer_started)
     {
-        printf("Accepted a new connection from %s:%s\n", client_host, client_service);
+        state->header_timer_started = true;
+        timer_wheel_schedule(&ctx->timers, &state->timer, ctx->now_ms + ctx->header_timeout_ms);
     }
-    else
+}
+
+// Takes a connection as far as it goes without blocking: answers the requests
+// that are in, sends the queued responses, and repeats while the queue was the
+// only thing holding further requests back.
+static void serve_client(server_context *ctx, client_state *state)
+{
+    if(borrow_exchange(state) == -1)
     {
-        printf("unable to get client information\n");
-    }
-
-    // resize arrays if full
-    // if(ctx->num_clients >= ctx->pollfds_capacity)
-    // {
-    //     size_t new_capacity = ctx->pollfds_capacity * 2;
-    //
-    //     // again, we need the new cap + 1 for listener
-    //     struct pollfd *new_poll    = realloc(ctx->pollfds, sizeof(struct pollfd) * (new_capacity + 1));
-    //     client_state  *new_clients = realloc(ctx->clients, sizeof(struct client_state) * new_capacity);
-    //
-    //     if(!new_poll || !new_clients)
-    //     {
-    //         perror("Error: realloc of new pollfds or new clients failed");
-    //         // question for giorgio. how should we deal with freeing here
-    //         if(new_poll)
-    //         {
-    //             free(new_poll);
-    //         }
-    //
-    //         if(new_clients)
-    //         {
-    //             free(new_clients);
-    //         }
-    //         close(client_fd);
-    //         return;
-    //     }
-    //
-    //     ctx->pollfds          = new_poll;
-    //     ctx->clients          = new_clients;
-    //     ctx->pollfds_capacity = new_capacity;
-    //
-    //     // initializing new slots that we just added
-    //     for(nfds_t i = ctx->num_clients + 1; i <= new_capacity; i++)
-    //     {
-    //         ctx->pollfds[i].fd      = -1;
-    //         ctx->pollfds[i].events  = 0;
-    //         ctx->pollfds[i].revents = 0;
-    //     }
-    // }
-    if(ctx->num_clients >= ctx->pollfds_capacity)
-    {
-        size_t new_capacity = (ctx->num_clients + 1) * 2;
-
-        // trying  to expand pollfds
-        struct pollfd *new_poll = realloc(ctx->pollfds, sizeof(struct pollfd) * (new_capacity + 1));
-        if(!new_poll)
-        {
-            perror("Error: realloc pollfds failed");
-            // old ctx->pollfds is still valid, just reject the current client
-            close(client_fd);
+        perror("Error: borrowing request state failed");
+        close_client(ctx, state);
+        return;
+    }
+
+    while(true)
+    {
+        const int read_result = read_requests(ctx, state);
+        int       send_result;
+
+        if(read_result == READ_FAILED)
+        {
+            close_client(ctx, state);
+            return;
+        }
+
+        send_result = flush_responses(ctx, state);
+        if(send_result == SEND_FAILED)
+        {
+            close_client(ctx, state);
+            return;
+        }
+        if(send_result == SEND_BLOCKED)
+        {
+            // re-arming also requeues an edge-triggered fd that yielded while still writable
+            if(event_backend_modify(&ctx->backend, state->socket, EVENT_WRITE, state) == -1)
+            {
+                perror("Error: waiting for the client to be writable failed");
+                close_client(ctx, state);
+                return;
+            }
+            state->waiting_for_write = true;
+
+            // a client that stops reading its responses counts as idle
+            timer_wheel_schedule(&ctx->timers, &state->timer, ctx->now_ms + ctx->idle_timeout_ms);
             return;
         }
-        // success
-        ctx->pollfds = new_poll;
 
-        // trying to expand clients
-        client_state *new_clients = realloc(ctx->clients, sizeof(client_state) * new_capacity);
-        if(!new_clients)
+        if(state->closing)
+        {
+            close_client(ctx, state);
+            return;
+        }
+        if(read_result == READ_WAITING)
         {
-            perror("Error: realloc clients failed");
-            // Old ctx->clients is still valid.
-            // ctx->pollfds is larger now, but that is safe (unused space).
-            close(client_fd);
+            if(state->waiting_for_write)
+            {
+                if(event_backend_modify(&ctx->backend, state->socket, EVENT_READ | EVENT_RECEIVE, state) == -1)
+                {
+                    perror("Error: waiting for the client to be readable failed");
+                    close_client(ctx, state);
+                    return;
+                }
+                state->waiting_for_write = false;
+            }
+            if(state->request_buffer_filled == state->request_start)
+            {
+                return_idle_buffers(state);
+            }
+            arm_read_timer(ctx, state);
             return;
         }
-        ctx->clients = new_clients;
+    }
+}
 
-        // Initialize new slots
-        for(nfds_t i = ctx->pollfds_capacity + 1; i <= new_capacity; i++)
+// Logs the names the resolver found for connections that are still open. A
+// slot may have been reused while the lookup ran, the generation tells.
+static void process_resolver_results(server_context *ctx)
+{
+    resolver_result result;
+
+    while(resolver_next_result(&ctx->resolver, &result) == 1)
+    {
+        const client_state *state = result.data;
+        char                client_host[NI_MAXHOST];
+        char                client_service[NI_MAXSERV];
+
+        if(ctx->log_level >= LOG_LEVEL_INFO && state->socket != -1 && state->generation == result.generation && format_peer_address(state, client_host, client_service) == 0)
         {
-            ctx->pollfds[i].fd      = -1;
-            ctx->pollfds[i].events  = 0;
-            ctx->pollfds[i].revents = 0;
+            log_ring_printf(ctx->log_ring, "Connection from %s:%s is %s\n", client_host, client_service, result.host);
         }
-        ctx->pollfds_capacity = new_capacity;
     }
+}
 
-    // store the clients in the pollfds array
-    nfds_t poll_index   = ctx->num_clients + 1;
-    nfds_t client_index = ctx->num_clients;
+// Closes every connection whose idle or header timeout has passed
+static void expire_clients(server_context *ctx)
+{
+    timer_entry *timer;
 
-    ctx->pollfds[poll_index].fd      = client_fd;
-    ctx->pollfds[poll_index].events  = POLLIN;
-    ctx->pollfds[poll_index].revents = 0;
+    while((timer = timer_wheel_expire(&ctx->timers, ctx->now_ms)) != NULL)
+    {
+        close_client(ctx, timer->data);
+    }
+}
 
-    memset(&ctx->clients[client_index], 0, sizeof(client_state));
-    ctx->clients[client_index].socket = client_fd;
+// Bytes are queued behind any the connection has not read yet, NULL marks the end of them
+static void queue_received(client_state *state, received_data *received)
+{
+    received_data **last = &state->received;
 
-    ctx->num_clients++;
+    if(received == NULL)
+    {
+        state->received_end = true;
+        return;
+    }
+    while(*last != NULL)
+    {
+        last = &(*last)->next;
+    }
+    *last = received;
 }
 
 static void event_loop(server_context *ctx)
 {
+    backend_event events[MAX_EVENTS_PER_WAIT];
+
+    // startup messages went through stdio, the log writer shares the fd and must not overtake them
+    fflush(stdout);
+
+    ctx->now_ms = timer_wheel_now_ms();
+    timer_wheel_init(&ctx->timers, ctx->now_ms);
+
     while(!exit_flag)
     {
-        int activity = poll(ctx->pollfds, ctx->num_clients + 1, -1);
+        // sleeps no longer than until the next timer tick is due
+        int activity = event_backend_wait(&ctx->backend, events, MAX_EVENTS_PER_WAIT, timer_wheel_timeout(&ctx->timers, timer_wheel_now_ms()));
 
         if(activity < 0)
         {
@@ -956,129 +3191,356 @@ static void event_loop(server_context *ctx)
             {
                 continue;
             }
-            perror("Error: poll failed");
+            perror("Error: event backend wait failed");
             ctx->exit_code = EXIT_FAILURE;
             return;
         }
 
-        // check listener to see if we need to accept a new client
-        if(ctx->pollfds[0].revents & POLLIN)
+        ctx->now_ms = timer_wheel_now_ms();
+        expire_clients(ctx);
+
+        // the pool counts per thread, which is per worker, and the receive
+        // buffers an io_uring backend keeps spare belong to no connection
+        if(ctx->metrics_shard != NULL)
         {
-            accept_client(ctx);
+            metrics_set(&ctx->metrics_shard->connection_buffer_bytes, buffer_pool_thread_bytes() - ctx->backend.idle_buffer_bytes);
         }
 
-        // need to check clients cuz read_request might call close_client
-        // need to go backwards cuz if we close a client, array shrinks.
-        for(nfds_t i = ctx->num_clients; i > 0; i--)
+        // only the ready fds come back, no scan over every client
+        for(int i = 0; i < activity; i++)
         {
-            nfds_t client_index = i - 1;
-            nfds_t poll_index   = client_index + 1;
+            if(events[i].events & EVENT_ACCEPT)
+            {
+                continue;
+            }
+
+            if(events[i].data == &ctx->listen_fd)
+            {
+                accept_clients(ctx, ctx->listen_fd, false);
+                continue;
+            }
+
+            if(events[i].data == &ctx->admin_fd)
+            {
+                accept_clients(ctx, ctx->admin_fd, true);
+                continue;
+            }
+
+            if(events[i].data == &ctx->wakeup_fds[0])
+            {
+                // nothing to read, exit_flag is checked at the top of the loop
+                continue;
+            }
+
+            if(events[i].data == &ctx->file_cache)
+            {
+                file_cache_process_events(&ctx->file_cache);
+                continue;
+            }
+
+            if(events[i].data == &ctx->resolver)
+            {
+                process_resolver_results(ctx);
+                continue;
+            }
+
+            if(events[i].data == &ctx->compressor)
+            {
+                compressor_process_results(&ctx->compressor);
+                continue;
+            }
+
+            // errors and hangups are picked up by read() or send() failing
+            client_state *state = events[i].data;
+            if(state->socket == -1)
+            {
+                // timed out or closed earlier in this batch, what was received for it goes back
+                if((events[i].events & EVENT_RECEIVE) && events[i].received != NULL)
+                {
+                    event_backend_release(&ctx->backend, events[i].received);
+                }
+                continue;
+            }
+            if(events[i].events & EVENT_RECEIVE)
+            {
+                queue_received(state, events[i].received);
+            }
+            serve_client(ctx, state);
+        }
 
-            if(ctx->pollfds[poll_index].revents & POLLIN)
+        // Connections the backend accepted are taken on last. A slot freed in
+        // this batch must not go to one of them while an event of its previous
+        // connection, maybe with that connection's bytes, is still to come.
+        for(int i = 0; i < activity; i++)
+        {
+            if(events[i].events & EVENT_ACCEPT)
             {
-                read_request(ctx, &ctx->clients[client_index]);
+                register_accepted_client(ctx, events[i].result, events[i].data == &ctx->admin_fd);
             }
         }
     }
 }
 
-static void close_client(server_context *ctx, const client_state *state)
+// Frees what the connection owns, the slot itself goes back to the table
+static void free_client(client_state *state)
 {
-    if(state->socket != -1)
+    if(state->exchange != NULL)
     {
-        close(state->socket);
+        release_response(&state->exchange->response);
+        while(state->exchange->queue_length > 0)
+        {
+            dequeue_response(state);
+        }
     }
+    return_idle_buffers(state);
+}
 
-    if(state->request_buffer)
+static void close_client(server_context *ctx, client_state *state)
+{
+    if(state->socket == -1)
     {
-        free(state->request_buffer);
+        return;
     }
 
-    if(state->file_path)
+    event_backend_remove(&ctx->backend, state->socket);
+    close(state->socket);
+    timer_wheel_cancel(&ctx->timers, &state->timer);
+
+    // bytes the backend received that were never read
+    while(state->received != NULL)
     {
-        free(state->file_path);
+        received_data *next = state->received->next;
+
+        event_backend_release(&ctx->backend, state->received);
+        state->received = next;
     }
 
-    if(state->request.method)
+    // responses cut short are logged with what was sent of them
+    for(size_t i = 0; state->exchange != NULL && i < state->exchange->queue_length; i++)
     {
-        free(state->request.method);
+        finish_response(ctx, queued_response(state, i));
     }
 
-    if(state->request.path)
+    free_client(state);
+    client_table_release(&ctx->clients, state);
+    ctx->num_clients--;
+    if(ctx->metrics_shard != NULL)
     {
-        free(state->request.path);
+        metrics_set(&ctx->metrics_shard->connections_active, ctx->num_clients);
     }
 
-    if(state->request.protocolVersion)
+    if(ctx->log_level >= LOG_LEVEL_INFO)
     {
-        free(state->request.protocolVersion);
+        log_ring_printf(ctx->log_ring, "Safely removed client connection\n");
     }
+}
 
-    // address of specific client - address of start of array = index
-    nfds_t client_index = state - ctx->clients;
+static void cleanup_server(server_context *ctx)
+{
+    struct client_slab *slab = ctx->clients.slabs;
 
-    // safety check
-    if((size_t)client_index >= ctx->num_clients)
+    // Free any remaining clients along with the slabs
+    while(slab != NULL)
     {
-        return;
+        struct client_slab *next = slab->next;
+
+        for(size_t i = 0; i < CLIENT_SLAB_SIZE; i++)
+        {
+            if(slab->slots[i].socket != -1)
+            {
+                close(slab->slots[i].socket);
+                free_client(&slab->slots[i]);
+            }
+        }
+        free(slab);
+        slab = next;
     }
+    client_table_init(&ctx->clients);
 
-    // remove from arrays by shifting everything down, need to fill gap left by client closing
-    size_t items_to_move = ctx->num_clients - client_index - 1;
+    if(ctx->file_cache.response_budget > 0)
+    {
+        printf("Response cache: %llu hits, %llu misses\n", (unsigned long long)ctx->file_cache.response_hits, (unsigned long long)ctx->file_cache.response_misses);
+    }
 
-    if(items_to_move > 0)
+    if(ctx->compressor.num_threads > 0)
     {
-        // shifting clients array
-        memmove(&ctx->clients[client_index], &ctx->clients[client_index + 1], sizeof(client_state) * items_to_move);
+        printf("Compression cache: %llu hits, %llu misses\n", (unsigned long long)ctx->compressor.hits, (unsigned long long)ctx->compressor.misses);
+    }
 
-        // need to shift pollfds array too, but indices here are + 1 relative to clients because of listener
-        memmove(&ctx->pollfds[client_index + 1], &ctx->pollfds[client_index + 2], sizeof(struct pollfd) * items_to_move);
+    // after the clients, they may still hold references to cached files and bodies
+    file_cache_destroy(&ctx->file_cache);
+    compressor_destroy(&ctx->compressor);
+    resolver_destroy(&ctx->resolver);
+    event_backend_destroy(&ctx->backend);
+
+    if(ctx->listen_fd != -1)
+    {
+        close(ctx->listen_fd);
     }
 
-    ctx->num_clients--;
+    if(ctx->admin_fd != -1)
+    {
+        close(ctx->admin_fd);
+    }
 
-    printf("Safely removed client connection\n");
+    for(size_t i = 0; i < 2; i++)
+    {
+        if(ctx->wakeup_fds[i] != -1)
+        {
+            close(ctx->wakeup_fds[i]);
+        }
+    }
 }
 
-static void cleanup_server(const server_context *ctx)
+static void init_wakeup_pipe(server_context *ctx)
 {
-    // Free the main arrays
-    if(ctx->pollfds)
+    if(pipe(ctx->wakeup_fds) == -1)
     {
-        free(ctx->pollfds);
+        perror("Error: wakeup pipe creation failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
     }
 
-    if(ctx->clients)
+    for(size_t i = 0; i < 2; i++)
     {
-        // Free any remaining client buffers
-        for(nfds_t i = 0; i < ctx->num_clients; i++)
+        if(fcntl(ctx->wakeup_fds[i], F_SETFD, FD_CLOEXEC) == -1)
         {
-            if(ctx->clients[i].request_buffer)
-            {
-                free(ctx->clients[i].request_buffer);
-            }
-            if(ctx->clients[i].request.method)
-            {
-                free(ctx->clients[i].request.method);
-            }
-            if(ctx->clients[i].request.path)
-            {
-                free(ctx->clients[i].request.path);
-            }
-            if(ctx->clients[i].request.protocolVersion)
-            {
-                free(ctx->clients[i].request.protocolVersion);
-            }
-            if(ctx->clients[i].file_path)
-            {
-                free(ctx->clients[i].file_path);
-            }
+            perror("Error: fcntl on wakeup pipe failed");
+            ctx->exit_code = EXIT_FAILURE;
+            quit(ctx);
         }
-        free(ctx->clients);
     }
+}
 
-    if(ctx->listen_fd != -1)
+#ifdef __linux__
+static void pin_worker_to_cpu(const worker *self)
+{
+    cpu_set_t cpus;
+    long      num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int       result;
+
+    if(num_cpus <= 0)
     {
-        close(ctx->listen_fd);
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(self->index % (size_t)num_cpus, &cpus);
+
+    result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(result != 0)
+    {
+        fprintf(stderr, "Warning: pinning worker %zu failed: %s\n", self->index, strerror(result));
+    }
+}
+#endif
+
+static void *worker_main(void *arg)
+{
+    worker *self = arg;
+
+#ifdef __linux__
+    if(self->ctx.pin_threads)
+    {
+        pin_worker_to_cpu(self);
+    }
+#endif
+
+    event_loop(&self->ctx);
+    return NULL;
+}
+
+// Sets up every worker's listener and poller up front so startup errors still quit the process,
+// then runs them until a signal sets exit_flag
+static void run_workers(server_context *ctx)
+{
+    worker  *workers;
+    sigset_t shutdown_signals;
+    sigset_t previous_mask;
+
+    workers = calloc(ctx->num_threads, sizeof(worker));
+    if(workers == NULL)
+    {
+        perror("Error: worker malloc failed");
+        ctx->exit_code = EXIT_FAILURE;
+        quit(ctx);
+    }
+
+    for(size_t i = 0; i < ctx->num_threads; i++)
+    {
+        workers[i].index        = i;
+        workers[i].ctx          = *ctx;
+        workers[i].ctx.log_ring = ctx->access_log == NULL ? NULL : &ctx->access_log->rings[i];
+        workers[i].ctx.metrics_shard = ctx->metrics == NULL ? NULL : &ctx->metrics->shards[i];
+        init_server_socket(&workers[i].ctx);
+        if(i == 0)
+        {
+            init_admin_socket(&workers[i].ctx);
+        }
+        init_wakeup_pipe(&workers[i].ctx);
+        init_event_backend(&workers[i].ctx);
+        init_file_cache(&workers[i].ctx);
+        init_resolver(&workers[i].ctx);
+        init_compressor(&workers[i].ctx);
+
+        // an ephemeral port chosen for the first worker is shared by the rest
+        ctx->port_number = workers[i].ctx.port_number;
+    }
+
+    // workers inherit a mask with the shutdown signals blocked so only the main thread handles them
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, &previous_mask);
+
+    for(size_t i = 0; i < ctx->num_threads; i++)
+    {
+        int result = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if(result != 0)
+        {
+            fprintf(stderr, "Error: starting worker %zu failed: %s\n", i, strerror(result));
+            ctx->exit_code = EXIT_FAILURE;
+            exit_flag      = 1;
+            break;
+        }
+        workers[i].started = true;
+    }
+
+    printf("Started %zu worker threads\n", ctx->num_threads);
+    fflush(stdout);
+
+    // sleep with the signals unblocked, checking the flag while they are blocked avoids missing one
+    while(!exit_flag)
+    {
+        sigsuspend(&previous_mask);
     }
-}
\ No newline at end of file
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+    // wake every worker out of its backend wait, each one closes its own connections
+    for(size_t i = 0; i < ctx->num_threads; i++)
+    {
+        const char wakeup = 0;
+
+        if(write(workers[i].ctx.wakeup_fds[1], &wakeup, 1) == -1)
+        {
+            perror("Error: waking worker failed");
+        }
+    }
+
+    for(size_t i = 0; i < ctx->num_threads; i++)
+    {
+        if(workers[i].started)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+        if(workers[i].ctx.exit_code != EXIT_SUCCESS)
+        {
+            ctx->exit_code = workers[i].ctx.exit_code;
+        }
+        cleanup_server(&workers[i].ctx);
+    }
+
+    free(workers);
+    printf("All workers stopped\n");
+}
+
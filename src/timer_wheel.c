@@ -0,0 +1,118 @@
+#include "../include/timer_wheel.h"
+#include <string.h>
+#include <time.h>
+
+enum
+{
+    MS_PER_SECOND    = 1000,
+    NS_PER_MS        = 1000000,
+    TIMER_WHEEL_MASK = TIMER_WHEEL_SLOTS - 1,
+};
+
+void timer_wheel_init(timer_wheel *wheel, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current_tick = now_ms / TIMER_WHEEL_TICK_MS;
+}
+
+static void unlink_timer(timer_wheel *wheel, timer_entry *entry)
+{
+    if(entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        wheel->slots[entry->expires_tick & TIMER_WHEEL_MASK] = entry->next;
+    }
+    if(entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+    entry->prev  = NULL;
+    entry->next  = NULL;
+    entry->armed = false;
+    wheel->num_timers--;
+}
+
+void timer_wheel_schedule(timer_wheel *wheel, timer_entry *entry, uint64_t expires_ms)
+{
+    uint64_t      tick = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    timer_entry **slot;
+
+    if(entry->armed)
+    {
+        unlink_timer(wheel, entry);
+    }
+
+    // already due, it goes out with the next expiry pass
+    if(tick < wheel->current_tick)
+    {
+        tick = wheel->current_tick;
+    }
+
+    slot                = &wheel->slots[tick & TIMER_WHEEL_MASK];
+    entry->expires_tick = tick;
+    entry->prev         = NULL;
+    entry->next         = *slot;
+    entry->armed        = true;
+    if(*slot != NULL)
+    {
+        (*slot)->prev = entry;
+    }
+    *slot = entry;
+    wheel->num_timers++;
+}
+
+void timer_wheel_cancel(timer_wheel *wheel, timer_entry *entry)
+{
+    if(entry->armed)
+    {
+        unlink_timer(wheel, entry);
+    }
+}
+
+int timer_wheel_timeout(const timer_wheel *wheel, uint64_t now_ms)
+{
+    const uint64_t next_tick_ms = wheel->current_tick * TIMER_WHEEL_TICK_MS;
+
+    if(wheel->num_timers == 0)
+    {
+        return -1;
+    }
+    return next_tick_ms <= now_ms ? 0 : (int)(next_tick_ms - now_ms);
+}
+
+timer_entry *timer_wheel_expire(timer_wheel *wheel, uint64_t now_ms)
+{
+    const uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+
+    // an empty wheel jumps straight to the present instead of walking every tick it slept through
+    if(wheel->num_timers == 0 && wheel->current_tick <= now_tick)
+    {
+        wheel->current_tick = now_tick + 1;
+        return NULL;
+    }
+
+    while(wheel->num_timers > 0 && wheel->current_tick <= now_tick)
+    {
+        for(timer_entry *entry = wheel->slots[wheel->current_tick & TIMER_WHEEL_MASK]; entry != NULL; entry = entry->next)
+        {
+            if(entry->expires_tick <= now_tick)
+            {
+                unlink_timer(wheel, entry);
+                return entry;
+            }
+        }
+        wheel->current_tick++;
+    }
+    return NULL;
+}
+
+uint64_t timer_wheel_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * MS_PER_SECOND) + ((uint64_t)now.tv_nsec / NS_PER_MS);
+}
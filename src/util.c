@@ -0,0 +1,16 @@
+#include "../include/util.h"
+#include <signal.h>
+
+int start_background_thread(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+    sigset_t all_signals;
+    sigset_t previous_mask;
+    int      result;
+
+    // the mask is inherited, the calling thread gets its own back right after
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &previous_mask);
+    result = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+    return result;
+}